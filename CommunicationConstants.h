@@ -1,15 +1,44 @@
 #ifndef _COMMUNICATIONCONSTANTS_H
 
 #define _COMMUNICATIONCONSTANTS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
 // Error codes
 static const int RPC_ERROR_TOO_MANY_ARGS = -1;
 static const int RPC_ERROR_TOO_FEW_ARGS = -2;
 static const int RPC_ERROR_BAD_OPERATION = -3;
+static const int RPC_ERROR_BUSY = -4;          // The server is at capacity; retry later
 
 // Operations to marshall with user input
 static const char RPC_SEARCH_OPERATION[] = "SEARCH"; // search for mp3s using term
 static const char RPC_DOWNLOAD_OPERATION[] = "DOWNLOAD"; // download mp3
 static const char RPC_LIST_OPERATION[] = "LIST"; // list all mp3s available
+static const char RPC_HASH_OPERATION[] = "HASH"; // get the SHA-256 hash of an mp3 without downloading it
+static const char RPC_RANGE_OPERATION[] = "RANGE"; // download part of an mp3: RANGE <offset> <length> <name>
+static const char RPC_KEEPALIVE_OPERATION[] = "KEEPALIVE"; // keep the connection open for more requests
+
+// DOWNLOAD and RANGE can be made conditional by putting "IF-NONE-MATCH <hex SHA-256>"
+// before the name. If the file still has that hash, the reply is "not modified"
+// with no body, so a client with a current copy pays one round trip.
+static const char RPC_IF_NONE_MATCH[] = "IF-NONE-MATCH";
+#define RPC_HASH_SIZE 32
+
+// DOWNLOAD, RANGE and HASH can ask for the file's block hashes by putting "BLOCKS"
+// before the name and any condition. A framed reply then carries the root and leaves
+// of a Merkle tree over RPC_BLOCK_SIZE blocks of the whole file (see blockhash.h)
+// ahead of its body, so each block can be checked as it arrives and a bad one
+// fetched again on its own. Text replies never carry them.
+static const char RPC_BLOCK_HASHES[] = "BLOCKS";
+#define RPC_BLOCK_SIZE (64 * 1024)
+
+// Successful reply headers:
+// RANGE:     OK <file size> <offset> <length>, then the bytes, then the whole file's hash
+// KEEPALIVE: OK <max requests> <idle timeout in seconds>
+static const char RPC_OK[] = "OK";
+// Conditional DOWNLOAD or RANGE whose hash matched: NOTMODIFIED <file size>
+static const char RPC_NOT_MODIFIED[] = "NOTMODIFIED";
 
 // RPC Error messages
 static const char ERROR_FILE_ERROR[] = "FILEERROR";
@@ -17,6 +46,107 @@ static const char ERROR_RPC_ERROR[] = "RPCERROR";
 
 static const int DEFAULT_PORT = 8080;
 
+// Framed protocol (version 2). Clients that offer this name through TLS ALPN get
+// framed replies; clients that offer nothing get the version 1 text replies above.
+// Requests are the same text in both versions.
+#define RPC_ALPN_PROTOCOL "mp3rpc/2"
+static const unsigned char RPC_ALPN_PROTOCOLS[] = "\x08" RPC_ALPN_PROTOCOL; // ALPN wire format
+static const uint32_t RPC_FRAME_MAGIC = 0x4D503352; // "MP3R"
+static const uint8_t RPC_FRAME_VERSION = 2;
+
+// Every version 2 reply starts with this header, in network byte order, followed by
+// body_length bytes of body and then, with RPC_FLAG_HASH_TRAILER, the SHA-256 hash
+// of the whole file. With RPC_FLAG_BLOCK_HASHES, the block hashes of the whole file
+// come between the header and the body: the root, then one leaf per block for
+// file_size bytes. body_length does not count them.
+#define RPC_FRAME_HEADER_SIZE 40
+#define RPC_FLAG_HASH_TRAILER 0x0001
+#define RPC_FLAG_BLOCK_HASHES 0x0002
+
+enum rpc_status {
+    RPC_STATUS_OK = 0,
+    RPC_STATUS_FILE_ERROR = 1, // error holds an errno value
+    RPC_STATUS_RPC_ERROR = 2,  // error holds one of the RPC_ERROR codes
+    RPC_STATUS_NOT_MODIFIED = 3 // Conditional request: the client's copy is current, no body
+};
+
+struct rpc_frame_header {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t status;       // enum rpc_status
+    uint16_t flags;
+    uint64_t body_length; // Bytes of body that follow the header
+    uint64_t file_size;   // DOWNLOAD and RANGE: size of the whole file
+    uint64_t offset;      // RANGE: where in the file the body starts
+    int32_t error;        // Error code when status is not RPC_STATUS_OK
+    uint32_t reserved;
+};
+
+static inline void rpc_put_bytes(unsigned char *where, uint64_t value, int size) {
+    for (int i = size - 1; i >= 0; i--) {
+        where[i] = (unsigned char)value;
+        value >>= 8;
+    }
+}
+
+static inline uint64_t rpc_get_bytes(const unsigned char *where, int size) {
+    uint64_t value = 0;
+    for (int i = 0; i < size; i++) {
+        value = (value << 8) | where[i];
+    }
+    return value;
+}
+
+static inline void rpc_frame_encode(const struct rpc_frame_header *header, unsigned char wire[RPC_FRAME_HEADER_SIZE]) {
+    rpc_put_bytes(wire, header->magic, 4);
+    wire[4] = header->version;
+    wire[5] = header->status;
+    rpc_put_bytes(wire + 6, header->flags, 2);
+    rpc_put_bytes(wire + 8, header->body_length, 8);
+    rpc_put_bytes(wire + 16, header->file_size, 8);
+    rpc_put_bytes(wire + 24, header->offset, 8);
+    rpc_put_bytes(wire + 32, (uint32_t)header->error, 4);
+    rpc_put_bytes(wire + 36, header->reserved, 4);
+}
+
+// Returns false if the bytes are not a version 2 header
+static inline bool rpc_frame_decode(const unsigned char wire[RPC_FRAME_HEADER_SIZE], struct rpc_frame_header *header) {
+    header->magic = (uint32_t)rpc_get_bytes(wire, 4);
+    header->version = wire[4];
+    header->status = wire[5];
+    header->flags = (uint16_t)rpc_get_bytes(wire + 6, 2);
+    header->body_length = rpc_get_bytes(wire + 8, 8);
+    header->file_size = rpc_get_bytes(wire + 16, 8);
+    header->offset = rpc_get_bytes(wire + 24, 8);
+    header->error = (int32_t)(uint32_t)rpc_get_bytes(wire + 32, 4);
+    header->reserved = (uint32_t)rpc_get_bytes(wire + 36, 4);
+    return header->magic == RPC_FRAME_MAGIC && header->version == RPC_FRAME_VERSION;
+}
+
+// Hashes travel as 64 lowercase hex digits in requests
+static inline void rpc_hash_to_hex(const unsigned char hash[RPC_HASH_SIZE], char hex[2 * RPC_HASH_SIZE + 1]) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < RPC_HASH_SIZE; i++) {
+        hex[2 * i] = digits[hash[i] >> 4];
+        hex[2 * i + 1] = digits[hash[i] & 0x0f];
+    }
+    hex[2 * RPC_HASH_SIZE] = '\0';
+}
+
+// Returns false unless 'hex' starts with 64 hex digits
+static inline bool rpc_hash_from_hex(const char *hex, unsigned char hash[RPC_HASH_SIZE]) {
+    for (int i = 0; i < 2 * RPC_HASH_SIZE; i++) {
+        char c = hex[i];
+        int value = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                    c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (value < 0) {
+            return false;
+        }
+        hash[i / 2] = i % 2 ? (hash[i / 2] | value) : value << 4;
+    }
+    return true;
+}
+
 
 
 #endif
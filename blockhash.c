@@ -0,0 +1,180 @@
+/**
+* @file blockhash.c
+* @author Corey Brantley, Shen Knoll, Harrison Sherwin
+* @brief  Block hashes for DOWNLOAD and RANGE. A file is cut into fixed-size blocks
+*         and each block gets a digest of its own, so a client can check a block
+*         the moment it has it and fetch again only the blocks that turn out bad,
+*         instead of finding out at the end that the whole file has to go. The
+*         digests are the leaves of a Merkle tree whose root checks them in turn.
+*
+*         Shared by the server, which builds the trees (see library.c), and the
+*         client, which checks blocks against them. The digests go through EVP
+*         with the SHA-256 implementation fetched once, so OpenSSL picks the
+*         fastest code the CPU runs (SHA-NI, AVX2 or plain) and no lookup is
+*         repeated per block.
+*/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blockhash.h"
+
+#define LEAF_PREFIX 0x00 // Leaves and nodes hash differently, so one cannot pass for the other
+#define NODE_PREFIX 0x01
+
+static EVP_MD *sha256;
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+
+static void fetch_sha256(void) {
+    sha256 = EVP_MD_fetch(NULL, "SHA256", NULL);
+}
+
+/**
+ * @brief Number of blocks in a file of 'size' bytes. The last block may be short.
+ */
+size_t block_count(uint64_t size) {
+    return (size + RPC_BLOCK_SIZE - 1) / RPC_BLOCK_SIZE;
+}
+
+/**
+ * @brief Start a plain SHA-256 digest with the same implementation, for callers
+ *        that hash the whole file alongside its blocks.
+ *
+ * @return true if the digest was started.
+ */
+bool block_digest_init(EVP_MD_CTX *ctx) {
+    pthread_once(&sha256_once, fetch_sha256);
+    return sha256 != NULL && EVP_DigestInit_ex(ctx, sha256, NULL) == 1;
+}
+
+/**
+ * @brief Start the digest of one leaf, for callers that have its block in pieces.
+ *        Feed the block with EVP_DigestUpdate() and finish with EVP_DigestFinal_ex().
+ *
+ * @return true if the digest was started.
+ */
+bool block_leaf_init(EVP_MD_CTX *ctx) {
+    unsigned char prefix = LEAF_PREFIX;
+
+    pthread_once(&sha256_once, fetch_sha256);
+    return sha256 != NULL && EVP_DigestInit_ex(ctx, sha256, NULL) == 1 &&
+           EVP_DigestUpdate(ctx, &prefix, 1) == 1;
+}
+
+/**
+ * @brief Compute the leaf digest of one block.
+ */
+void block_hash_leaf(const void *data, size_t length, unsigned char leaf[BLOCK_HASH_SIZE]) {
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+
+    if (ctx == NULL || !block_leaf_init(ctx) || EVP_DigestUpdate(ctx, data, length) != 1 ||
+        EVP_DigestFinal_ex(ctx, leaf, NULL) != 1) {
+        memset(leaf, 0, BLOCK_HASH_SIZE); // Matches no block, so the block is fetched again
+    }
+    EVP_MD_CTX_free(ctx);
+}
+
+/**
+ * @brief Compute the root of the tree over a list of leaves. An empty file has one
+ *        empty block's leaf as its root.
+ *
+ * @return true on success, false if memory or the digest ran out.
+ */
+bool block_hash_root(const unsigned char (*leaves)[BLOCK_HASH_SIZE], size_t count,
+                     unsigned char root[BLOCK_HASH_SIZE]) {
+    unsigned char (*level)[BLOCK_HASH_SIZE];
+    unsigned char prefix = NODE_PREFIX;
+    EVP_MD_CTX *ctx;
+    bool ok = true;
+
+    if (count == 0) {
+        block_hash_leaf("", 0, root);
+        return true;
+    }
+    level = malloc(count * BLOCK_HASH_SIZE);
+    ctx = EVP_MD_CTX_new();
+    if (level == NULL || ctx == NULL) {
+        free(level);
+        EVP_MD_CTX_free(ctx);
+        return false;
+    }
+    memcpy(level, leaves, count * BLOCK_HASH_SIZE);
+    pthread_once(&sha256_once, fetch_sha256);
+
+    // Each pass pairs up the nodes of one level into the level above, in place
+    while (ok && count > 1) {
+        size_t parents = 0;
+
+        for (size_t i = 0; ok && i < count; i += 2, parents++) {
+            if (i + 1 == count) {
+                memmove(level[parents], level[i], BLOCK_HASH_SIZE);
+                continue;
+            }
+            ok = sha256 != NULL && EVP_DigestInit_ex(ctx, sha256, NULL) == 1 &&
+                 EVP_DigestUpdate(ctx, &prefix, 1) == 1 &&
+                 EVP_DigestUpdate(ctx, level[i], 2 * BLOCK_HASH_SIZE) == 1 &&
+                 EVP_DigestFinal_ex(ctx, level[parents], NULL) == 1;
+        }
+        count = parents;
+    }
+    if (ok) {
+        memcpy(root, level[0], BLOCK_HASH_SIZE);
+    }
+
+    EVP_MD_CTX_free(ctx);
+    free(level);
+    return ok;
+}
+
+/**
+ * @brief Allocate a tree for a file of 'size' bytes, with one reference held by
+ *        the caller. The leaves and root are left for the caller to fill in.
+ */
+struct block_tree *block_tree_create(uint64_t size) {
+    size_t count = block_count(size);
+    struct block_tree *tree = malloc(sizeof(*tree) + count * BLOCK_HASH_SIZE);
+
+    if (tree != NULL) {
+        atomic_init(&tree->references, 1);
+        tree->size = size;
+        tree->count = count;
+    }
+    return tree;
+}
+
+/**
+ * @brief Build the tree for a file that is already in memory.
+ *
+ * @return The tree, or NULL if it could not be built.
+ */
+struct block_tree *block_tree_hash_memory(const unsigned char *data, uint64_t size) {
+    struct block_tree *tree = block_tree_create(size);
+
+    if (tree == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < tree->count; i++) {
+        uint64_t start = (uint64_t)i * RPC_BLOCK_SIZE;
+        block_hash_leaf(data + start, size - start < RPC_BLOCK_SIZE ? size - start : RPC_BLOCK_SIZE,
+                        tree->leaves[i]);
+    }
+    if (!block_hash_root((const unsigned char (*)[BLOCK_HASH_SIZE])tree->leaves, tree->count, tree->root)) {
+        block_tree_release(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+struct block_tree *block_tree_retain(struct block_tree *tree) {
+    if (tree != NULL) {
+        atomic_fetch_add_explicit(&tree->references, 1, memory_order_relaxed);
+    }
+    return tree;
+}
+
+void block_tree_release(struct block_tree *tree) {
+    if (tree != NULL && atomic_fetch_sub_explicit(&tree->references, 1, memory_order_acq_rel) == 1) {
+        free(tree);
+    }
+}
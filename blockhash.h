@@ -0,0 +1,39 @@
+#ifndef _BLOCKHASH_H
+#define _BLOCKHASH_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <openssl/evp.h>
+
+#include "CommunicationConstants.h"
+
+#define BLOCK_HASH_SIZE RPC_HASH_SIZE
+
+// A Merkle tree over a file cut into RPC_BLOCK_SIZE blocks. Each leaf is
+// SHA-256(0x00 || block) and each node above them SHA-256(0x01 || left || right);
+// a node without a sibling moves up a level unchanged. Only the leaves and the root
+// are kept: the leaves are what a block is checked against, and the root checks
+// the leaves. Trees are shared between readers and freed with their last reference.
+struct block_tree {
+    atomic_int references;
+    uint64_t size;            // Size of the file the tree covers
+    size_t count;             // Number of blocks, and of leaves
+    unsigned char root[BLOCK_HASH_SIZE];
+    unsigned char leaves[][BLOCK_HASH_SIZE];
+};
+
+size_t block_count(uint64_t size);
+bool block_digest_init(EVP_MD_CTX *ctx);
+bool block_leaf_init(EVP_MD_CTX *ctx);
+void block_hash_leaf(const void *data, size_t length, unsigned char leaf[BLOCK_HASH_SIZE]);
+bool block_hash_root(const unsigned char (*leaves)[BLOCK_HASH_SIZE], size_t count,
+                     unsigned char root[BLOCK_HASH_SIZE]);
+struct block_tree *block_tree_create(uint64_t size);
+struct block_tree *block_tree_hash_memory(const unsigned char *data, uint64_t size);
+struct block_tree *block_tree_retain(struct block_tree *tree);
+void block_tree_release(struct block_tree *tree);
+
+#endif
@@ -1,5 +1,7 @@
 // So far this is just a copy of my code from Assignment 4.
 
+#define _GNU_SOURCE // fallocate()
+
 /**
 * @file client.c
 * @author Corey Brantley, Shen Knoll, Harrison Sherwin
@@ -32,6 +34,10 @@
 #include <pthread.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <time.h>
+#include <signal.h>
+#include <stdint.h>
+#include <getopt.h>
 
 #include <openssl/sha.h>
 #include <openssl/bio.h>
@@ -43,6 +49,8 @@
 
 #include "CommunicationConstants.h"
 #include "playaudio.h"
+#include "downloadpipe.h"
+#include "blockhash.h"
 
 // Global statics
 #define DEFAULT_HOST        "localhost"
@@ -50,15 +58,33 @@
 #define BUFFER_SIZE         256
 #define HASH_SIZE SHA256_DIGEST_LENGTH
 #define DEFAULT_DOWNLOAD_LOCATION "downloaded-mp3s"
+#define HASH_MANIFEST DEFAULT_DOWNLOAD_LOCATION "/.hashes" // Hashes of downloaded files
 #define LIST_MP3S 1
 #define SEARCH_MP3S 2
 #define DOWNLOAD_MP3 3
 #define PLAY_MP3 4
 #define STOP_MP3 5
+#define VALIDATE_MP3 6
+#define STREAM_MP3 7
+#define PAUSE_MP3 8
+#define SEEK_MP3 9
+#define RESUME_MP3 10
 #define QUIT_PROGRAM 0
 #define MAX_FILES 50
 #define MAX_RETRIES 3
-
+#define DOWNLOAD_BUFFER_SIZE (16 * 1024)
+#define SSL_READ_AHEAD_SIZE (128 * 1024)
+#define MAX_STREAMS 16
+#define PARALLEL_RANGE_SIZE (1024 * 1024) // Largest piece of a file one stream fetches at a time
+#define DEFAULT_TRANSFERS 4 // Files a mirror downloads at once
+#define MAX_TRANSFERS 32
+#define DEFAULT_AUDIO_BUFFER 32 // Blocks of decoded audio between the decoder and the device
+#define MAX_AUDIO_BUFFER 4096
+#define MAX_FORMATTED_TIME (100 * 3600 - 1) // Seconds; longer times show as 5999:59
+#define SESSION_CACHE_SIZE 8    // Session tickets kept for resuming connections
+#define MAX_ADDRESSES 8         // Addresses kept for the server's name
+#define ADDRESS_CACHE_TTL 300   // Seconds before the server's name is looked up again
+#define TICKET_WAIT 2           // Seconds to wait for the ticket after an early-data reply
 
 struct SSL_Connection
 {
@@ -69,77 +95,374 @@ struct SSL_Connection
   char remote_host[MAX_HOSTNAME_LENGTH];
   unsigned int port;
   int connected;
+  // Keep-alive: one connection carries several requests
+  int keepAlive;          // The server agreed to keep this connection open
+  int keepAliveRefused;   // The server does not do keep-alive, so stop asking
+  int requestsLeft;       // Requests the server will still take on this connection
+  int idleTimeout;        // Seconds the server keeps an idle connection open
+  time_t idleDeadline;    // After this, assume the server has closed the connection
+  // The reply being read (see CommunicationConstants.h)
+  struct rpc_frame_header reply;
+  uint64_t bodyLeft;      // Bytes of the reply's body not read yet
+  int trailerLeft;        // Bytes of the hash trailer not read yet
+  uint64_t fetched;       // Bytes of MP3s downloaded through this connection
+  // Resumption and early data (TLS 1.3 0-RTT)
+  int earlyData;          // The request went out as early data and was accepted
+  int ticketSaved;        // The server has sent a session ticket on this connection
+};
+
+// The server's addresses, IPv6 and IPv4 alike, so each new connection does not wait
+// on the resolver. They are looked up again once they are ADDRESS_CACHE_TTL seconds
+// old, or when none of them takes a connection.
+static struct {
+  pthread_mutex_t lock;
+  char host[MAX_HOSTNAME_LENGTH];
+  unsigned int port;
+  struct sockaddr_storage addresses[MAX_ADDRESSES];
+  socklen_t lengths[MAX_ADDRESSES];
+  int count;
+  time_t expires;
+} addressCache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Session tickets from the server, newest last. Each one resumes a single
+// connection, as TLS 1.3 asks of clients; the server sends new ones every time.
+static struct {
+  pthread_mutex_t lock;
+  SSL_SESSION *sessions[SESSION_CACHE_SIZE];
+  int count;
+} sessionCache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// A file the client has downloaded and hashed. While its size and modification
+// time are unchanged it still has that hash, so it is not hashed again on the next
+// start just to ask the server whether it is current.
+struct ManifestEntry
+{
+  char *fileName;
+  unsigned char hash[HASH_SIZE];
+  off_t size;
+  struct timespec mtime;
 };
 
 
+void close_ssl_connection(struct SSL_Connection *ssl_connection);
+int sendRequest(struct SSL_Connection *ssl_connection, const char *request);
+int readReply(struct SSL_Connection *ssl_connection, void *buffer, int size);
+int readTrailer(struct SSL_Connection *ssl_connection, unsigned char hash[HASH_SIZE]);
+unsigned char *readBlockHashes(struct SSL_Connection *ssl_connection);
+void printServerError(const struct rpc_frame_header *reply);
+void finishRequest(struct SSL_Connection *ssl_connection);
 void requestAvailableDownloads(struct SSL_Connection *ssl_connection, const char rpc_operation[9]);
 void searchAvailableDownloads(struct SSL_Connection *ssl_connection);
-int downloadMP3(struct SSL_Connection *ssl_connection);
-int playMP3(char *fileName, pthread_t *ptid);
+void promptDownloadName(char *fileName);
+int downloadMP3(struct SSL_Connection *ssl_connection, const char *fileName, struct audio_stream *stream);
+int downloadMP3Parallel(struct SSL_Connection *ssl_connection, const char *fileName, int streams);
+int downloadWithRetries(struct SSL_Connection *ssl_connection, const char *fileName, int streams);
+int requestHash(struct SSL_Connection *ssl_connection, const char *fileName, unsigned char hash[HASH_SIZE]);
+int mirrorCatalog(struct SSL_Connection *ssl_connection, const char *searchTerm, int transfers, int streams);
+int hashFile(const char *path, unsigned char hash[HASH_SIZE]);
+size_t findDamagedBlocks(const char *path, const unsigned char *leaves, uint64_t fileSize, size_t **bad);
+int refetchBlocks(struct SSL_Connection *ssl_connection, const char *fileName, const char *path,
+                  const unsigned char *leaves, uint64_t fileSize, const size_t *bad, size_t badCount);
+int manifestLookup(const char *fileName, unsigned char hash[HASH_SIZE]);
+void manifestRecord(const char *fileName, const unsigned char hash[HASH_SIZE]);
+int playMP3(const char *fileName, double start);
+int seekMP3();
+void formatTime(double seconds, char *text, size_t size);
+int streamMP3(struct SSL_Connection *ssl_connection, const char *fileName, pthread_t *ptid);
 int promptUser();
 int chooseFromDownloadedMP3s(char *fileChoice);
 void printDownloadedChoices(char *fileNames[MAX_FILES], int fileCount);
 int stopMP3(pthread_t *ptid);
+void printPlaybackStats();
+int validateMP3(struct SSL_Connection *ssl_connection, char *fileChoice);
+
+atomic_int stopStreaming = 1; // Set to stop the streaming playback thread; 0 while it runs
+struct audio_player *player;  // Plays the queue of downloaded MP3s, started by the first PLAY
+int audioBuffer = DEFAULT_AUDIO_BUFFER;
+char resumeFile[BUFFER_SIZE]; // The track the last STOP interrupted, and where, for RESUME
+double resumeAt;
+int showProgress = 1; // Off when several downloads run at once and would print over each other
+
+// The hash manifest, read from HASH_MANIFEST the first time it is needed
+struct ManifestEntry *manifest;
+int manifestCount;
+int manifestLoaded;
+pthread_mutex_t mutexManifest = PTHREAD_MUTEX_INITIALIZER;
+
+// One piece of a parallel download
+struct ByteRange
+{
+  uint64_t offset;
+  uint64_t length;
+  int state;    // RANGE_PENDING, RANGE_ACTIVE or RANGE_DONE
+  int attempts; // Times it has failed
+};
+#define RANGE_PENDING 0
+#define RANGE_ACTIVE  1
+#define RANGE_DONE    2
 
-int *stopPlaying;
-pthread_mutex_t mutexPlaying;
+// A file being fetched over several connections at once. Each stream thread takes
+// the next pending range, fetches it and writes it in place with pwrite().
+struct ParallelDownload
+{
+  pthread_mutex_t lock;
+  pthread_cond_t changed;       // Signalled when a range finishes or fails
+  const struct SSL_Connection *server; // Host, port and SSL context to connect with
+  const char *fileName;
+  int fd;
+  uint64_t fileSize;
+  unsigned char hash[HASH_SIZE]; // Server's hash of the whole file
+  struct ByteRange *ranges;
+  int rangeCount;
+  int rangesLeft;
+  int failed;                   // A range failed too often; every stream stops
+  uint64_t received;            // Bytes on disk, for the progress display
+  int percent;
+};
+
+// Mirroring the catalog, or a search result, into the download folder. Each
+// transfer thread has its own connection and takes the next name on the list.
+struct Mirror
+{
+  pthread_mutex_t lock;
+  const struct SSL_Connection *server;
+  char **names;
+  int nameCount;
+  int next;          // Next name to take
+  int streams;       // Connections per file
+  int downloaded;
+  int upToDate;      // Skipped because the local hash already matches
+  int failed;
+  uint64_t received; // Bytes fetched from the server
+};
+
+/**
+* @brief Get the addresses 'hostname' resolves to, from the cache unless they are
+*        stale, for another host, or 'refresh' is set. getaddrinfo() rather than
+*        gethostbyname(), because parallel downloads connect from several threads at
+*        once, and it finds IPv6 addresses as well as IPv4 ones. Sets 'looked' if
+*        the name was looked up just now. Returns how many addresses there are.
+*/
+int resolveHost(const char *hostname, unsigned int port, struct sockaddr_storage *addresses,
+                socklen_t *lengths, int refresh, int *looked) {
+  struct addrinfo  hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_ADDRCONFIG };
+  struct addrinfo* host;
+  struct addrinfo* entry;
+  char             service[16];
+  int              count;
+
+  pthread_mutex_lock(&addressCache.lock);
+  *looked = 0;
+  if (refresh || addressCache.count == 0 || time(NULL) >= addressCache.expires ||
+      addressCache.port != port || strcmp(addressCache.host, hostname) != 0) {
+    *looked = 1;
+    addressCache.count = 0;
+    snprintf(service, sizeof(service), "%u", port);
+    if (getaddrinfo(hostname, service, &hints, &host) == 0) {
+      for (entry = host; entry != NULL && addressCache.count < MAX_ADDRESSES; entry = entry->ai_next) {
+        memcpy(&addressCache.addresses[addressCache.count], entry->ai_addr, entry->ai_addrlen);
+        addressCache.lengths[addressCache.count++] = entry->ai_addrlen;
+      }
+      freeaddrinfo(host);
+    }
+    snprintf(addressCache.host, sizeof(addressCache.host), "%s", hostname);
+    addressCache.port = port;
+    addressCache.expires = time(NULL) + ADDRESS_CACHE_TTL;
+  }
+  count = addressCache.count;
+  memcpy(addresses, addressCache.addresses, count * sizeof(*addresses));
+  memcpy(lengths, addressCache.lengths, count * sizeof(*lengths));
+  pthread_mutex_unlock(&addressCache.lock);
+  return count;
+}
 
 /**
 * @brief This function does the basic necessary housekeeping to establish a secure TCP
-*        connection to the server specified by 'hostname'.
+*        connection to the server specified by 'hostname'. Each of the server's
+*        addresses is tried in the order the resolver gave them.
 */
 int create_socket(char* hostname, unsigned int port) {
-  int                sockfd;
-  struct hostent*    host;
-  struct sockaddr_in dest_addr;
+  struct sockaddr_storage addresses[MAX_ADDRESSES];
+  socklen_t               lengths[MAX_ADDRESSES];
+  int                     count = 0;
+  int                     looked = 0;
+  int                     sockfd;
+  int                     error = 0;
+
+  // Try the cached addresses first, then look the name up again in case the
+  // server has moved
+  for (int refresh = 0; refresh < 2 && !(refresh && looked); refresh++) {
+    count = resolveHost(hostname, port, addresses, lengths, refresh, &looked);
+    for (int i = 0; i < count; i++) {
+      // Create a socket (endpoint) for network communication. Sockets are blocking
+      // by default, which suits this client.
+      sockfd = socket(addresses[i].ss_family, SOCK_STREAM, 0);
+      if (sockfd < 0) {
+        error = errno;
+        continue;
+      }
+      if (connect(sockfd, (struct sockaddr *)&addresses[i], lengths[i]) == 0) {
+        return sockfd;
+      }
+      error = errno;
+      close(sockfd);
+    }
+  }
 
-  host = gethostbyname(hostname);
-  if (host == NULL) {
+  if (count == 0) {
     fprintf(stderr, "Client: Cannot resolve hostname %s\n",  hostname);
-    exit(EXIT_FAILURE);
+  } else {
+    fprintf(stderr, "Client: Cannot connect to host %s on port %d: %s\n", hostname, port, strerror(error));
   }
+  return -1;
+}
 
-  // Create a socket (endpoint) for network communication.  The socket()
-  // call returns a socket descriptor, which works exactly like a file
-  // descriptor for file system operations we worked with in CS431
-  //
-  // Sockets are by default blocking, so the server will block while reading
-  // from or writing to a socket. For most applications this is acceptable.
-  sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (sockfd < 0) {
-    fprintf(stderr, "Server: Unable to create socket: %s", strerror(errno));
-    exit(EXIT_FAILURE);
+/**
+* @brief OpenSSL callback for each session ticket the server sends: keep it to
+*        resume a later connection. Returns 1 because the cache keeps the reference.
+*/
+int saveSession(SSL *ssl, SSL_SESSION *session) {
+  struct SSL_Connection *ssl_connection = SSL_get_app_data(ssl);
+
+  pthread_mutex_lock(&sessionCache.lock);
+  if (sessionCache.count == SESSION_CACHE_SIZE) {
+    SSL_SESSION_free(sessionCache.sessions[0]);
+    memmove(sessionCache.sessions, sessionCache.sessions + 1, (SESSION_CACHE_SIZE - 1) * sizeof(SSL_SESSION *));
+    sessionCache.count--;
+  }
+  sessionCache.sessions[sessionCache.count++] = session;
+  pthread_mutex_unlock(&sessionCache.lock);
+  if (ssl_connection != NULL) {
+    ssl_connection->ticketSaved = 1;
   }
+  return 1;
+}
 
-  // First we set up a network socket. An IP socket address is a combination
-  // of an IP interface address plus a 16-bit port number. The struct field
-  // sin_family is *always* set to AF_INET. Anything else returns an error.
-  // The TCP port is stored in sin_port, but needs to be converted to the
-  // format on the host machine to network byte order, which is why htons()
-  // is called. The s_addr field is the network address of the remote host
-  // specified on the command line. The earlier call to gethostbyname()
-  // retrieves the IP address for the given hostname.
-  dest_addr.sin_family=AF_INET;
-  dest_addr.sin_port=htons(port);
-  dest_addr.sin_addr.s_addr = *(long*)(host->h_addr);
-
-  // Now we connect to the remote host.  We pass the connect() system call the
-  // socket descriptor, the address of the remote host, and the size in bytes
-  // of the remote host's address
-  if (connect(sockfd, (struct sockaddr *) &dest_addr,
-	      sizeof(struct sockaddr)) <0) {
-    fprintf(stderr, "Client: Cannot connect to host %s [%s] on port %d: %s\n",
-	    hostname, inet_ntoa(dest_addr.sin_addr), port, strerror(errno));
-    exit(EXIT_FAILURE);
+/**
+* @brief Whether a session is still worth offering to the server.
+*/
+int sessionUsable(SSL_SESSION *session) {
+  return SSL_SESSION_is_resumable(session) &&
+         SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) > time(NULL);
+}
+
+/**
+* @brief Take the newest usable session out of the cache, or NULL if there is none.
+*/
+SSL_SESSION *takeSession(void) {
+  SSL_SESSION *session = NULL;
+
+  pthread_mutex_lock(&sessionCache.lock);
+  while (session == NULL && sessionCache.count > 0) {
+    session = sessionCache.sessions[--sessionCache.count];
+    if (!sessionUsable(session)) {
+      SSL_SESSION_free(session);
+      session = NULL;
+    }
+  }
+  pthread_mutex_unlock(&sessionCache.lock);
+  return session;
+}
+
+/**
+* @brief Whether the next connection can send 'request' as early data: the newest
+*        session allows that much of it.
+*/
+int earlyDataAllowed(const char *request) {
+  int allowed = 0;
+
+  pthread_mutex_lock(&sessionCache.lock);
+  if (sessionCache.count > 0) {
+    SSL_SESSION *session = sessionCache.sessions[sessionCache.count - 1];
+    allowed = sessionUsable(session) && SSL_SESSION_get_max_early_data(session) >= strlen(request);
+  }
+  pthread_mutex_unlock(&sessionCache.lock);
+  return allowed;
+}
+
+/**
+* @brief Whether a request only reads, so a copy replayed from early data would do
+*        no harm: LIST and SEARCH.
+*/
+int isReadOnlyRequest(const char *request) {
+  size_t length = strcspn(request, " ");
+
+  return (length == strlen(RPC_LIST_OPERATION) && strncmp(request, RPC_LIST_OPERATION, length) == 0) ||
+         (length == strlen(RPC_SEARCH_OPERATION) && strncmp(request, RPC_SEARCH_OPERATION, length) == 0);
+}
+
+/**
+* @brief Read exactly 'size' bytes from the connection.
+*/
+int readExact(SSL *ssl, void *buffer, int size) {
+  int total = 0;
+  int rcount;
+
+  while (total < size && (rcount = SSL_read(ssl, (char *)buffer + total, size - total)) > 0) {
+    total += rcount;
+  }
+  return total == size ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+* @brief Read and check the header that starts every reply, and get ready to read
+*        the body and trailer that follow it.
+*/
+int readReplyHeader(struct SSL_Connection *ssl_connection) {
+  unsigned char wire[RPC_FRAME_HEADER_SIZE];
+
+  ssl_connection->bodyLeft = 0;
+  ssl_connection->trailerLeft = 0;
+  if (readExact(ssl_connection->ssl, wire, sizeof(wire)) != EXIT_SUCCESS ||
+      !rpc_frame_decode(wire, &ssl_connection->reply)) {
+    return EXIT_FAILURE;
+  }
+  ssl_connection->bodyLeft = ssl_connection->reply.body_length;
+  if (ssl_connection->reply.flags & RPC_FLAG_HASH_TRAILER) {
+    ssl_connection->trailerLeft = HASH_SIZE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+* @brief Ask the server to keep the connection open for more requests. A server with
+*        keep-alive turned off answers with an error and closes the connection.
+*/
+int requestKeepAlive(struct SSL_Connection *ssl_connection) {
+  char limits[BUFFER_SIZE];
+  int length;
+
+  if (SSL_write(ssl_connection->ssl, RPC_KEEPALIVE_OPERATION, strlen(RPC_KEEPALIVE_OPERATION)) <= 0 ||
+      readReplyHeader(ssl_connection) != EXIT_SUCCESS ||
+      ssl_connection->reply.status != RPC_STATUS_OK ||
+      ssl_connection->reply.body_length >= sizeof(limits) ||
+      readExact(ssl_connection->ssl, limits, ssl_connection->reply.body_length) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
   }
 
-  return sockfd;
+  // The body is: <max requests> <idle timeout>
+  length = ssl_connection->reply.body_length;
+  limits[length] = '\0';
+  ssl_connection->bodyLeft = 0;
+  if (sscanf(limits, "%d %d", &ssl_connection->requestsLeft, &ssl_connection->idleTimeout) != 2) {
+    return EXIT_FAILURE;
+  }
+  ssl_connection->keepAlive = 1;
+  ssl_connection->idleDeadline = time(NULL) + ssl_connection->idleTimeout - 1;
+  return EXIT_SUCCESS;
 }
 
-void initialize_connection(struct SSL_Connection *ssl_connection) {
+/**
+* @brief Set up the SSL context once. Every connection, including the parallel
+*        download streams, is created from it.
+*/
+void initialize_context(struct SSL_Connection *ssl_connection) {
+  if (ssl_connection->ssl_ctx != NULL) {
+    return;
+  }
+
   // Initialize OpenSSL ciphers and digests
   OpenSSL_add_all_algorithms();
-  printf("\n");
   // SSL_library_init() registers the available SSL/TLS ciphers and digests.
   if(SSL_library_init() < 0) {
     fprintf(stderr, "Client: Could not initialize the OpenSSL library!\n");
@@ -160,16 +483,59 @@ void initialize_connection(struct SSL_Connection *ssl_connection) {
   // to be negotiated between client and server
   SSL_CTX_set_options(ssl_connection->ssl_ctx, SSL_OP_NO_SSLv2);
 
-  // Create a new SSL connection state object
+  // Let each recv() pull in several TLS records at once instead of a record header
+  // and then its body
+  SSL_CTX_set_read_ahead(ssl_connection->ssl_ctx, 1);
+  SSL_CTX_set_default_read_buffer_len(ssl_connection->ssl_ctx, SSL_READ_AHEAD_SIZE);
+
+  // Keep the session tickets the server sends, to resume later connections with an
+  // abbreviated handshake
+  SSL_CTX_set_session_cache_mode(ssl_connection->ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ssl_connection->ssl_ctx, saveSession);
+}
+
+/**
+* @brief Whether an open keep-alive connection can take another request: the server
+*        will still take requests on it and has not timed it out.
+*/
+int connectionUsable(struct SSL_Connection *ssl_connection) {
+  return ssl_connection->connected == 1 && ssl_connection->keepAlive &&
+         ssl_connection->requestsLeft > 0 && time(NULL) < ssl_connection->idleDeadline;
+}
+
+/**
+* @brief Open a TLS connection to the server, resuming a saved session if there is
+*        one. Given 'earlyRequest', a session that allows it sends the request as
+*        TLS 1.3 early data along with the ClientHello, and the reply comes back
+*        with the server's side of the handshake. Returns 1 if 'earlyRequest' has
+*        been sent, as early data or after the handshake if the server turned the
+*        early data down, 0 otherwise, and -1 if no connection could be opened.
+*/
+int openConnection(struct SSL_Connection *ssl_connection, const char *earlyRequest) {
+  SSL_SESSION *session = takeSession();
+  size_t written = 0;
+  int sent = 0;
+
+  // Create a new SSL connection state object, offering the framed protocol
   ssl_connection->ssl = SSL_new(ssl_connection->ssl_ctx);
+  SSL_set_alpn_protos(ssl_connection->ssl, RPC_ALPN_PROTOCOLS, sizeof(RPC_ALPN_PROTOCOLS) - 1);
+  SSL_set_app_data(ssl_connection->ssl, ssl_connection);
+  ssl_connection->ticketSaved = 0;
+  ssl_connection->earlyData = 0;
+  if (session != NULL) {
+    SSL_set_session(ssl_connection->ssl, session);
+  }
 
   // Create the underlying TCP socket connection to the remote host
   ssl_connection->sockfd = create_socket(ssl_connection->remote_host, ssl_connection->port);
-  if(ssl_connection->sockfd != 0)
+  if(ssl_connection->sockfd >= 0)
     fprintf(stderr, "Client: Established TCP connection to '%s' on port %u\n", ssl_connection->remote_host, ssl_connection->port);
   else {
     fprintf(stderr, "Client: Could not establish TCP connection to %s on port %u\n", ssl_connection->remote_host, ssl_connection->port);
-    exit(EXIT_FAILURE);
+    SSL_SESSION_free(session);
+    SSL_free(ssl_connection->ssl);
+    ssl_connection->connected = -1;
+    return -1;
   }
 
   // Bind the SSL object to the network socket descriptor. The socket descriptor
@@ -178,28 +544,255 @@ void initialize_connection(struct SSL_Connection *ssl_connection) {
   // create_socket()
   SSL_set_fd(ssl_connection->ssl, ssl_connection->sockfd);
 
+  // The request goes out in the same flight as the ClientHello
+  if (earlyRequest != NULL && session != NULL && SSL_SESSION_get_max_early_data(session) >= strlen(earlyRequest) &&
+      SSL_write_early_data(ssl_connection->ssl, earlyRequest, strlen(earlyRequest), &written) != 1) {
+    written = 0;
+  }
+  SSL_SESSION_free(session); // The SSL object holds its own reference
+
   // Initiates an SSL session over the existing socket connection. SSL_connect()
   // will return 1 if successful.
   if (SSL_connect(ssl_connection->ssl) == 1)
-    printf("Client: Established SSL/TLS session to '%s' on port %u\n", ssl_connection->remote_host, ssl_connection->port);
+    printf("Client: Established SSL/TLS session to '%s' on port %u%s\n", ssl_connection->remote_host, ssl_connection->port,
+           SSL_session_reused(ssl_connection->ssl) ? " (resumed)" : "");
   else {
     fprintf(stderr, "Client: Could not establish SSL session to '%s' on port %u\n", ssl_connection->remote_host, ssl_connection->port);
-    exit(EXIT_FAILURE);
+    SSL_free(ssl_connection->ssl);
+    close(ssl_connection->sockfd);
+    ssl_connection->connected = -1;
+    return -1;
   }
   printf("\n\n");
   ssl_connection->connected = 1;
+  ssl_connection->keepAlive = 0;
+
+  // This client only reads framed replies, which the server agrees to through ALPN
+  const unsigned char *protocol;
+  unsigned int protocolLength;
+  SSL_get0_alpn_selected(ssl_connection->ssl, &protocol, &protocolLength);
+  if (protocolLength != strlen(RPC_ALPN_PROTOCOL) || memcmp(protocol, RPC_ALPN_PROTOCOL, protocolLength) != 0) {
+    fprintf(stderr, "Client: Server '%s' does not support protocol %s, please update it\n",
+            ssl_connection->remote_host, RPC_ALPN_PROTOCOL);
+    close_ssl_connection(ssl_connection);
+    return -1;
+  }
+
+  if (earlyRequest != NULL) {
+    if (written > 0 && SSL_get_early_data_status(ssl_connection->ssl) == SSL_EARLY_DATA_ACCEPTED) {
+      printf("Client: Sent '%s' as early data\n", earlyRequest);
+      ssl_connection->earlyData = 1;
+      sent = 1;
+    } else {
+      sent = SSL_write(ssl_connection->ssl, earlyRequest, strlen(earlyRequest)) > 0;
+    }
+  }
+  return sent;
+}
+
+/**
+* @brief Make sure 'ssl_connection' has an open connection, reusing a keep-alive
+*        one while it lasts. Returns EXIT_FAILURE if no connection could be opened.
+*/
+int initialize_connection(struct SSL_Connection *ssl_connection) {
+  // Keep using an open keep-alive connection while the server will still take
+  // requests on it and has not timed it out
+  if (connectionUsable(ssl_connection)) {
+    return EXIT_SUCCESS;
+  }
+  if (ssl_connection->connected == 1) {
+    close_ssl_connection(ssl_connection);
+  }
+
+  initialize_context(ssl_connection);
+  printf("\n");
+  if (openConnection(ssl_connection, NULL) < 0) {
+    return EXIT_FAILURE;
+  }
+
+  // Ask for keep-alive. A server that refuses closes the connection, so open a
+  // plain one instead and do not ask that server again.
+  if (!ssl_connection->keepAliveRefused && requestKeepAlive(ssl_connection) != EXIT_SUCCESS) {
+    ssl_connection->keepAliveRefused = 1;
+    close_ssl_connection(ssl_connection);
+    return initialize_connection(ssl_connection);
+  }
+  return EXIT_SUCCESS;
 }
 
-// Deallocate memory for the SSL data structures and close the socket
+// Deallocate memory for the SSL data structures and close the socket. The SSL
+// context is kept for the next connection.
 void close_ssl_connection(struct SSL_Connection *ssl_connection) {
+    // After an early-data reply the server's session ticket is still on its way;
+    // read up to the server's close so the next connection can resume too
+    if (ssl_connection->earlyData && !ssl_connection->ticketSaved) {
+      struct timeval timeout = { .tv_sec = TICKET_WAIT, .tv_usec = 0 };
+      char discard[BUFFER_SIZE];
+
+      setsockopt(ssl_connection->sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      while (!ssl_connection->ticketSaved && SSL_read(ssl_connection->ssl, discard, sizeof(discard)) > 0) {
+      }
+    }
+    ssl_connection->earlyData = 0;
+    SSL_shutdown(ssl_connection->ssl);
     SSL_free(ssl_connection->ssl);
-    SSL_CTX_free(ssl_connection->ssl_ctx);
     close(ssl_connection->sockfd);
     ssl_connection->connected = -1;
+    ssl_connection->keepAlive = 0;
     printf("Client: Terminated SSL/TLS connection with server '%s'\n",
 	    ssl_connection->remote_host);
 }
 
+/**
+* @brief Open a connection if needed, send a request and read the header of the
+*        reply. If a reused keep-alive connection turns out to have been closed by
+*        the server, the request is sent again on a new one.
+*
+*        A LIST or SEARCH that needs a new connection goes out as early data on a
+*        connection of its own when the saved session allows it, so the reply
+*        arrives one round trip after the TCP connection is up.
+*/
+int sendRequest(struct SSL_Connection *ssl_connection, const char *request) {
+  int reused = ssl_connection->connected == 1;
+  int wcount;
+
+  // A request that fails before a reply arrives must not leave the last reply's
+  // status behind, or callers would take a lost connection for a server error
+  memset(&ssl_connection->reply, 0, sizeof(ssl_connection->reply));
+  initialize_context(ssl_connection);
+  if (!connectionUsable(ssl_connection) && isReadOnlyRequest(request) && earlyDataAllowed(request)) {
+    if (ssl_connection->connected == 1) {
+      close_ssl_connection(ssl_connection);
+    }
+    reused = 0;
+    printf("\n");
+    wcount = openConnection(ssl_connection, request) > 0 ? (int)strlen(request) : -1;
+  } else if (initialize_connection(ssl_connection) == EXIT_SUCCESS) {
+    wcount = SSL_write(ssl_connection->ssl, request, strlen(request));
+  } else {
+    return -1; // Nothing to send the request on; retrying is up to the caller
+  }
+  if (ssl_connection->keepAlive) {
+    ssl_connection->requestsLeft--;
+  }
+  if (wcount > 0 && readReplyHeader(ssl_connection) == EXIT_SUCCESS) {
+    return wcount;
+  }
+
+  if (ssl_connection->connected == 1) {
+    close_ssl_connection(ssl_connection);
+  }
+  if (reused) {
+    return sendRequest(ssl_connection, request);
+  }
+  return -1;
+}
+
+/**
+* @brief Read part of the body of the reply to the last request, like SSL_read().
+*        Returns 0 once the whole body has been read.
+*/
+int readReply(struct SSL_Connection *ssl_connection, void *buffer, int size) {
+  int rcount;
+
+  if (ssl_connection->bodyLeft == 0) {
+    return 0;
+  }
+  if ((uint64_t)size > ssl_connection->bodyLeft) {
+    size = ssl_connection->bodyLeft;
+  }
+  rcount = SSL_read(ssl_connection->ssl, buffer, size);
+  if (rcount > 0) {
+    ssl_connection->bodyLeft -= rcount;
+  }
+  return rcount;
+}
+
+/**
+* @brief Read the hash that follows the body of a DOWNLOAD or RANGE reply.
+*/
+int readTrailer(struct SSL_Connection *ssl_connection, unsigned char hash[HASH_SIZE]) {
+  if (ssl_connection->bodyLeft != 0 || ssl_connection->trailerLeft != HASH_SIZE ||
+      readExact(ssl_connection->ssl, hash, HASH_SIZE) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  ssl_connection->trailerLeft = 0;
+  return EXIT_SUCCESS;
+}
+
+/**
+* @brief Read the block hashes that come between the header and the body of a reply
+*        with RPC_FLAG_BLOCK_HASHES, and check the leaves against their root.
+*        Returns one leaf per block of the whole file, for the caller to free, or
+*        NULL if they could not be read or do not add up to the root.
+*/
+unsigned char *readBlockHashes(struct SSL_Connection *ssl_connection) {
+  size_t count = block_count(ssl_connection->reply.file_size);
+  unsigned char root[BLOCK_HASH_SIZE];
+  unsigned char computedRoot[BLOCK_HASH_SIZE];
+  unsigned char *leaves = malloc(count > 0 ? count * BLOCK_HASH_SIZE : 1);
+  size_t total = 0;
+  int rcount = 1;
+
+  if (leaves == NULL || readExact(ssl_connection->ssl, root, BLOCK_HASH_SIZE) != EXIT_SUCCESS) {
+    free(leaves);
+    return NULL;
+  }
+  while (total < count * BLOCK_HASH_SIZE &&
+         (rcount = SSL_read(ssl_connection->ssl, leaves + total, count * BLOCK_HASH_SIZE - total)) > 0) {
+    total += rcount;
+  }
+  if (rcount <= 0 || !block_hash_root((const unsigned char (*)[BLOCK_HASH_SIZE])leaves, count, computedRoot) ||
+      memcmp(root, computedRoot, BLOCK_HASH_SIZE) != 0) {
+    free(leaves);
+    return NULL;
+  }
+  return leaves;
+}
+
+/**
+* @brief Explain an error reply from the server.
+*/
+void printServerError(const struct rpc_frame_header *reply) {
+  if (reply->status == RPC_STATUS_FILE_ERROR) {
+    fprintf(stderr, "Client: Server encountered file error: %s\n", strerror(reply->error));
+  } else if (reply->error == RPC_ERROR_BAD_OPERATION) {
+    fprintf(stderr, "Client: Server encountered error -- 'Bad Operation'\n");
+  } else if (reply->error == RPC_ERROR_TOO_FEW_ARGS) {
+    fprintf(stderr, "Client: Server encountered error -- 'Too few arguments'\n");
+  } else if (reply->error == RPC_ERROR_TOO_MANY_ARGS) {
+    fprintf(stderr, "Client: Server encountered error -- 'Too many arguments'\n");
+  } else if (reply->error == RPC_ERROR_BUSY) {
+    fprintf(stderr, "Client: Server is busy, try again later\n");
+  } else {
+    fprintf(stderr, "Client: Server encountered error %d\n", reply->error);
+  }
+}
+
+/**
+* @brief Done with the current request. A keep-alive connection stays open for the
+*        next one once any unread part of the reply is skipped; otherwise the
+*        connection is closed.
+*/
+void finishRequest(struct SSL_Connection *ssl_connection) {
+  char buffer[DOWNLOAD_BUFFER_SIZE];
+  int rcount;
+
+  if (ssl_connection->connected != 1) {
+    return;
+  }
+  if (ssl_connection->keepAlive && ssl_connection->requestsLeft > 0) {
+    while ((rcount = readReply(ssl_connection, buffer, sizeof(buffer))) > 0) {
+    }
+    if (rcount == 0 && (ssl_connection->trailerLeft == 0 ||
+                        readTrailer(ssl_connection, (unsigned char *)buffer) == EXIT_SUCCESS)) {
+      ssl_connection->idleDeadline = time(NULL) + ssl_connection->idleTimeout - 1;
+      return;
+    }
+  }
+  close_ssl_connection(ssl_connection);
+}
+
 /**
 * @brief The sequence of steps required to establish a secure SSL/TLS connection is:
 *
@@ -231,19 +824,69 @@ int main(int argc, char** argv) {
   int               userChoice;
   char*             fileChoice = malloc(BUFFER_SIZE);
   int               continuePrompting = 1;
-  int               stopFlag = -1;
-  int               downloadTries;
+  int               streams = 1;
+  int               mirror = 0;
+  int               transfers = DEFAULT_TRANSFERS;
+  char*             searchTerm = NULL;
+  int               option;
   pthread_t         ptid;
+  static const struct option longOptions[] = {
+    {"mirror", no_argument, NULL, 'm'},
+    {"search", required_argument, NULL, 's'},
+    {"jobs", required_argument, NULL, 'j'},
+    {"audio-buffer", required_argument, NULL, 'b'},
+    {NULL, 0, NULL, 0}
+  };
 
-  stopPlaying = &stopFlag;
-  pthread_mutex_init(&mutexPlaying, NULL);
+  // A server closing an idle keep-alive connection must not kill the client
+  signal(SIGPIPE, SIG_IGN);
 
   ssl_connection.connected = -1;
 
-  if (argc != 2) {
-    fprintf(stderr, "Client: Usage: ssl-client <server name>:<port>\n");
+  // Without --mirror the client runs the interactive menu
+  while ((option = getopt_long(argc, argv, "ms:j:b:", longOptions, NULL)) != -1) {
+    switch (option) {
+    case 'm':
+      mirror = 1;
+      break;
+    case 's':
+      mirror = 1;
+      searchTerm = optarg;
+      break;
+    case 'j':
+      transfers = atoi(optarg);
+      break;
+    case 'b':
+      audioBuffer = atoi(optarg);
+      break;
+    default:
+      argc = 0; // Print the usage
+      break;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "Client: Usage: ssl-client [--mirror [--search <term>] [--jobs <transfers>]] "
+                    "[--audio-buffer <blocks>] <server name>:<port> [parallel download streams]\n");
+    exit(EXIT_FAILURE);
+  } else if (audioBuffer < 2 || audioBuffer > MAX_AUDIO_BUFFER) {
+    fprintf(stderr, "Client: The audio buffer must be between 2 and %d blocks\n", MAX_AUDIO_BUFFER);
+    exit(EXIT_FAILURE);
+  } else if (transfers < 1 || transfers > MAX_TRANSFERS) {
+    fprintf(stderr, "Client: Concurrent transfers must be between 1 and %d\n", MAX_TRANSFERS);
     exit(EXIT_FAILURE);
   } else {
+    // Optionally download over several connections at once
+    if (argc == 3) {
+      streams = atoi(argv[2]);
+      if (streams < 1 || streams > MAX_STREAMS) {
+        fprintf(stderr, "Client: Parallel download streams must be between 1 and %d\n", MAX_STREAMS);
+        exit(EXIT_FAILURE);
+      }
+    }
+
     // Search for ':' in the argument to see if port is specified
     temp_ptr = strchr(argv[1], ':');
     if (temp_ptr == NULL) {    // Hostname only. Use default port
@@ -260,6 +903,16 @@ int main(int argc, char** argv) {
     }
   }
 
+  if (mirror) {
+    int result = mirrorCatalog(&ssl_connection, searchTerm, transfers, streams);
+    if (ssl_connection.connected == 1) {
+      close_ssl_connection(&ssl_connection);
+    }
+    SSL_CTX_free(ssl_connection.ssl_ctx);
+    return result;
+  }
+
+  audioInit();
   while (continuePrompting > 0) {
     userChoice = promptUser();
     switch (userChoice)
@@ -271,20 +924,61 @@ int main(int argc, char** argv) {
       requestAvailableDownloads(&ssl_connection, RPC_SEARCH_OPERATION);
       break;
     case DOWNLOAD_MP3:
-      downloadTries = 1;
-      while (downloadMP3(&ssl_connection) != EXIT_SUCCESS && downloadTries <= MAX_RETRIES) {
-        printf("DOWNLOAD FAILED RETRYING -- Try %d of %d\n", downloadTries, MAX_RETRIES);
-      }
+      // Each retry picks up where the partial file on disk left off
+      promptDownloadName(fileName);
+      downloadWithRetries(&ssl_connection, fileName, streams);
       break;
     case PLAY_MP3:
-      if (stopFlag == 0) { stopMP3(&ptid); }
+      // The queue and a stream cannot share the audio device
+      if (!atomic_load(&stopStreaming)) { stopMP3(&ptid); }
 
       if (chooseFromDownloadedMP3s(fileChoice) == EXIT_SUCCESS) {
-        playMP3(fileChoice, &ptid);
+        playMP3(fileChoice, 0);
+      }
+      break;
+    case SEEK_MP3:
+      seekMP3();
+      break;
+    case RESUME_MP3:
+      if (resumeFile[0] == '\0') {
+        printf("Nothing to resume.\n");
+        break;
+      }
+      if (!atomic_load(&stopStreaming)) { stopMP3(&ptid); }
+      if (playMP3(resumeFile, resumeAt) == EXIT_SUCCESS) {
+        resumeFile[0] = '\0';
+      }
+      break;
+    case PAUSE_MP3:
+      if (player != NULL) {
+        printf(audioPlayerTogglePause(player) ? "Audio paused.\n" : "Audio resumed.\n");
       }
       break;
     case STOP_MP3:
-      if (stopFlag == 0) { stopMP3(&ptid); }
+      if (!atomic_load(&stopStreaming)) { stopMP3(&ptid); }
+      if (player != NULL) {
+        double length;
+        char position[16];
+        if (audioPlayerPosition(player, resumeFile, sizeof(resumeFile), &resumeAt, &length) == 0) {
+          formatTime(resumeAt, position, sizeof(position));
+          printf("Client: Stopped '%s' at %s (choose %d to resume it)\n", resumeFile, position, RESUME_MP3);
+        }
+        audioPlayerStop(player);
+        printf("Audio stopped.\n");
+        printPlaybackStats();
+      }
+      break;
+    case STREAM_MP3:
+      if (!atomic_load(&stopStreaming)) { stopMP3(&ptid); }
+      if (player != NULL) { audioPlayerStop(player); }
+
+      promptDownloadName(fileName);
+      streamMP3(&ssl_connection, fileName, &ptid);
+      break;
+    case VALIDATE_MP3:
+      if (chooseFromDownloadedMP3s(fileChoice) == EXIT_SUCCESS) {
+        validateMP3(&ssl_connection, fileChoice);
+      }
       break;
     case QUIT_PROGRAM:
       continuePrompting = -1;
@@ -295,26 +989,26 @@ int main(int argc, char** argv) {
     }
   }
 
+  if (!atomic_load(&stopStreaming)) { stopMP3(&ptid); }
+  if (player != NULL) {
+    printPlaybackStats();
+    audioPlayerClose(player);
+  }
+  audioShutdown();
+
   if (ssl_connection.connected == 1) {
     close_ssl_connection(&ssl_connection);
   }
+  if (ssl_connection.ssl_ctx != NULL) {
+    SSL_CTX_free(ssl_connection.ssl_ctx);
+  }
 
   return EXIT_SUCCESS;
 }
 
-void *thread_playMP3(void *arg) {
-
-  char* fileName = (char *)arg;
-  playAudio(arg, stopPlaying);
-  // error check playaudio
-  pthread_exit(NULL);
-}
-
 int stopMP3(pthread_t *ptid) {
     // Signal the playback thread to stop
-    pthread_mutex_lock(&mutexPlaying);
-    *stopPlaying = -1;
-    pthread_mutex_unlock(&mutexPlaying);
+    atomic_store(&stopStreaming, 1);
 
     // Wait for the thread to exit gracefully
     pthread_join(*ptid, NULL);
@@ -323,58 +1017,180 @@ int stopMP3(pthread_t *ptid) {
     return EXIT_SUCCESS;
 }
 
-// Play MP3 file
-int playMP3(char *fileName, pthread_t *ptid)  {
-  int result;
+/**
+* @brief Add a downloaded MP3 to the play queue. It starts at once if nothing is
+*        playing, and otherwise follows the tracks already queued without a gap.
+*
+* @param start - Seconds into the track to begin at, 0 for the beginning
+*/
+int playMP3(const char *fileName, double start) {
+  int waiting;
+  char position[16];
 
-  pthread_mutex_lock(&mutexPlaying);
-  *stopPlaying = 0;
-  pthread_mutex_unlock(&mutexPlaying);
-  result = pthread_create(ptid, NULL, &thread_playMP3, fileName);
-  if (result != 0) {
-        fprintf(stderr, "Error creating playback thread: %s\n", strerror(result));
-        return EXIT_FAILURE;
+  if (player == NULL && (player = audioPlayerOpen(audioBuffer)) == NULL) {
+    fprintf(stderr, "Client: Could not start the player\n");
+    return EXIT_FAILURE;
+  }
+  waiting = audioPlayerEnqueueAt(player, fileName, start);
+  if (waiting < 0) {
+    fprintf(stderr, "Client: The play queue is full\n");
+    return EXIT_FAILURE;
+  }
+  if (start > 0) {
+    formatTime(start, position, sizeof(position));
+    printf("Client: Added '%s' to the play queue, starting at %s\n", fileName, position);
+  } else {
+    printf("Client: Added '%s' to the play queue\n", fileName);
   }
-
   return EXIT_SUCCESS;
 }
 
-int promptUser() {
-  int choice;
+/**
+* @brief Ask where to go in the track that is playing: "1:30" or "90" goes to that
+*        position, "+10" or "-10" skips forwards or back that many seconds.
+*/
+int seekMP3() {
   char buffer[BUFFER_SIZE];
-  // Print the menu options for the user
-  printf("\nPlease choose from the following options:\n");
-  printf("%d. List available MP3s to download\n", LIST_MP3S);
-  printf("%d. Search MP3s to download\n", SEARCH_MP3S);
-  printf("%d. Download MP3\n", DOWNLOAD_MP3);
-  printf("%d. Play MP3\n", PLAY_MP3);
-  printf("%d. Stop MP3\n\n", STOP_MP3);
-  printf("%d. Stop Program\n", QUIT_PROGRAM);
+  char fileName[BUFFER_SIZE];
+  char position[16], length[16];
+  double seconds, total, minutes;
+  int whence = SEEK_SET;
 
-  // Optionally, prompt the user for input (not part of the original request)
-  
-  printf("Enter your choice (1-5) or 0 to stop: ");
+  if (player == NULL || audioPlayerPosition(player, fileName, sizeof(fileName), &seconds, &total) != 0) {
+    printf("Nothing is playing.\n");
+    return EXIT_FAILURE;
+  }
+  formatTime(seconds, position, sizeof(position));
+  formatTime(total, length, sizeof(length));
+  printf("Playing '%s' at %s of %s\n", fileName, position, length);
+  printf("Enter a position (m:ss or seconds), or +/- seconds to skip: ");
   bzero(buffer, BUFFER_SIZE);
-  fgets(buffer, BUFFER_SIZE-1, stdin);
-  // Remove trailing newline character
-  buffer[strlen(buffer)-1] = '\0';
+  if (fgets(buffer, BUFFER_SIZE-1, stdin) == NULL) {
+    return EXIT_FAILURE;
+  }
 
-  sscanf(buffer, "%d", &choice);
-  printf("YOUR CHOICE WAS: %d\n\n", choice);
-  return choice;
-}
+  if (buffer[0] == '+' || buffer[0] == '-') {
+    whence = SEEK_CUR;
+  }
+  if (sscanf(buffer, "%lf:%lf", &minutes, &seconds) == 2) {
+    seconds = minutes * 60 + (buffer[0] == '-' ? -seconds : seconds);
+  } else if (sscanf(buffer, "%lf", &seconds) != 1) {
+    printf("Invalid position\n");
+    return EXIT_FAILURE;
+  }
 
-void printDownloadedChoices(char *fileNames[MAX_FILES], int fileCount) {
-  printf("Please Choose From List of Downloaded MP3\n");
-  for (int i = 0; i < fileCount; i++) {
-    printf("%d. %s\n", i+1, fileNames[i]);
+  if ((seconds = audioPlayerSeek(player, seconds, whence)) < 0) {
+    printf("Nothing is playing.\n");
+    return EXIT_FAILURE;
   }
+  formatTime(seconds, position, sizeof(position));
+  printf("Client: Playing from %s\n", position);
+  return EXIT_SUCCESS;
 }
-int chooseFromDownloadedMP3s(char *fileChoice) {
-  DIR *dp;
-  struct dirent *ep;
-  char downloadLocation[BUFFER_SIZE];
-  char chosenFile[BUFFER_SIZE];
+
+void formatTime(double seconds, char *text, size_t size) {
+  // Clamped before the conversion, so the text always fits the callers' 16-byte buffers
+  int whole = seconds > 0 ? (int)(seconds < MAX_FORMATTED_TIME ? seconds : MAX_FORMATTED_TIME) : 0;
+
+  snprintf(text, size, "%d:%02d", whole / 60, whole % 60);
+}
+
+/**
+* @brief Show how the playback buffer has coped so far. Underruns mean the decoder
+*        could not keep up and --audio-buffer should be larger; the latency is how
+*        far ahead of the speakers the decoder runs.
+*/
+void printPlaybackStats() {
+  struct audio_player_stats stats;
+
+  audioPlayerStats(player, &stats);
+  if (stats.blocks > 0) {
+    printf("Client: Played %lu blocks with a %zu block buffer: %lu underrun%s, latency %.1f ms average, %.1f ms worst\n",
+           stats.blocks, stats.depth, stats.underruns, stats.underruns == 1 ? "" : "s",
+           stats.averageLatencyMs, stats.maxLatencyMs);
+  }
+}
+
+void *thread_streamMP3(void *arg) {
+  playAudioStream((struct audio_stream *)arg, &stopStreaming);
+  pthread_exit(NULL);
+}
+
+/**
+* @brief Play an MP3 while it downloads. The download is the same as DOWNLOAD_MP3,
+*        so the file still ends up in the download folder with its hash checked,
+*        but every byte is also handed to a playback thread as soon as it arrives.
+*/
+int streamMP3(struct SSL_Connection *ssl_connection, const char *fileName, pthread_t *ptid) {
+  struct audio_stream *stream = audioStreamOpen();
+  int downloadTries = 1;
+  int result;
+
+  if (stream == NULL) {
+    fprintf(stderr, "Client: Out of memory for streaming\n");
+    return EXIT_FAILURE;
+  }
+
+  atomic_store(&stopStreaming, 0);
+  result = pthread_create(ptid, NULL, &thread_streamMP3, stream);
+  if (result != 0) {
+    fprintf(stderr, "Error creating playback thread: %s\n", strerror(result));
+    atomic_store(&stopStreaming, 1);
+    playAudioStream(stream, &stopStreaming); // Returns at once, letting go of the stream
+    audioStreamClose(stream);
+    return EXIT_FAILURE;
+  }
+
+  // A retry resumes from the partial file, and only bytes the player has not had yet are fed
+  while ((result = downloadMP3(ssl_connection, fileName, stream)) != EXIT_SUCCESS && downloadTries <= MAX_RETRIES) {
+    printf("DOWNLOAD FAILED RETRYING -- Try %d of %d\n", downloadTries, MAX_RETRIES);
+    downloadTries++;
+  }
+  audioStreamClose(stream);
+  return result;
+}
+
+int promptUser() {
+  int choice;
+  char buffer[BUFFER_SIZE];
+  // Print the menu options for the user
+  printf("\nPlease choose from the following options:\n");
+  printf("%d. List available MP3s to download\n", LIST_MP3S);
+  printf("%d. Search MP3s to download\n", SEARCH_MP3S);
+  printf("%d. Download MP3\n", DOWNLOAD_MP3);
+  printf("%d. Play MP3 (add it to the play queue)\n", PLAY_MP3);
+  printf("%d. Stop MP3 (and clear the play queue)\n", STOP_MP3);
+  printf("%d. Validate downloaded MP3\n", VALIDATE_MP3);
+  printf("%d. Stream MP3 (play while downloading)\n", STREAM_MP3);
+  printf("%d. Pause or resume playback\n", PAUSE_MP3);
+  printf("%d. Seek in the playing MP3\n", SEEK_MP3);
+  printf("%d. Resume the last stopped MP3 where it left off\n\n", RESUME_MP3);
+  printf("%d. Stop Program\n", QUIT_PROGRAM);
+
+  // Optionally, prompt the user for input (not part of the original request)
+  
+  printf("Enter your choice (1-10) or 0 to stop: ");
+  bzero(buffer, BUFFER_SIZE);
+  fgets(buffer, BUFFER_SIZE-1, stdin);
+  // Remove trailing newline character
+  buffer[strlen(buffer)-1] = '\0';
+
+  sscanf(buffer, "%d", &choice);
+  printf("YOUR CHOICE WAS: %d\n\n", choice);
+  return choice;
+}
+
+void printDownloadedChoices(char *fileNames[MAX_FILES], int fileCount) {
+  printf("Please Choose From List of Downloaded MP3\n");
+  for (int i = 0; i < fileCount; i++) {
+    printf("%d. %s\n", i+1, fileNames[i]);
+  }
+}
+int chooseFromDownloadedMP3s(char *fileChoice) {
+  DIR *dp;
+  struct dirent *ep;
+  char downloadLocation[BUFFER_SIZE];
+  char chosenFile[BUFFER_SIZE];
   char buffer[BUFFER_SIZE];
   char *fileNames[MAX_FILES];  // Array to hold file names
   int validChoice = -1;
@@ -386,7 +1202,8 @@ int chooseFromDownloadedMP3s(char *fileChoice) {
   dp = opendir(downloadLocation);
   if (dp != NULL) {
     while ((ep = readdir (dp)) != NULL) {
-      if (strcmp(ep->d_name, ".") == 0 || strcmp(ep->d_name, "..") == 0) {
+      // Skips . and .., and the hash manifest and frame indexes kept beside the MP3s
+      if (ep->d_name[0] == '.') {
         continue; 
       } 
       // Add the file name to the array if there's space left
@@ -474,12 +1291,12 @@ void requestAvailableDownloads(struct SSL_Connection *ssl_connection, const char
   char request[BUFFER_SIZE];
   char buffer[BUFFER_SIZE];
   int count = 1;
-
-  initialize_connection(ssl_connection);
+  int lineLength = 0;
 
   if (strcmp(rpc_operation, RPC_SEARCH_OPERATION) == 0) {
     printf("Client: Please enter a search term: ");
     fgets(buffer, BUFFER_SIZE-1, stdin);
+    buffer[strcspn(buffer, "\n")] = '\0'; // Do not send the newline as part of the term
 
     sprintf(request, "%s %s", rpc_operation, buffer);
     
@@ -489,7 +1306,7 @@ void requestAvailableDownloads(struct SSL_Connection *ssl_connection, const char
   }
 
 
-  wcount = SSL_write(ssl_connection->ssl, request, strlen(request));
+  wcount = sendRequest(ssl_connection, request);
   if (wcount < 0) {
     fprintf(stderr, "Client: Could not write message to socket: %s\n", strerror(errno));
     exit(EXIT_FAILURE);
@@ -497,119 +1314,1159 @@ void requestAvailableDownloads(struct SSL_Connection *ssl_connection, const char
     printf("Client: Successfully sent message \"%s\" to %s on port %u\n\n",
     request, ssl_connection->remote_host, ssl_connection->port);
   }
+  if (ssl_connection->reply.status != RPC_STATUS_OK) {
+    printServerError(&ssl_connection->reply);
+    finishRequest(ssl_connection);
+    return;
+  }
 
-  while ((rcount = SSL_read(ssl_connection->ssl, buffer, BUFFER_SIZE - 1)) > 0) {
-    buffer[rcount] = '\0';
-    printf("%d. %s", count, buffer);
-    count++;
+  // The server sends the names in as few records as it can, so number them by line
+  // rather than by read. A name may be split across two reads.
+  while ((rcount = readReply(ssl_connection, buffer, BUFFER_SIZE - 1)) > 0) {
+    for (int i = 0; i < rcount; i++) {
+      if (lineLength == 0) {
+        printf("%d. ", count);
+      }
+      putchar(buffer[i]);
+      lineLength++;
+      if (buffer[i] == '\n') {
+        lineLength = 0;
+        count++;
+      }
+    }
   }
   printf("\n");
   if (rcount < 0)  {
     fprintf(stderr, "Client: Error reading from searfer: %s\n", strerror(errno));
   }
 
-  close_ssl_connection(ssl_connection);
+  finishRequest(ssl_connection);
 }
 
-int downloadMP3(struct SSL_Connection *ssl_connection) {
-  char fileName[BUFFER_SIZE];
+void promptDownloadName(char *fileName) {
   char buffer[BUFFER_SIZE];
-  char request[BUFFER_SIZE];
-  char downloadLocation[BUFFER_SIZE];
-  char serverError[BUFFER_SIZE];
-  int writefd = -1;
-  int wcount;
-  int rcount;
-  int serverErrno;
-  SHA256_CTX sha256;
-  SHA256_Init(&sha256);
-
-  initialize_connection(ssl_connection);
 
   // Read input
   printf("Client: Please enter the name of the mp3 you want to download: ");
   bzero(buffer, BUFFER_SIZE);
   fgets(buffer, BUFFER_SIZE-1, stdin);
 
-  // Remove trailing newline character
-  // buffer[strlen(buffer)-1] = '\0';
-  
   // Pull everything written by user as filename. Filename could include spaces. 
+  fileName[0] = '\0';
   sscanf(buffer, "%s", fileName);
+}
+
+/**
+* @brief Hand the player the part of [position, position + length) of the file it
+*        does not have yet.
+*/
+void feedAudio(struct audio_stream *stream, uint64_t position, const char *data, size_t length) {
+  uint64_t fed = audioStreamFed(stream);
+
+  if (position + length <= fed || position > fed) {
+    return;
+  }
+  audioStreamFeed(stream, data + (fed - position), length - (fed - position));
+}
 
-  // Build the request
-  sprintf(request, "%s %s", RPC_DOWNLOAD_OPERATION, fileName);
-  // Build the download location
+/**
+* @brief SHA-256 hash of a file on disk.
+*/
+int hashFile(const char *path, unsigned char hash[HASH_SIZE]) {
+  char buffer[DOWNLOAD_BUFFER_SIZE];
+  int readfd;
+  int rcount = -1;
+  int ok;
+  EVP_MD_CTX *sha256;
+
+  readfd = open(path, O_RDONLY);
+  if (readfd < 0) {
+    return EXIT_FAILURE;
+  }
+  // The same SHA-256 the download pipe hashes with, so the results compare
+  sha256 = EVP_MD_CTX_new();
+  ok = sha256 != NULL && block_digest_init(sha256);
+  while (ok && (rcount = read(readfd, buffer, sizeof(buffer))) > 0) {
+    ok = EVP_DigestUpdate(sha256, buffer, rcount) == 1;
+  }
+  ok = ok && rcount == 0 && EVP_DigestFinal_ex(sha256, hash, NULL) == 1;
+  EVP_MD_CTX_free(sha256);
+  close(readfd);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+* @brief Check each block of a file on disk against the server's leaves. Returns
+*        how many blocks did not match, listed in 'bad' for the caller to free.
+*/
+size_t findDamagedBlocks(const char *path, const unsigned char *leaves, uint64_t fileSize, size_t **bad) {
+  unsigned char *block = malloc(RPC_BLOCK_SIZE);
+  unsigned char leaf[BLOCK_HASH_SIZE];
+  size_t count = block_count(fileSize);
+  size_t badCount = 0;
+  int readfd = open(path, O_RDONLY);
+
+  *bad = malloc((count > 0 ? count : 1) * sizeof(**bad));
+  for (size_t i = 0; readfd >= 0 && block != NULL && *bad != NULL && i < count; i++) {
+    uint64_t start = (uint64_t)i * RPC_BLOCK_SIZE;
+    size_t length = fileSize - start < RPC_BLOCK_SIZE ? fileSize - start : RPC_BLOCK_SIZE;
+    ssize_t rcount = pread(readfd, block, length, start);
+
+    block_hash_leaf(block, rcount > 0 ? rcount : 0, leaf);
+    if (rcount != (ssize_t)length || memcmp(leaf, leaves + i * BLOCK_HASH_SIZE, BLOCK_HASH_SIZE) != 0) {
+      (*bad)[badCount++] = i;
+    }
+  }
+  if (readfd >= 0) {
+    close(readfd);
+  }
+  free(block);
+  return badCount;
+}
+
+/**
+* @brief Fetch damaged blocks of a file again, with one RANGE request for each run
+*        of neighbouring blocks, and write each block into place once it matches
+*        its leaf. Everything else in the file is left as it is.
+*/
+int refetchBlocks(struct SSL_Connection *ssl_connection, const char *fileName, const char *path,
+                  const unsigned char *leaves, uint64_t fileSize, const size_t *bad, size_t badCount) {
+  const struct rpc_frame_header *reply = &ssl_connection->reply;
+  unsigned char *block = malloc(RPC_BLOCK_SIZE);
+  unsigned char leaf[BLOCK_HASH_SIZE];
+  unsigned char hash[HASH_SIZE];
+  char request[BUFFER_SIZE];
+  int writefd = open(path, O_WRONLY);
+  int result = block != NULL && writefd >= 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  size_t next = 0;
+
+  printf("Client: %zu damaged block%s in '%s', fetching %s again\n", badCount, badCount == 1 ? "" : "s",
+         fileName, badCount == 1 ? "it" : "them");
+  while (result == EXIT_SUCCESS && next < badCount) {
+    size_t first = bad[next], last = bad[next];
+    while (++next < badCount && bad[next] == last + 1) {
+      last++;
+    }
+    uint64_t start = (uint64_t)first * RPC_BLOCK_SIZE;
+    uint64_t end = (uint64_t)(last + 1) * RPC_BLOCK_SIZE < fileSize ? (uint64_t)(last + 1) * RPC_BLOCK_SIZE : fileSize;
+
+    snprintf(request, sizeof(request), "%s %llu %llu %s", RPC_RANGE_OPERATION,
+             (unsigned long long)start, (unsigned long long)(end - start), fileName);
+    if (sendRequest(ssl_connection, request) < 0) {
+      result = EXIT_FAILURE;
+      break;
+    }
+    if (reply->status != RPC_STATUS_OK || reply->offset != start || reply->body_length != end - start ||
+        reply->file_size != fileSize) {
+      finishRequest(ssl_connection);
+      result = EXIT_FAILURE;
+      break;
+    }
+
+    for (uint64_t position = start; result == EXIT_SUCCESS && position < end; position += RPC_BLOCK_SIZE) {
+      size_t length = end - position < RPC_BLOCK_SIZE ? end - position : RPC_BLOCK_SIZE;
+      size_t got = 0;
+      int rcount;
+
+      while (got < length && (rcount = readReply(ssl_connection, block + got, length - got)) > 0) {
+        got += rcount;
+      }
+      block_hash_leaf(block, got, leaf);
+      if (got < length || memcmp(leaf, leaves + (position / RPC_BLOCK_SIZE) * BLOCK_HASH_SIZE, BLOCK_HASH_SIZE) != 0 ||
+          pwrite(writefd, block, length, position) != (ssize_t)length) {
+        result = EXIT_FAILURE;
+      }
+    }
+    if (result != EXIT_SUCCESS || readTrailer(ssl_connection, hash) != EXIT_SUCCESS) {
+      close_ssl_connection(ssl_connection);
+      result = EXIT_FAILURE;
+      break;
+    }
+    finishRequest(ssl_connection);
+  }
+
+  if (result != EXIT_SUCCESS) {
+    fprintf(stderr, "Client: Could not fetch the damaged blocks of '%s' again\n", fileName);
+  }
+  if (writefd >= 0) {
+    close(writefd);
+  }
+  free(block);
+  return result;
+}
+
+/**
+* @brief Read the hash manifest. Each line is
+*        "<hex hash> <size> <mtime seconds> <mtime nanoseconds> <file name>".
+*        Call with mutexManifest held.
+*/
+void loadManifest() {
+  char line[BUFFER_SIZE + 2 * HASH_SIZE + 64];
+  char hex[2 * HASH_SIZE + 1];
+  char name[BUFFER_SIZE];
+  struct ManifestEntry entry;
+  long long size, seconds, nanoseconds;
+  FILE *file;
+
+  manifestLoaded = 1;
+  file = fopen(HASH_MANIFEST, "r");
+  if (file == NULL) {
+    return;
+  }
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (sscanf(line, "%64s %lld %lld %lld %255[^\n]", hex, &size, &seconds, &nanoseconds, name) != 5 ||
+        !rpc_hash_from_hex(hex, entry.hash)) {
+      continue; // Skip damaged lines; those files are hashed again when needed
+    }
+    entry.size = size;
+    entry.mtime.tv_sec = seconds;
+    entry.mtime.tv_nsec = nanoseconds;
+    entry.fileName = strdup(name);
+    manifest = realloc(manifest, (manifestCount + 1) * sizeof(struct ManifestEntry));
+    manifest[manifestCount++] = entry;
+  }
+  fclose(file);
+}
+
+/**
+* @brief Write the hash manifest out whole, replacing the old one in one step so a
+*        crash cannot leave it half written. Call with mutexManifest held.
+*/
+void saveManifest() {
+  char hex[2 * HASH_SIZE + 1];
+  FILE *file = fopen(HASH_MANIFEST ".new", "w");
+
+  if (file == NULL) {
+    return;
+  }
+  for (int i = 0; i < manifestCount; i++) {
+    rpc_hash_to_hex(manifest[i].hash, hex);
+    fprintf(file, "%s %lld %lld %ld %s\n", hex, (long long)manifest[i].size,
+            (long long)manifest[i].mtime.tv_sec, manifest[i].mtime.tv_nsec, manifest[i].fileName);
+  }
+  if (fclose(file) == 0) {
+    rename(HASH_MANIFEST ".new", HASH_MANIFEST);
+  }
+}
+
+/**
+* @brief Get the hash of a downloaded file from the manifest, if the file has not
+*        changed since it was recorded.
+*/
+int manifestLookup(const char *fileName, unsigned char hash[HASH_SIZE]) {
+  char path[BUFFER_SIZE];
+  struct stat st;
+  int result = EXIT_FAILURE;
+
+  snprintf(path, sizeof(path), "%s/%s", DEFAULT_DOWNLOAD_LOCATION, fileName);
+  if (stat(path, &st) < 0) {
+    return EXIT_FAILURE;
+  }
+  pthread_mutex_lock(&mutexManifest);
+  if (!manifestLoaded) {
+    loadManifest();
+  }
+  for (int i = 0; i < manifestCount; i++) {
+    if (strcmp(manifest[i].fileName, fileName) == 0) {
+      if (manifest[i].size == st.st_size && manifest[i].mtime.tv_sec == st.st_mtim.tv_sec &&
+          manifest[i].mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        memcpy(hash, manifest[i].hash, HASH_SIZE);
+        result = EXIT_SUCCESS;
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&mutexManifest);
+  return result;
+}
+
+/**
+* @brief Record the hash of a file that has just been downloaded and checked.
+*/
+void manifestRecord(const char *fileName, const unsigned char hash[HASH_SIZE]) {
+  char path[BUFFER_SIZE];
+  struct stat st;
+  int i;
+
+  snprintf(path, sizeof(path), "%s/%s", DEFAULT_DOWNLOAD_LOCATION, fileName);
+  if (stat(path, &st) < 0) {
+    return;
+  }
+  pthread_mutex_lock(&mutexManifest);
+  if (!manifestLoaded) {
+    loadManifest();
+  }
+  for (i = 0; i < manifestCount && strcmp(manifest[i].fileName, fileName) != 0; i++) {
+  }
+  if (i == manifestCount) {
+    manifest = realloc(manifest, (manifestCount + 1) * sizeof(struct ManifestEntry));
+    manifest[i].fileName = strdup(fileName);
+    manifestCount++;
+  }
+  memcpy(manifest[i].hash, hash, HASH_SIZE);
+  manifest[i].size = st.st_size;
+  manifest[i].mtime = st.st_mtim;
+  saveManifest();
+  pthread_mutex_unlock(&mutexManifest);
+}
+
+/**
+* @brief Download an MP3 with the RANGE operation, starting from the size of any
+*        partial copy already on disk, then check the SHA-256 hash of the whole
+*        file against the server's. A transfer that breaks off leaves the partial
+*        file in place, so the next try only fetches the missing bytes. A file that
+*        fails the hash check is thrown away so the next try starts over.
+*
+*        A complete copy whose hash is in the manifest is sent with the request
+*        instead (IF-NONE-MATCH). If the server still has the same file it answers
+*        "not modified" and nothing is transferred; otherwise the new file replaces
+*        the copy.
+*
+*        The body is received into large buffers that a download pipe hashes and
+*        writes to disk on threads of its own, so the network, the hash and the
+*        disk all work at once and the file is not read back to check it.
+*
+*        The server sends the file's block hashes ahead of the body, and the pipe
+*        checks every block against them, both the part kept from an earlier try
+*        and each block as it arrives. A damaged block that arrives stops the
+*        transfer early; damaged blocks are then fetched again on their own, and
+*        only if the transfer stopped early does the next try resume past them.
+*
+*        If 'stream' is not NULL, the file is also fed to that player as it arrives.
+*/
+int downloadMP3(struct SSL_Connection *ssl_connection, const char *fileName, struct audio_stream *stream) {
+  char buffer[DOWNLOAD_BUFFER_SIZE];
+  struct download_pipe *pipe;
+  struct timespec started, finished;
+  unsigned char *data;
+  size_t size, length;
+  double seconds;
+  char request[BUFFER_SIZE];
+  char downloadLocation[BUFFER_SIZE];
+  unsigned char computedHash[HASH_SIZE];
+  unsigned char serverHash[HASH_SIZE];
+  unsigned char knownHash[HASH_SIZE];
+  char knownHex[2 * HASH_SIZE + 1];
+  struct stat st;
+  const struct rpc_frame_header *reply = &ssl_connection->reply;
+  struct download_blocks blocks = {0};
+  unsigned char *leaves = NULL;
+  int stoppedEarly = 0;
+  long long offset = 0;
+  long long received = 0;
+  int conditional = 0;
+  int percent = -1;
+  int writefd;
+  int wcount;
+  int rcount;
+
+  // Build the download location and see how much of it we already have
   sprintf(downloadLocation, "%s/%s", DEFAULT_DOWNLOAD_LOCATION, fileName);
+  if (stat(downloadLocation, &st) == 0) {
+    offset = st.st_size;
+  }
+
+  // Build the request. A copy we know to be complete only needs fetching again if
+  // the server's file has changed. The player needs the whole file, so streaming
+  // always takes the plain path.
+  if (stream == NULL && offset > 0 && manifestLookup(fileName, knownHash) == EXIT_SUCCESS) {
+    conditional = 1;
+    offset = 0;
+    rpc_hash_to_hex(knownHash, knownHex);
+    snprintf(request, sizeof(request), "%s 0 0 %s %s %s %s", RPC_RANGE_OPERATION, RPC_BLOCK_HASHES,
+             RPC_IF_NONE_MATCH, knownHex, fileName);
+  } else {
+    snprintf(request, sizeof(request), "%s %lld 0 %s %s", RPC_RANGE_OPERATION, offset, RPC_BLOCK_HASHES, fileName);
+  }
 
   // Write to server
-  wcount = SSL_write(ssl_connection->ssl, request, strlen(request));
+  wcount = sendRequest(ssl_connection, request);
   if (wcount < 0) {
     fprintf(stderr, "Client: Could not write message to socket: %s\n",
 	    strerror(errno));
-    exit(EXIT_FAILURE);
+    return EXIT_FAILURE;
   } else {
     printf("Client: Successfully sent message \"%s\" to %s on port %u\n",
 	   request, ssl_connection->remote_host, ssl_connection->port);
   }
 
-  bzero(buffer, BUFFER_SIZE);
+  // The status is in the reply header, so the file data itself is never parsed
+  if (reply->status == RPC_STATUS_NOT_MODIFIED) {
+    finishRequest(ssl_connection);
+    printf("Client: '%s' is already up to date in %s\n", fileName, downloadLocation);
+    return EXIT_SUCCESS;
+  } else if (reply->status == RPC_STATUS_FILE_ERROR && reply->error == EINVAL && offset > 0) {
+    // Our copy is longer than the server's, so it is not a partial download of it
+    fprintf(stderr, "Client: Local copy of '%s' does not match the server's, starting over\n", fileName);
+    finishRequest(ssl_connection);
+    truncate(downloadLocation, 0);
+    return EXIT_FAILURE;
+  } else if (reply->status != RPC_STATUS_OK) {
+    printServerError(reply);
+    finishRequest(ssl_connection);
+    return EXIT_FAILURE;
+  } else if (reply->offset != (uint64_t)offset || !(reply->flags & RPC_FLAG_HASH_TRAILER)) {
+    fprintf(stderr, "Client: Unexpected reply from server\n");
+    finishRequest(ssl_connection);
+    return EXIT_FAILURE;
+  }
 
-  
-  // Recieve from server
-  while ((rcount = SSL_read(ssl_connection->ssl, buffer, BUFFER_SIZE)) > 0 ) {
-    buffer[rcount] = '\0';
-
-    sscanf(buffer, "%10s %d", serverError, &serverErrno);
-    if (strcmp(serverError, ERROR_FILE_ERROR) == 0) {
-      fprintf(stderr, "Client: Server encountered file error: %s\n", strerror(serverErrno));
-      exit(EXIT_FAILURE);
-    } else if (strcmp(serverError, ERROR_RPC_ERROR) == 0) {
-      if (serverErrno == RPC_ERROR_BAD_OPERATION) {
-        fprintf(stderr, "Client: Server encountered error -- 'Bad Operation'\n");
-      } else if (serverErrno == RPC_ERROR_TOO_FEW_ARGS) {
-        fprintf(stderr, "Client: Server encountered error -- 'Too few arguments'\n");
-      } else if (serverErrno == RPC_ERROR_TOO_MANY_ARGS) {
-        fprintf(stderr, "Client: Server encountered error -- 'Too many arguments'\n");
+  // The block hashes come before the body
+  if (reply->flags & RPC_FLAG_BLOCK_HASHES) {
+    if ((leaves = readBlockHashes(ssl_connection)) == NULL) {
+      fprintf(stderr, "Client: Could not read the block hashes of '%s'\n", fileName);
+      close_ssl_connection(ssl_connection);
+      return EXIT_FAILURE;
+    }
+    blocks.leaves = leaves;
+    blocks.count = block_count(reply->file_size);
+    blocks.size = reply->file_size;
+  }
+
+  // Open file for writing, keeping what is already there unless it is an old version.
+  // What is kept is read back to hash it.
+  writefd = open(downloadLocation, O_RDWR | O_CREAT | (conditional ? O_TRUNC : 0), S_IRUSR | S_IWUSR);
+  if (writefd < 0) {
+    free(leaves);
+    fprintf(stderr, "Client: Could not open file \"%s\" for writing: %s\n", downloadLocation, strerror(errno));
+    close_ssl_connection(ssl_connection);
+    return EXIT_FAILURE;
+  }
+  if (offset > 0) {
+    printf("Client: Resuming '%s' at byte %lld of %llu\n", fileName, offset,
+           (unsigned long long)reply->file_size);
+  }
+#ifdef FALLOC_FL_KEEP_SIZE
+  // Reserve the disk space up front so the file is not fragmented. The file keeps
+  // its current size, which is what a later try resumes from.
+  if (reply->body_length > 0) {
+    fallocate(writefd, FALLOC_FL_KEEP_SIZE, offset, reply->body_length);
+  }
+#endif
+
+  // When streaming, the player first gets whatever is already on disk
+  if (stream != NULL) {
+    int readfd = open(downloadLocation, O_RDONLY);
+    uint64_t position = audioStreamFed(stream);
+
+    while (readfd >= 0 && position < (uint64_t)offset &&
+           (rcount = pread(readfd, buffer, sizeof(buffer), position)) > 0) {
+      if (position + rcount > (uint64_t)offset) {
+        rcount = offset - position;
       }
-      
-      exit(EXIT_FAILURE);
+      audioStreamFeed(stream, buffer, rcount);
+      position += rcount;
+    }
+    if (readfd >= 0) {
+      close(readfd);
+    }
+  }
 
-    } else if(writefd < 1) { // if a file hasn't been opened for writing
-      // Open file for writing
-      writefd = open(downloadLocation, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR); // Open for writing, create if it doesn't exist, overwrite if allowed to
-      if (writefd < 0) {
-        fprintf(stderr, "Client: Could not open file \"%s\" for writing: %s\n", downloadLocation, strerror(errno));
-        exit(EXIT_FAILURE);
+  pipe = downloadPipeOpen(writefd, offset, leaves != NULL ? &blocks : NULL);
+  if (pipe == NULL) {
+    fprintf(stderr, "Client: Could not start receiving \"%s\"\n", fileName);
+    free(leaves);
+    close(writefd);
+    close_ssl_connection(ssl_connection);
+    return EXIT_FAILURE;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &started);
+
+  // Stop as soon as the pipe finds a damaged block in what has arrived
+  rcount = 1;
+  while (rcount > 0 && ssl_connection->bodyLeft > 0 && !(stoppedEarly = downloadPipeDamaged(pipe)) &&
+         (data = downloadPipeBuffer(pipe, &size)) != NULL) {
+    // Fill the whole buffer, a few TLS records at a time, before handing it on
+    length = 0;
+    while (length < size && (rcount = readReply(ssl_connection, data + length, size - length)) > 0) {
+      if (stream != NULL) {
+        feedAudio(stream, offset + received + length, (char *)data + length, rcount);
+      }
+      length += rcount;
+    }
+    downloadPipeSubmit(pipe, length);
+
+    // Show progress through the whole file, including any part kept from before
+    received += length;
+    if (showProgress && reply->file_size > 0 && (offset + received) * 100 / (long long)reply->file_size != percent) {
+      percent = (offset + received) * 100 / (long long)reply->file_size;
+      printf("\rClient: Downloaded %lld of %llu bytes (%d%%)", offset + received,
+             (unsigned long long)reply->file_size, percent);
+      fflush(stdout);
+    }
+  }
+  if (percent >= 0) {
+    printf("\n");
+  }
+  // Waits for the last writes and the hash of the whole file
+  if (downloadPipeClose(pipe, computedHash) != 0) {
+    fprintf(stderr, "Client: Error while writing to file \"%s\": %s\n", fileName, strerror(errno));
+    free(leaves);
+    free(blocks.bad);
+    close(writefd);
+    close_ssl_connection(ssl_connection);
+    return EXIT_FAILURE;
+  }
+  close(writefd);
+  clock_gettime(CLOCK_MONOTONIC, &finished);
+  ssl_connection->fetched += received;
+
+  // A transfer stopped at a damaged block is cut off; otherwise the whole-file
+  // hash follows the body as usual
+  if (stoppedEarly) {
+    fprintf(stderr, "Client: Block %zu of '%s' arrived damaged, stopping the transfer\n",
+            blocks.bad[blocks.badCount - 1], fileName);
+    close_ssl_connection(ssl_connection);
+  } else if (rcount < 0 || readTrailer(ssl_connection, serverHash) != EXIT_SUCCESS) {
+    // Keep the partial file so the next try resumes from it, and checks it again
+    fprintf(stderr, "Error reading from server: transfer ended with %llu bytes left\n",
+            (unsigned long long)ssl_connection->bodyLeft);
+    free(leaves);
+    free(blocks.bad);
+    close_ssl_connection(ssl_connection);
+    return EXIT_FAILURE;
+  } else {
+    finishRequest(ssl_connection);
+  }
+
+  // Fetch the damaged blocks again now that the pipe has found them all. The pipe's
+  // hash covered the damaged bytes, so a repaired file is hashed again. A transfer
+  // that stopped early resumes from the end of the file on the next try.
+  if (blocks.badCount > 0) {
+    int repaired = refetchBlocks(ssl_connection, fileName, downloadLocation, leaves, blocks.size,
+                                 blocks.bad, blocks.badCount);
+
+    free(leaves);
+    free(blocks.bad);
+    if (repaired != EXIT_SUCCESS || stoppedEarly) {
+      return EXIT_FAILURE;
+    }
+    if (truncate(downloadLocation, reply->file_size) < 0 || hashFile(downloadLocation, computedHash) != EXIT_SUCCESS) {
+      fprintf(stderr, "Client: Could not read back \"%s\": %s\n", downloadLocation, strerror(errno));
+      return EXIT_FAILURE;
+    }
+  } else {
+    free(leaves);
+  }
+
+  // The pipe hashed the whole file, including any part kept from an earlier try
+  if (truncate(downloadLocation, reply->file_size) < 0) {
+    fprintf(stderr, "Client: Could not set the size of \"%s\": %s\n", downloadLocation, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  if (memcmp(computedHash, serverHash, HASH_SIZE) != 0) {
+    fprintf(stderr, "Hash mismatch! Download of '%s' may be corrupted.\n", fileName);
+    truncate(downloadLocation, 0);
+    return EXIT_FAILURE;
+  }
+
+  manifestRecord(fileName, computedHash);
+  seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+  if (showProgress && received > 0 && seconds > 0) {
+    printf("Client: Received %.1f MB in %.2f s (%.1f MB/s)\n", received / 1e6, seconds, received / 1e6 / seconds);
+  }
+  printf("Client: Hash verified and succesfully downloaded file to: %s\n", downloadLocation);
+  return EXIT_SUCCESS;
+}
+
+/**
+* @brief Take the next range that needs fetching, waiting while the only ranges
+*        left are being fetched by other streams (one of them may still fail and
+*        come back). Returns -1 when there is nothing left to do.
+*/
+int takeRange(struct ParallelDownload *download) {
+  int taken = -1;
+
+  pthread_mutex_lock(&download->lock);
+  while (!download->failed && download->rangesLeft > 0) {
+    for (int i = 0; i < download->rangeCount; i++) {
+      if (download->ranges[i].state == RANGE_PENDING) {
+        download->ranges[i].state = RANGE_ACTIVE;
+        taken = i;
+        break;
       }
     }
+    if (taken >= 0) {
+      break;
+    }
+    pthread_cond_wait(&download->changed, &download->lock);
+  }
+  pthread_mutex_unlock(&download->lock);
+  return taken;
+}
 
-    SHA256_Update(&sha256, buffer, rcount);
-    wcount = write(writefd, buffer, rcount);
-    if (wcount < 0) {
-      fprintf(stderr, "Client: Error while writing to file \"%s\": %s\n", fileName, strerror(errno));
-      exit(EXIT_FAILURE);
+/**
+* @brief Record how fetching a range went. A failed range goes back in the queue
+*        until it has failed MAX_RETRIES times, at which point the download stops.
+*/
+void finishRange(struct ParallelDownload *download, int index, int succeeded) {
+  struct ByteRange *range = &download->ranges[index];
+
+  pthread_mutex_lock(&download->lock);
+  if (succeeded) {
+    range->state = RANGE_DONE;
+    download->rangesLeft--;
+  } else {
+    range->state = RANGE_PENDING;
+    if (++range->attempts > MAX_RETRIES) {
+      download->failed = 1;
     }
   }
+  pthread_cond_broadcast(&download->changed);
+  pthread_mutex_unlock(&download->lock);
+}
 
-  close(writefd);
+/**
+* @brief Fetch one range over a stream's connection and write it into place.
+*/
+int fetchRange(struct ParallelDownload *download, struct SSL_Connection *stream, const struct ByteRange *range) {
+  char buffer[DOWNLOAD_BUFFER_SIZE];
+  char request[BUFFER_SIZE];
+  unsigned char hash[HASH_SIZE];
+  const struct rpc_frame_header *reply = &stream->reply;
+  uint64_t written = 0;
+  int rcount;
 
-  char computed_hash[HASH_SIZE];
-  SHA256_Final(computed_hash, &sha256);
+  snprintf(request, sizeof(request), "%s %llu %llu %s", RPC_RANGE_OPERATION,
+           (unsigned long long)range->offset, (unsigned long long)range->length, download->fileName);
+  if (sendRequest(stream, request) < 0) {
+    return EXIT_FAILURE;
+  }
+  if (reply->status != RPC_STATUS_OK || reply->offset != range->offset ||
+      reply->body_length != range->length || reply->file_size != download->fileSize) {
+    finishRequest(stream);
+    return EXIT_FAILURE;
+  }
 
-  char server_hash[HASH_SIZE];
-  SSL_read(ssl_connection->ssl, server_hash, HASH_SIZE);
+  while ((rcount = readReply(stream, buffer, sizeof(buffer))) > 0) {
+    if (pwrite(download->fd, buffer, rcount, range->offset + written) != rcount) {
+      fprintf(stderr, "Client: Error while writing to file \"%s\": %s\n", download->fileName, strerror(errno));
+      close_ssl_connection(stream);
+      return EXIT_FAILURE;
+    }
+    written += rcount;
+
+    pthread_mutex_lock(&download->lock);
+    download->received += rcount;
+    if (showProgress && download->received * 100 / download->fileSize != (uint64_t)download->percent) {
+      download->percent = download->received * 100 / download->fileSize;
+      printf("\rClient: Downloaded %llu of %llu bytes (%d%%)", (unsigned long long)download->received,
+             (unsigned long long)download->fileSize, download->percent);
+      fflush(stdout);
+    }
+    pthread_mutex_unlock(&download->lock);
+  }
 
-  if (rcount < 0) {
-        fprintf(stderr, "Error reading from server: %s\n", strerror(errno));
-        return EXIT_FAILURE;
-  } else if (memcmp(computed_hash, server_hash, HASH_SIZE) == 0) {
+  if (rcount < 0 || readTrailer(stream, hash) != EXIT_SUCCESS) {
+    close_ssl_connection(stream);
+    pthread_mutex_lock(&download->lock);
+    download->received -= written; // The range is fetched again from the start
+    pthread_mutex_unlock(&download->lock);
+    return EXIT_FAILURE;
+  }
+  finishRequest(stream);
+
+  // A different hash means the file changed on the server part way through
+  if (memcmp(hash, download->hash, HASH_SIZE) != 0) {
+    fprintf(stderr, "\nClient: '%s' changed on the server during the download\n", download->fileName);
+    pthread_mutex_lock(&download->lock);
+    download->failed = 1;
+    pthread_mutex_unlock(&download->lock);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+* @brief Set up 'to' to open its own connections to the same server as 'from',
+*        sharing its SSL context.
+*/
+void copyConnection(struct SSL_Connection *to, const struct SSL_Connection *from) {
+  memset(to, 0, sizeof(*to));
+  strncpy(to->remote_host, from->remote_host, MAX_HOSTNAME_LENGTH);
+  to->port = from->port;
+  to->method = from->method;
+  to->ssl_ctx = from->ssl_ctx;
+  to->keepAliveRefused = from->keepAliveRefused;
+  to->connected = -1;
+}
+
+/**
+* @brief One stream of a parallel download: its own connection (which the load
+*        balancer may send to a different replica) fetching ranges until none are left.
+*/
+void *thread_downloadStream(void *arg) {
+  struct ParallelDownload *download = arg;
+  struct SSL_Connection stream;
+  int index;
+
+  copyConnection(&stream, download->server);
+  while ((index = takeRange(download)) >= 0) {
+    finishRange(download, index, fetchRange(download, &stream, &download->ranges[index]) == EXIT_SUCCESS);
+  }
+
+  if (stream.connected == 1) {
+    close_ssl_connection(&stream);
+  }
+  return NULL;
+}
+
+/**
+* @brief Download an MP3 over several connections at once. The part of the file not
+*        on disk yet is split into ranges of at most PARALLEL_RANGE_SIZE bytes, which
+*        'streams' threads fetch with RANGE and write in place with pwrite(). A range
+*        that fails is fetched again on its own. At the end the whole file is checked
+*        against the server's SHA-256 hash.
+*
+*        If the download fails, the file is cut back to the ranges that arrived in
+*        one piece from the start, so the next try (parallel or not) resumes there.
+*
+*        As in downloadMP3(), a complete copy whose hash is in the manifest is only
+*        fetched again if the server's file has changed.
+*/
+int downloadMP3Parallel(struct SSL_Connection *ssl_connection, const char *fileName, int streams) {
+  char request[BUFFER_SIZE];
+  char downloadLocation[BUFFER_SIZE];
+  unsigned char scratch[1];
+  unsigned char computedHash[HASH_SIZE];
+  unsigned char knownHash[HASH_SIZE];
+  char knownHex[2 * HASH_SIZE + 1];
+  unsigned char *leaves = NULL;
+  size_t *bad;
+  size_t badCount;
+  int conditional = 0;
+  struct ParallelDownload download = {0};
+  pthread_t threads[MAX_STREAMS];
+  struct stat st;
+  uint64_t offset = 0;
+  uint64_t complete;
+  int rcount;
+
+  sprintf(downloadLocation, "%s/%s", DEFAULT_DOWNLOAD_LOCATION, fileName);
+  if (stat(downloadLocation, &st) == 0) {
+    offset = st.st_size;
+  }
+
+  // Ask for the first byte only, to learn the file's size, hash and block hashes
+  if (offset > 0 && manifestLookup(fileName, knownHash) == EXIT_SUCCESS) {
+    conditional = 1;
+    rpc_hash_to_hex(knownHash, knownHex);
+    snprintf(request, sizeof(request), "%s 0 1 %s %s %s %s", RPC_RANGE_OPERATION, RPC_BLOCK_HASHES,
+             RPC_IF_NONE_MATCH, knownHex, fileName);
+  } else {
+    snprintf(request, sizeof(request), "%s 0 1 %s %s", RPC_RANGE_OPERATION, RPC_BLOCK_HASHES, fileName);
+  }
+  if (sendRequest(ssl_connection, request) < 0) {
+    fprintf(stderr, "Client: Could not write message to socket: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  if (ssl_connection->reply.status == RPC_STATUS_NOT_MODIFIED) {
+    finishRequest(ssl_connection);
+    printf("Client: '%s' is already up to date in %s\n", fileName, downloadLocation);
+    return EXIT_SUCCESS;
+  }
+  if (ssl_connection->reply.status != RPC_STATUS_OK) {
+    printServerError(&ssl_connection->reply);
+    finishRequest(ssl_connection);
+    return EXIT_FAILURE;
+  }
+  download.fileSize = ssl_connection->reply.file_size;
+  if ((ssl_connection->reply.flags & RPC_FLAG_BLOCK_HASHES) &&
+      (leaves = readBlockHashes(ssl_connection)) == NULL) {
+    fprintf(stderr, "Client: Could not read the block hashes of '%s'\n", fileName);
+    close_ssl_connection(ssl_connection);
+    return EXIT_FAILURE;
+  }
+  while ((rcount = readReply(ssl_connection, scratch, sizeof(scratch))) > 0) {
+  }
+  if (rcount < 0 || readTrailer(ssl_connection, download.hash) != EXIT_SUCCESS) {
+    free(leaves);
+    close_ssl_connection(ssl_connection);
+    return EXIT_FAILURE;
+  }
+  finishRequest(ssl_connection);
+
+  if (conditional) {
+    // Our complete copy is an old version of the file
+    offset = 0;
+  } else if (offset > download.fileSize) {
+    // Our copy is longer than the server's, so it is not a partial download of it
+    fprintf(stderr, "Client: Local copy of '%s' does not match the server's, starting over\n", fileName);
+    offset = 0;
+  }
+
+  download.fd = open(downloadLocation, O_WRONLY | O_CREAT | (conditional ? O_TRUNC : 0), S_IRUSR | S_IWUSR);
+  if (download.fd < 0) {
+    fprintf(stderr, "Client: Could not open file \"%s\" for writing: %s\n", downloadLocation, strerror(errno));
+    free(leaves);
+    return EXIT_FAILURE;
+  }
+  if (offset > 0 && offset < download.fileSize) {
+    printf("Client: Resuming '%s' at byte %llu of %llu\n", fileName,
+           (unsigned long long)offset, (unsigned long long)download.fileSize);
+  }
+#ifdef FALLOC_FL_KEEP_SIZE
+  if (download.fileSize > offset) {
+    fallocate(download.fd, FALLOC_FL_KEEP_SIZE, offset, download.fileSize - offset);
+  }
+#endif
+
+  // Split what is missing into ranges. Smaller files get smaller ranges, so every
+  // stream still has something to do.
+  uint64_t missing = download.fileSize - offset;
+  uint64_t rangeSize = (missing + streams - 1) / streams;
+  if (rangeSize > PARALLEL_RANGE_SIZE) {
+    rangeSize = PARALLEL_RANGE_SIZE;
+  }
+  if (rangeSize == 0) {
+    rangeSize = 1;
+  }
+  download.rangeCount = (missing + rangeSize - 1) / rangeSize;
+  download.ranges = calloc(download.rangeCount > 0 ? download.rangeCount : 1, sizeof(struct ByteRange));
+  for (int i = 0; i < download.rangeCount; i++) {
+    download.ranges[i].offset = offset + i * rangeSize;
+    download.ranges[i].length = download.fileSize - download.ranges[i].offset < rangeSize ?
+                                download.fileSize - download.ranges[i].offset : rangeSize;
+  }
+  download.rangesLeft = download.rangeCount;
+  download.server = ssl_connection;
+  download.fileName = fileName;
+  download.received = offset;
+  download.percent = -1;
+  pthread_mutex_init(&download.lock, NULL);
+  pthread_cond_init(&download.changed, NULL);
+
+  if (streams > download.rangeCount) {
+    streams = download.rangeCount;
+  }
+  for (int i = 0; i < streams; i++) {
+    if (pthread_create(&threads[i], NULL, thread_downloadStream, &download) != 0) {
+      fprintf(stderr, "Client: Could not start download stream %d\n", i + 1);
+      streams = i;
+      break;
+    }
+  }
+  for (int i = 0; i < streams; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  if (download.percent >= 0) {
+    printf("\n");
+  }
+  if (streams == 0 && download.rangesLeft > 0) {
+    download.failed = 1;
+  }
+
+  // Keep only the part that arrived in one piece from the start
+  complete = offset;
+  for (int i = 0; i < download.rangeCount && download.ranges[i].state == RANGE_DONE; i++) {
+    complete = download.ranges[i].offset + download.ranges[i].length;
+  }
+  ftruncate(download.fd, download.failed ? complete : download.fileSize);
+  close(download.fd);
+  ssl_connection->fetched += download.received - offset;
+  free(download.ranges);
+  pthread_mutex_destroy(&download.lock);
+  pthread_cond_destroy(&download.changed);
+
+  if (download.failed) {
+    fprintf(stderr, "Client: Parallel download of '%s' failed, keeping the first %llu bytes\n",
+            fileName, (unsigned long long)complete);
+    free(leaves);
+    return EXIT_FAILURE;
+  }
+
+  // Check the whole file, including any part kept from an earlier try. If it does
+  // not match, the block hashes say which blocks are damaged, and only those are
+  // fetched again.
+  if (hashFile(downloadLocation, computedHash) != EXIT_SUCCESS) {
+    fprintf(stderr, "Client: Could not read back \"%s\": %s\n", downloadLocation, strerror(errno));
+    free(leaves);
+    return EXIT_FAILURE;
+  }
+  if (memcmp(computedHash, download.hash, HASH_SIZE) != 0 && leaves != NULL) {
+    badCount = findDamagedBlocks(downloadLocation, leaves, download.fileSize, &bad);
+    if (badCount > 0 && refetchBlocks(ssl_connection, fileName, downloadLocation, leaves, download.fileSize,
+                                      bad, badCount) == EXIT_SUCCESS) {
+      hashFile(downloadLocation, computedHash);
+    }
+    free(bad);
+  }
+  free(leaves);
+  if (memcmp(computedHash, download.hash, HASH_SIZE) != 0) {
     fprintf(stderr, "Hash mismatch! Download of '%s' may be corrupted.\n", fileName);
-  } else
-  {
-    printf("Client: Hash verified and succesfully downloaded file to: %s\n", downloadLocation);
+    truncate(downloadLocation, 0);
+    return EXIT_FAILURE;
   }
 
-  close_ssl_connection(ssl_connection);
+  manifestRecord(fileName, computedHash);
+  printf("Client: Hash verified and succesfully downloaded file to: %s\n", downloadLocation);
   return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+/**
+* @brief Ask the server for the SHA-256 hash of one of its MP3s. On failure the
+*        reply header says whether the server does not have the file.
+*/
+int requestHash(struct SSL_Connection *ssl_connection, const char *fileName, unsigned char hash[HASH_SIZE]) {
+  char request[BUFFER_SIZE];
+  int rcount;
+  int total = 0;
+
+  snprintf(request, sizeof(request), "%s %s", RPC_HASH_OPERATION, fileName);
+  if (sendRequest(ssl_connection, request) <= 0) {
+    fprintf(stderr, "Client: Could not write message to socket: %s\n", strerror(errno));
+    finishRequest(ssl_connection);
+    return EXIT_FAILURE;
+  }
+  if (ssl_connection->reply.status == RPC_STATUS_OK) {
+    while (total < HASH_SIZE &&
+           (rcount = readReply(ssl_connection, hash + total, HASH_SIZE - total)) > 0) {
+      total += rcount;
+    }
+  }
+  finishRequest(ssl_connection);
+  return total == HASH_SIZE ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+* @brief Check a downloaded MP3 against the server's copy by comparing the SHA-256
+*        hash of the local file with the hash the server reports, without
+*        downloading the file again.
+*/
+int validateMP3(struct SSL_Connection *ssl_connection, char *fileChoice) {
+  unsigned char localHash[HASH_SIZE];
+  unsigned char serverHash[HASH_SIZE];
+  char *fileName = strrchr(fileChoice, '/') ? strrchr(fileChoice, '/') + 1 : fileChoice;
+
+  // Hash the local copy
+  if (hashFile(fileChoice, localHash) != EXIT_SUCCESS) {
+    fprintf(stderr, "Client: Could not open file \"%s\" for reading: %s\n", fileChoice, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  // Ask the server for its hash
+  if (requestHash(ssl_connection, fileName, serverHash) != EXIT_SUCCESS) {
+    if (ssl_connection->reply.status == RPC_STATUS_FILE_ERROR) {
+      fprintf(stderr, "Client: Server does not have '%s'\n", fileName);
+    } else {
+      fprintf(stderr, "Client: Could not read hash of '%s' from server\n", fileName);
+    }
+    return EXIT_FAILURE;
+  }
+
+  if (memcmp(localHash, serverHash, HASH_SIZE) == 0) {
+    printf("Client: '%s' matches the server's copy\n", fileName);
+    return EXIT_SUCCESS;
+  }
+  printf("Client: '%s' does not match the server's copy, download it again\n", fileName);
+  return EXIT_FAILURE;
+}
+
+/**
+* @brief Download an MP3, over several connections if 'streams' is more than one,
+*        trying again up to MAX_RETRIES times. Each retry picks up where the partial
+*        file on disk left off. A server that is too busy is tried again after a
+*        wait that doubles each time; a file the server refuses is not tried again.
+*/
+int downloadWithRetries(struct SSL_Connection *ssl_connection, const char *fileName, int streams) {
+  int downloadTries = 1;
+  int downloadResult;
+
+  while (1) {
+    if (streams > 1) {
+      initialize_context(ssl_connection);
+      downloadResult = downloadMP3Parallel(ssl_connection, fileName, streams);
+    } else {
+      downloadResult = downloadMP3(ssl_connection, fileName, NULL);
+    }
+    if (downloadResult != EXIT_SUCCESS && downloadTries <= MAX_RETRIES &&
+        ssl_connection->reply.status == RPC_STATUS_RPC_ERROR && ssl_connection->reply.error == RPC_ERROR_BUSY) {
+      printf("SERVER BUSY, RETRYING IN %d SECONDS -- Try %d of %d\n", 1 << downloadTries, downloadTries, MAX_RETRIES);
+      sleep(1 << downloadTries);
+      downloadTries++;
+      continue;
+    }
+    // EINVAL means our partial copy did not fit the server's file and was thrown away
+    if (downloadResult == EXIT_SUCCESS || downloadTries > MAX_RETRIES ||
+        (ssl_connection->reply.status != RPC_STATUS_OK && ssl_connection->reply.error != EINVAL)) {
+      return downloadResult;
+    }
+    printf("DOWNLOAD FAILED RETRYING -- Try %d of %d\n", downloadTries, MAX_RETRIES);
+    downloadTries++;
+  }
+}
+
+/**
+* @brief Get the names from a LIST or SEARCH reply. Returns how many there are, or
+*        -1 if the request failed. The caller frees each name and the array.
+*/
+int requestNames(struct SSL_Connection *ssl_connection, const char *request, char ***names) {
+  char *listing = NULL;
+  size_t length = 0;
+  size_t capacity = 0;
+  int count = 0;
+  int rcount;
+
+  *names = NULL;
+  if (sendRequest(ssl_connection, request) < 0) {
+    fprintf(stderr, "Client: Could not write message to socket: %s\n", strerror(errno));
+    return -1;
+  }
+  if (ssl_connection->reply.status != RPC_STATUS_OK) {
+    printServerError(&ssl_connection->reply);
+    finishRequest(ssl_connection);
+    return -1;
+  }
+
+  // The body is one name per line
+  do {
+    if (capacity - length < DOWNLOAD_BUFFER_SIZE) {
+      capacity = capacity ? capacity * 2 : 4 * DOWNLOAD_BUFFER_SIZE;
+      listing = realloc(listing, capacity + 1);
+      if (listing == NULL) {
+        fprintf(stderr, "Client: Out of memory reading the list of MP3s\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    rcount = readReply(ssl_connection, listing + length, capacity - length);
+    if (rcount > 0) {
+      length += rcount;
+    }
+  } while (rcount > 0);
+  finishRequest(ssl_connection);
+  if (rcount < 0) {
+    free(listing);
+    return -1;
+  }
+
+  listing[length] = '\0';
+  for (char *line = strtok(listing, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+    if ((count & (count - 1)) == 0) {
+      *names = realloc(*names, (count ? count * 2 : 1) * sizeof(char *));
+    }
+    (*names)[count++] = strdup(line);
+  }
+  free(listing);
+  return count;
+}
+
+/**
+* @brief One transfer of a mirror: its own connection taking names off the list
+*        until there are none left. A file whose local copy is current costs one
+*        conditional request and is counted as up to date.
+*/
+void *thread_mirror(void *arg) {
+  struct Mirror *mirror = arg;
+  struct SSL_Connection transfer;
+  const char *fileName;
+  const char *outcome;
+  uint64_t before;
+  int index;
+
+  copyConnection(&transfer, mirror->server);
+  while (1) {
+    pthread_mutex_lock(&mirror->lock);
+    index = mirror->next < mirror->nameCount ? mirror->next++ : -1;
+    pthread_mutex_unlock(&mirror->lock);
+    if (index < 0) {
+      break;
+    }
+
+    fileName = mirror->names[index];
+    before = transfer.fetched;
+    if (downloadWithRetries(&transfer, fileName, mirror->streams) != EXIT_SUCCESS) {
+      outcome = "FAILED";
+    } else if (transfer.fetched == before) {
+      outcome = "up to date"; // Not modified, or a complete copy the server's hash confirmed
+    } else {
+      outcome = "downloaded";
+    }
+
+    pthread_mutex_lock(&mirror->lock);
+    mirror->received += transfer.fetched - before;
+    if (outcome[0] == 'u') {
+      mirror->upToDate++;
+    } else if (outcome[0] == 'd') {
+      mirror->downloaded++;
+    } else {
+      mirror->failed++;
+    }
+    printf("Mirror: [%d/%d] %s: %s\n", mirror->downloaded + mirror->upToDate + mirror->failed,
+           mirror->nameCount, fileName, outcome);
+    fflush(stdout);
+    pthread_mutex_unlock(&mirror->lock);
+  }
+
+  if (transfer.connected == 1) {
+    close_ssl_connection(&transfer);
+  }
+  return NULL;
+}
+
+/**
+* @brief Download every MP3 the server lists, or every match for 'searchTerm', into
+*        the download folder with 'transfers' files in flight at once, then print
+*        how long it took. Returns EXIT_FAILURE if any file could not be downloaded.
+*/
+int mirrorCatalog(struct SSL_Connection *ssl_connection, const char *searchTerm, int transfers, int streams) {
+  char request[BUFFER_SIZE];
+  struct Mirror mirror = {0};
+  pthread_t threads[MAX_TRANSFERS];
+  struct timespec started, finished;
+  double seconds;
+
+  if (searchTerm != NULL) {
+    snprintf(request, sizeof(request), "%s %s", RPC_SEARCH_OPERATION, searchTerm);
+  } else {
+    snprintf(request, sizeof(request), "%s", RPC_LIST_OPERATION);
+  }
+  mirror.nameCount = requestNames(ssl_connection, request, &mirror.names);
+  if (mirror.nameCount < 0) {
+    fprintf(stderr, "Client: Could not get the list of MP3s to mirror\n");
+    return EXIT_FAILURE;
+  }
+  if (mkdir(DEFAULT_DOWNLOAD_LOCATION, S_IRWXU) < 0 && errno != EEXIST) {
+    fprintf(stderr, "Client: Could not create \"%s\": %s\n", DEFAULT_DOWNLOAD_LOCATION, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  printf("Mirror: %d MP3s, %d at a time\n", mirror.nameCount, transfers);
+
+  // Progress bars from several downloads at once would print over each other
+  showProgress = transfers == 1;
+  mirror.server = ssl_connection;
+  mirror.streams = streams;
+  pthread_mutex_init(&mirror.lock, NULL);
+  if (transfers > mirror.nameCount) {
+    transfers = mirror.nameCount;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  for (int i = 0; i < transfers; i++) {
+    if (pthread_create(&threads[i], NULL, thread_mirror, &mirror) != 0) {
+      fprintf(stderr, "Client: Could not start transfer %d\n", i + 1);
+      transfers = i;
+      break;
+    }
+  }
+  if (transfers == 0) {
+    thread_mirror(&mirror);
+  }
+  for (int i = 0; i < transfers; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &finished);
+  seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+
+  printf("\nMirror: %d downloaded, %d already up to date, %d failed\n",
+         mirror.downloaded, mirror.upToDate, mirror.failed);
+  printf("Mirror: Fetched %.1f MB in %.1f s (%.2f MB/s, %.2f files/s)\n", mirror.received / 1e6, seconds,
+         seconds > 0 ? mirror.received / 1e6 / seconds : 0.0,
+         seconds > 0 ? (mirror.downloaded + mirror.upToDate) / seconds : 0.0);
+
+  for (int i = 0; i < mirror.nameCount; i++) {
+    free(mirror.names[i]);
+  }
+  free(mirror.names);
+  pthread_mutex_destroy(&mirror.lock);
+  return mirror.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
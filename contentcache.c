@@ -0,0 +1,293 @@
+/**
+* @file contentcache.c
+* @author Corey Brantley, Shen Knoll, Harrison Sherwin
+* @brief  Keeps the contents of recently downloaded MP3 files in memory, so the
+*         few popular tracks that get most of the traffic are sent straight from
+*         the heap instead of being read from disk for every request. Pods run
+*         with small memory limits, and the kernel page cache is the first thing
+*         to go under pressure, so the cache has a byte budget of its own.
+*
+*         Entries are found through a hash table on the track name and evicted in
+*         least recently used order once the budget is spent. Each entry stores
+*         the identity of the file it was read from (inode, size and modification
+*         time), like the library's digests, and a lookup only hits when the file
+*         on disk still has that identity. The digest stored with an entry is the
+*         hash of exactly the bytes in it: it comes from the library when the file
+*         was unchanged while it was read, and is computed from the bytes otherwise.
+*
+*         One mutex guards the table and the LRU list. It is only held to find,
+*         link and unlink entries; files are read and hashed outside it. Readers
+*         hold a reference to the entry they are sending, so an entry that is
+*         evicted mid-send is freed when the last reader releases it.
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "contentcache.h"
+#include "library.h"
+
+#define BUCKET_COUNT    256
+#define MAX_ENTRY_SHARE 4 // No single file may take more than 1/4 of the budget
+
+static struct {
+    pthread_mutex_t lock;
+    struct content_entry *buckets[BUCKET_COUNT];
+    struct content_entry *newest;
+    struct content_entry *oldest;
+    size_t budget;
+    size_t bytes;
+    size_t entries;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long bypasses;
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * @brief FNV-1a hash of a track name, to pick its bucket.
+ */
+static size_t bucket_of(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    }
+    return hash % BUCKET_COUNT;
+}
+
+static bool same_file(const struct content_entry *entry, const struct stat *st) {
+    return entry->inode == st->st_ino && entry->size == st->st_size &&
+           entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void free_entry(struct content_entry *entry) {
+    free(entry->name);
+    free(entry->data);
+    free(entry);
+}
+
+/**
+ * @brief Take an entry out of the table and the LRU list and drop the cache's
+ *        reference to it. The caller holds the lock.
+ */
+static void remove_entry(struct content_entry *entry) {
+    struct content_entry **link = &cache.buckets[bucket_of(entry->name)];
+
+    while (*link != entry) {
+        link = &(*link)->bucket;
+    }
+    *link = entry->bucket;
+
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+    } else {
+        cache.newest = entry->older;
+    }
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        cache.oldest = entry->newer;
+    }
+
+    cache.bytes -= entry->size;
+    cache.entries--;
+    content_cache_release(entry);
+}
+
+/**
+ * @brief Move an entry to the most recently used end of the list. The caller
+ *        holds the lock.
+ */
+static void touch_entry(struct content_entry *entry) {
+    if (cache.newest == entry) {
+        return;
+    }
+    entry->newer->older = entry->older;
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        cache.oldest = entry->newer;
+    }
+    entry->older = cache.newest;
+    entry->newer = NULL;
+    cache.newest->newer = entry;
+    cache.newest = entry;
+}
+
+/**
+ * @brief Read a whole file into a new entry, with the digest of what was read.
+ *
+ * @return The entry, or NULL if the file could not be read or changed from what
+ *         the caller saw while it was being read.
+ */
+static struct content_entry *load_entry(const char *name, const char *path, const struct stat *st) {
+    struct content_entry *entry = calloc(1, sizeof(*entry));
+    struct stat before, after;
+    off_t done = 0;
+    int fd = -1;
+
+    if (entry == NULL || (entry->name = strdup(name)) == NULL ||
+        (entry->data = malloc(st->st_size > 0 ? st->st_size : 1)) == NULL) {
+        goto fail;
+    }
+    entry->inode = st->st_ino;
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtim;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &before) < 0 || !same_file(entry, &before)) {
+        goto fail;
+    }
+    while (done < entry->size) {
+        ssize_t bytes = pread(fd, entry->data + done, entry->size - done, done);
+        if (bytes <= 0) {
+            goto fail;
+        }
+        done += bytes;
+    }
+    if (fstat(fd, &after) < 0 || !same_file(entry, &after)) {
+        goto fail; // Written to while we read it
+    }
+    close(fd);
+
+    // The library's digest is for this identity, which did not change while we
+    // read, so it is the digest of these bytes. Otherwise hash them ourselves.
+    if (!library_get_hash(name, &after, entry->digest)) {
+        SHA256(entry->data, entry->size, entry->digest);
+    }
+
+    atomic_init(&entry->references, 1);
+    return entry;
+
+fail:
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (entry != NULL) {
+        free_entry(entry);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Set the cache's byte budget. A budget of 0 turns the cache off.
+ *
+ * @param budget - Most bytes of file contents to keep in memory.
+ * @return true (the cache allocates nothing up front).
+ */
+bool content_cache_init(size_t budget) {
+    pthread_mutex_lock(&cache.lock);
+    cache.budget = budget;
+    while (cache.bytes > cache.budget) {
+        remove_entry(cache.oldest);
+        cache.evictions++;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return true;
+}
+
+/**
+ * @brief Get the contents of a file from the cache, reading it in on a miss and
+ *        evicting the least recently used files to make room.
+ *
+ * @param name - The track's name, which is the cache key.
+ * @param path - Where the file is on disk.
+ * @param st - The file's current status, as the caller just saw it.
+ * @return A referenced entry that the caller must give back with
+ *         content_cache_release(), or NULL if the file is not cached and cannot
+ *         be (the cache is off, the file is too large, or it is changing). The
+ *         caller then reads the file itself.
+ */
+struct content_entry *content_cache_get(const char *name, const char *path, const struct stat *st) {
+    struct content_entry *entry;
+    struct content_entry *loaded;
+
+    pthread_mutex_lock(&cache.lock);
+    if (cache.budget == 0 || (size_t)st->st_size > cache.budget / MAX_ENTRY_SHARE) {
+        if (cache.budget > 0) {
+            cache.bypasses++;
+        }
+        pthread_mutex_unlock(&cache.lock);
+        return NULL;
+    }
+    for (entry = cache.buckets[bucket_of(name)]; entry != NULL; entry = entry->bucket) {
+        if (strcmp(entry->name, name) == 0) {
+            break;
+        }
+    }
+    if (entry != NULL && same_file(entry, st)) {
+        cache.hits++;
+        touch_entry(entry);
+        atomic_fetch_add(&entry->references, 1);
+        pthread_mutex_unlock(&cache.lock);
+        return entry;
+    }
+    cache.misses++;
+    pthread_mutex_unlock(&cache.lock);
+
+    // Read the file without holding the lock, so other tracks are still served
+    loaded = load_entry(name, path, st);
+    if (loaded == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    // Another thread may have loaded the same file, or an older copy, meanwhile
+    for (entry = cache.buckets[bucket_of(name)]; entry != NULL; entry = entry->bucket) {
+        if (strcmp(entry->name, name) == 0) {
+            remove_entry(entry);
+            break;
+        }
+    }
+    while (cache.bytes + loaded->size > cache.budget && cache.oldest != NULL) {
+        remove_entry(cache.oldest);
+        cache.evictions++;
+    }
+
+    size_t bucket = bucket_of(name);
+    loaded->bucket = cache.buckets[bucket];
+    cache.buckets[bucket] = loaded;
+    loaded->older = cache.newest;
+    loaded->newer = NULL;
+    if (cache.newest != NULL) {
+        cache.newest->newer = loaded;
+    } else {
+        cache.oldest = loaded;
+    }
+    cache.newest = loaded;
+    cache.bytes += loaded->size;
+    cache.entries++;
+    atomic_fetch_add(&loaded->references, 1); // One for the cache, one for the caller
+    pthread_mutex_unlock(&cache.lock);
+    return loaded;
+}
+
+/**
+ * @brief Give back an entry from content_cache_get(). An entry that has been
+ *        evicted is freed when its last reader gives it back.
+ */
+void content_cache_release(struct content_entry *entry) {
+    if (atomic_fetch_sub(&entry->references, 1) == 1) {
+        free_entry(entry);
+    }
+}
+
+/**
+ * @brief Copy the cache's counters.
+ */
+void content_cache_stats(struct content_cache_stats *stats) {
+    pthread_mutex_lock(&cache.lock);
+    stats->hits = cache.hits;
+    stats->misses = cache.misses;
+    stats->evictions = cache.evictions;
+    stats->bypasses = cache.bypasses;
+    stats->entries = cache.entries;
+    stats->bytes = cache.bytes;
+    stats->budget = cache.budget;
+    pthread_mutex_unlock(&cache.lock);
+}
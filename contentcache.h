@@ -0,0 +1,43 @@
+#ifndef _CONTENTCACHE_H
+#define _CONTENTCACHE_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+
+// The contents of one file held in memory, with the SHA-256 digest of exactly those
+// bytes. An entry never changes once it is in the cache; a file that changes on
+// disk gets a new entry, and the old one is freed when its last reader is done.
+struct content_entry {
+    char *name;
+    ino_t inode;
+    off_t size;
+    struct timespec mtime;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    unsigned char *data;
+    atomic_int references;
+    struct content_entry *newer;  // Least recently used order
+    struct content_entry *older;
+    struct content_entry *bucket; // Next entry in the same hash bucket
+};
+
+// Counters for how the cache is doing
+struct content_cache_stats {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long bypasses; // Files too large to cache
+    size_t entries;
+    size_t bytes;
+    size_t budget;
+};
+
+// A byte-budgeted LRU cache of hot MP3 files, shared by every worker thread
+bool content_cache_init(size_t budget);
+struct content_entry *content_cache_get(const char *name, const char *path, const struct stat *st);
+void content_cache_release(struct content_entry *entry);
+void content_cache_stats(struct content_cache_stats *stats);
+
+#endif
@@ -0,0 +1,399 @@
+/**
+* @file downloadpipe.c
+* @author Corey Brantley, Shen Knoll, Harrison Sherwin
+* @brief  The receive side of a download, split into three stages that overlap:
+*         the caller reads from the network into large buffers, one thread hashes
+*         them and another writes them to the file. The buffers come from a small
+*         fixed pool and go back to it once both the hasher and the writer are done
+*         with them, so a slow disk or a slow hash only holds up the network once
+*         the whole pool is in use.
+*
+*         The hash covers the whole file: whatever was already on disk before the
+*         download's offset is read back and hashed on the hashing thread while the
+*         rest arrives.
+*
+*         Given the server's block hashes, the hashing thread also checks every
+*         block against its leaf (see blockhash.c) and lists the ones that do not
+*         match, so they can be fetched again on their own. downloadPipeDamaged()
+*         tells the receiver as soon as a block it sent was bad, so it can stop
+*         early.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "downloadpipe.h"
+#include "blockhash.h"
+
+#define PIPE_BUFFERS 8                 // Buffers in the pool
+#define PIPE_BUFFER_SIZE (128 * 1024)  // Each one holds several TLS records
+
+struct pipe_buffer {
+    unsigned char *data;
+    size_t length;
+    off_t position;           // Where in the file it goes
+};
+
+struct download_pipe {
+    int fd;
+    off_t prefix;             // Bytes on disk before the download started
+    off_t position;           // Where the next submitted buffer goes
+    off_t durable;            // Everything before this has been written
+    pthread_mutex_t lock;
+    pthread_cond_t changed;   // Broadcast whenever a stage moves on
+
+    // The n'th buffer submitted is buffers[n % PIPE_BUFFERS]. Each stage counts the
+    // buffers it has finished with; a buffer is free again once both the hasher and
+    // the writer have passed it.
+    struct pipe_buffer buffers[PIPE_BUFFERS];
+    unsigned long filled;
+    unsigned long hashed;
+    unsigned long written;
+    int ended;                // No more buffers will be submitted
+    int error;                // errno of the first failed read or write, or 0
+
+    EVP_MD_CTX *sha256;       // Only the hashing thread uses it until the pipe is closed
+
+    // Checking blocks against the server's leaves, when there are any. Only the
+    // hashing thread touches these, apart from the list of bad blocks and 'damaged',
+    // which are guarded by the lock.
+    struct download_blocks *blocks;
+    EVP_MD_CTX *leaf;         // Digest of the block being hashed
+    size_t block;             // Index of that block
+    size_t blockFilled;       // Bytes of it hashed so far
+    int damaged;              // A block with received bytes in it did not match
+    pthread_t hasher;
+    pthread_t writer;
+    int hasherStarted;
+    int writerStarted;
+};
+
+/**
+ * @brief Stop the pipe after a failed read or write. The receiver finds out from
+ *        its next downloadPipeBuffer() and the other stages stop where they are.
+ */
+static void failPipe(struct download_pipe *pipe, int error) {
+    pthread_mutex_lock(&pipe->lock);
+    if (pipe->error == 0) {
+        pipe->error = error;
+    }
+    pthread_cond_broadcast(&pipe->changed);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+/**
+ * @brief Note a block that did not match its leaf. A block that holds any of the
+ *        bytes received this time marks the pipe damaged.
+ */
+static void badBlock(struct download_pipe *pipe) {
+    struct download_blocks *blocks = pipe->blocks;
+    size_t *bad;
+
+    pthread_mutex_lock(&pipe->lock);
+    bad = realloc(blocks->bad, (blocks->badCount + 1) * sizeof(*bad));
+    if (bad != NULL) {
+        blocks->bad = bad;
+        blocks->bad[blocks->badCount++] = pipe->block;
+        pipe->damaged |= (uint64_t)(pipe->block + 1) * RPC_BLOCK_SIZE > (uint64_t)pipe->prefix;
+    }
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+/**
+ * @brief Add the next bytes of the file to the whole-file hash and, when there are
+ *        block hashes, to the digest of each block they fall in, checking every
+ *        block as its last byte goes in.
+ */
+static void hashData(struct download_pipe *pipe, const unsigned char *data, size_t length) {
+    struct download_blocks *blocks = pipe->blocks;
+    unsigned char leaf[BLOCK_HASH_SIZE];
+
+    EVP_DigestUpdate(pipe->sha256, data, length);
+    while (blocks != NULL && length > 0 && pipe->block < blocks->count) {
+        uint64_t start = (uint64_t)pipe->block * RPC_BLOCK_SIZE;
+        size_t blockLength = blocks->size - start < RPC_BLOCK_SIZE ? blocks->size - start : RPC_BLOCK_SIZE;
+        size_t piece = blockLength - pipe->blockFilled < length ? blockLength - pipe->blockFilled : length;
+
+        if (pipe->blockFilled == 0) {
+            block_leaf_init(pipe->leaf);
+        }
+        EVP_DigestUpdate(pipe->leaf, data, piece);
+        pipe->blockFilled += piece;
+        data += piece;
+        length -= piece;
+        if (pipe->blockFilled == blockLength) {
+            EVP_DigestFinal_ex(pipe->leaf, leaf, NULL);
+            if (memcmp(leaf, blocks->leaves + pipe->block * BLOCK_HASH_SIZE, BLOCK_HASH_SIZE) != 0) {
+                badBlock(pipe);
+            }
+            pipe->block++;
+            pipe->blockFilled = 0;
+        }
+    }
+}
+
+/**
+ * @brief Hash the part of the file kept from an earlier try, reading it back from
+ *        disk, then every buffer in the order it was received.
+ */
+static void *hashThread(void *arg) {
+    struct download_pipe *pipe = arg;
+    struct pipe_buffer *buffer;
+    unsigned char *data = malloc(PIPE_BUFFER_SIZE);
+    off_t position = 0;
+    ssize_t rcount = 0;
+
+    while (data != NULL && position < pipe->prefix) {
+        size_t size = pipe->prefix - position < PIPE_BUFFER_SIZE ? pipe->prefix - position : PIPE_BUFFER_SIZE;
+        if ((rcount = pread(pipe->fd, data, size, position)) <= 0) {
+            break;
+        }
+        hashData(pipe, data, rcount);
+        position += rcount;
+    }
+    if (position < pipe->prefix) {
+        failPipe(pipe, data == NULL ? ENOMEM : rcount < 0 ? errno : EIO);
+        free(data);
+        return NULL;
+    }
+    free(data);
+
+    pthread_mutex_lock(&pipe->lock);
+    for (;;) {
+        while (pipe->hashed == pipe->filled && !pipe->ended && !pipe->error) {
+            pthread_cond_wait(&pipe->changed, &pipe->lock);
+        }
+        if (pipe->hashed == pipe->filled || pipe->error) {
+            break;
+        }
+        buffer = &pipe->buffers[pipe->hashed % PIPE_BUFFERS];
+        pthread_mutex_unlock(&pipe->lock);
+        hashData(pipe, buffer->data, buffer->length);
+        pthread_mutex_lock(&pipe->lock);
+        pipe->hashed++;
+        pthread_cond_broadcast(&pipe->changed);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+    return NULL;
+}
+
+/**
+ * @brief Write a whole buffer into place.
+ *
+ * @return 0, or the errno of the failed write.
+ */
+static int writeBuffer(int fd, const struct pipe_buffer *buffer) {
+    size_t done = 0;
+    ssize_t wcount;
+
+    while (done < buffer->length) {
+        wcount = pwrite(fd, buffer->data + done, buffer->length - done, buffer->position + done);
+        if (wcount < 0 && errno != EINTR) {
+            return errno;
+        }
+        done += wcount > 0 ? wcount : 0;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write each buffer to the file in turn with pwrite().
+ */
+static void *writeThread(void *arg) {
+    struct download_pipe *pipe = arg;
+    struct pipe_buffer *buffer;
+    int error;
+
+    pthread_mutex_lock(&pipe->lock);
+    for (;;) {
+        while (pipe->written == pipe->filled && !pipe->ended && !pipe->error) {
+            pthread_cond_wait(&pipe->changed, &pipe->lock);
+        }
+        if (pipe->written == pipe->filled || pipe->error) {
+            break;
+        }
+        buffer = &pipe->buffers[pipe->written % PIPE_BUFFERS];
+        pthread_mutex_unlock(&pipe->lock);
+        error = writeBuffer(pipe->fd, buffer);
+        pthread_mutex_lock(&pipe->lock);
+        if (error != 0) {
+            pipe->error = pipe->error ? pipe->error : error;
+            pthread_cond_broadcast(&pipe->changed);
+            break;
+        }
+        pipe->durable = buffer->position + buffer->length;
+        pipe->written++;
+        pthread_cond_broadcast(&pipe->changed);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+    return NULL;
+}
+
+/**
+ * @brief Start the hashing and writing threads for a download into 'fd', which
+ *        must be open for reading and writing.
+ *
+ * @param offset - Where the download starts. The bytes before it are already in
+ *        the file and are hashed from there.
+ * @param blocks - The server's block hashes to check the whole file against, or
+ *        NULL to only hash it.
+ * @return The pipe, or NULL if it could not be set up.
+ */
+struct download_pipe *downloadPipeOpen(int fd, off_t offset, struct download_blocks *blocks) {
+    struct download_pipe *pipe = calloc(1, sizeof(*pipe));
+    unsigned char hash[DOWNLOAD_PIPE_HASH_SIZE];
+
+    if (pipe == NULL) {
+        return NULL;
+    }
+    pipe->fd = fd;
+    pipe->prefix = offset;
+    pipe->position = offset;
+    pipe->durable = offset;
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->changed, NULL);
+    if ((pipe->sha256 = EVP_MD_CTX_new()) == NULL || !block_digest_init(pipe->sha256)) {
+        downloadPipeClose(pipe, hash);
+        return NULL;
+    }
+    if (blocks != NULL) {
+        blocks->bad = NULL;
+        blocks->badCount = 0;
+        pipe->blocks = blocks;
+        if ((pipe->leaf = EVP_MD_CTX_new()) == NULL) {
+            downloadPipeClose(pipe, hash);
+            return NULL;
+        }
+    }
+    for (int i = 0; i < PIPE_BUFFERS; i++) {
+        if ((pipe->buffers[i].data = malloc(PIPE_BUFFER_SIZE)) == NULL) {
+            downloadPipeClose(pipe, hash);
+            return NULL;
+        }
+    }
+
+    pipe->hasherStarted = pthread_create(&pipe->hasher, NULL, hashThread, pipe) == 0;
+    pipe->writerStarted = pthread_create(&pipe->writer, NULL, writeThread, pipe) == 0;
+    if (!pipe->hasherStarted || !pipe->writerStarted) {
+        downloadPipeClose(pipe, hash);
+        return NULL;
+    }
+    return pipe;
+}
+
+/**
+ * @brief Wait for a free buffer to receive into.
+ *
+ * @param size - Set to how many bytes the buffer holds.
+ * @return The buffer, or NULL with errno set if the pipe has failed.
+ */
+unsigned char *downloadPipeBuffer(struct download_pipe *pipe, size_t *size) {
+    unsigned char *data = NULL;
+    unsigned long slowest;
+
+    pthread_mutex_lock(&pipe->lock);
+    for (;;) {
+        slowest = pipe->hashed < pipe->written ? pipe->hashed : pipe->written;
+        if (pipe->error || pipe->filled - slowest < PIPE_BUFFERS) {
+            break;
+        }
+        pthread_cond_wait(&pipe->changed, &pipe->lock);
+    }
+    if (pipe->error) {
+        errno = pipe->error;
+    } else {
+        data = pipe->buffers[pipe->filled % PIPE_BUFFERS].data;
+        *size = PIPE_BUFFER_SIZE;
+    }
+    pthread_mutex_unlock(&pipe->lock);
+    return data;
+}
+
+/**
+ * @brief Check whether a block holding received bytes has failed its check, in
+ *        which case the rest of the download is not worth receiving.
+ */
+int downloadPipeDamaged(struct download_pipe *pipe) {
+    int damaged;
+
+    pthread_mutex_lock(&pipe->lock);
+    damaged = pipe->damaged;
+    pthread_mutex_unlock(&pipe->lock);
+    return damaged;
+}
+
+/**
+ * @brief Hand the buffer from the last downloadPipeBuffer() on to be hashed and
+ *        written, with 'length' bytes in it.
+ *
+ * @return 0, or -1 with errno set if the pipe has failed.
+ */
+int downloadPipeSubmit(struct download_pipe *pipe, size_t length) {
+    struct pipe_buffer *buffer;
+    int error;
+
+    pthread_mutex_lock(&pipe->lock);
+    if ((error = pipe->error) == 0 && length > 0) {
+        buffer = &pipe->buffers[pipe->filled % PIPE_BUFFERS];
+        buffer->length = length;
+        buffer->position = pipe->position;
+        pipe->position += length;
+        pipe->filled++;
+        pthread_cond_broadcast(&pipe->changed);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Wait until everything submitted has been written and hashed, then free
+ *        the pipe. The file descriptor is left open. After a failed write the file
+ *        is cut back to the last byte before which everything was written, so a
+ *        later try resumes from there rather than past a hole.
+ *
+ * @param hash - Set to the SHA-256 hash of the whole file, if nothing failed.
+ * @return 0, or -1 with errno set to the first error.
+ */
+int downloadPipeClose(struct download_pipe *pipe, unsigned char hash[DOWNLOAD_PIPE_HASH_SIZE]) {
+    int error;
+
+    pthread_mutex_lock(&pipe->lock);
+    pipe->ended = 1;
+    pthread_cond_broadcast(&pipe->changed);
+    pthread_mutex_unlock(&pipe->lock);
+    if (pipe->hasherStarted) {
+        pthread_join(pipe->hasher, NULL);
+    }
+    if (pipe->writerStarted) {
+        pthread_join(pipe->writer, NULL);
+    }
+
+    error = pipe->error;
+    if (error != 0) {
+        ftruncate(pipe->fd, pipe->durable);
+    }
+    if (error == 0 && (pipe->sha256 == NULL || EVP_DigestFinal_ex(pipe->sha256, hash, NULL) != 1)) {
+        error = EIO;
+    }
+    EVP_MD_CTX_free(pipe->sha256);
+    EVP_MD_CTX_free(pipe->leaf);
+    for (int i = 0; i < PIPE_BUFFERS; i++) {
+        free(pipe->buffers[i].data);
+    }
+    pthread_mutex_destroy(&pipe->lock);
+    pthread_cond_destroy(&pipe->changed);
+    free(pipe);
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
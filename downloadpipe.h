@@ -0,0 +1,28 @@
+#ifndef _DOWNLOADPIPE_H
+#define _DOWNLOADPIPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DOWNLOAD_PIPE_HASH_SIZE 32
+
+// The receive side of a download: buffers filled from the network are hashed and
+// written to the file on threads of their own while the next ones arrive
+struct download_pipe;
+
+struct download_blocks {
+    const unsigned char *leaves; // One leaf per block of the whole file
+    size_t count;
+    uint64_t size;               // Size of the whole file
+    size_t *bad;                 // Set by the pipe: blocks that did not match, in order
+    size_t badCount;             // The caller frees 'bad' once the pipe is closed
+};
+
+struct download_pipe *downloadPipeOpen(int fd, off_t offset, struct download_blocks *blocks);
+int downloadPipeDamaged(struct download_pipe *pipe);
+unsigned char *downloadPipeBuffer(struct download_pipe *pipe, size_t *size);
+int downloadPipeSubmit(struct download_pipe *pipe, size_t length);
+int downloadPipeClose(struct download_pipe *pipe, unsigned char hash[DOWNLOAD_PIPE_HASH_SIZE]);
+
+#endif
@@ -0,0 +1,818 @@
+/**
+* @file library.c
+* @author Corey Brantley, Shen Knoll, Harrison Sherwin
+* @brief  Keeps an in-memory index of the tracks in the MP3 directory and their
+*         SHA-256 digests, so downloads do not have to hash the file every time.
+*
+*         The whole directory is hashed once at startup, spread across one thread
+*         per core. Each digest is stored with the identity of the file it was
+*         computed from (inode, size and modification time), and callers pass in
+*         the identity of the file they opened so a stale digest is never used.
+*         A background thread watches the directory with inotify and re-hashes
+*         only the files that were added or changed.
+*
+*         Each track also gets a tree of block hashes (see blockhash.c), built
+*         while the file is hashed and kept with its digest. At startup the
+*         files are spread across the cores; a single file the watcher re-hashes
+*         is split into runs of blocks that are hashed in parallel instead. A
+*         file the server has to hash on demand is hashed on the request's own
+*         worker, which already runs alongside the others, and its tree is kept
+*         for the next request for the same version of the file.
+*
+*         Readers never take a lock while they use the library. The watcher keeps
+*         its own working list of tracks and, after each batch of changes,
+*         publishes a new immutable snapshot that also holds the ready-made LIST
+*         response and the search index (see searchindex.c). Readers take a
+*         reference to the current snapshot, and the old one is freed when the
+*         last reader releases it.
+*/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+
+#include "library.h"
+#include "blockhash.h"
+#include "workerpool.h"
+#include "searchindex.h"
+
+#define TRACK_EXTENSION  ".mp3"
+#define JOBS_PER_THREAD  4 // Runs of blocks per thread when one file is hashed in parallel
+#define BUILT_TREES      16 // Block trees built on demand that are kept for the next request
+
+// Changes to the directory that can add, replace or remove a track
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB)
+
+struct library_entry {
+    char *name;
+    ino_t inode;
+    off_t size;
+    struct timespec mtime;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    struct block_tree *blocks;
+    bool hashed;
+};
+
+// One share of hashing a file on the worker pool: the leaves of a run of blocks,
+// the digest of the whole file, or both
+struct hash_job {
+    int fd;
+    uint64_t size;
+    size_t first, last;        // Blocks to read
+    struct block_tree *tree;   // Leaves to fill in, or NULL
+    EVP_MD_CTX *sha256;        // Whole-file digest to update, or NULL
+    bool failed;
+};
+
+// The working list of tracks, only touched while loading and by the watcher
+// thread. Entries are kept sorted by name so lookups can use a binary search.
+static struct {
+    char directory[PATH_MAX];
+    int threads;              // Threads to hash one file with
+    struct library_entry *entries;
+    size_t count;
+    size_t capacity;
+} library;
+
+// Block trees the server built on demand for files the library had none for, such
+// as a file that changed since the watcher last saw it. They are kept with the
+// identity of the file they were built from, so each version of a file is only
+// hashed once, and the oldest is replaced when a new one comes in.
+static struct library_entry built_trees[BUILT_TREES];
+static size_t next_built_tree;
+static pthread_mutex_t built_trees_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The snapshot readers see. The lock only guards swapping the pointer and
+// taking a reference, never the time a reader spends using the snapshot.
+static struct library_snapshot *current_snapshot = NULL;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Only regular files with an .mp3 extension are served.
+ */
+static bool is_track_name(const char *name) {
+    size_t length = strlen(name);
+    size_t extension = strlen(TRACK_EXTENSION);
+
+    // The name must end in the extension, so "song.mp3.part" is not a track
+    return length > extension && strcmp(name + length - extension, TRACK_EXTENSION) == 0;
+}
+
+/**
+ * @brief Compare the identity of a file with the one a digest was computed from.
+ */
+static bool same_identity(const struct library_entry *entry, const struct stat *st) {
+    return entry->inode == st->st_ino && entry->size == st->st_size &&
+           entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/**
+ * @brief Find a track by name in the working list.
+ *
+ * @param name - The track to look for.
+ * @param position - Set to the index of the track, or where it would be inserted.
+ * @return true if the track is in the library.
+ */
+static bool find_entry(const char *name, size_t *position) {
+    size_t low = 0, high = library.count;
+
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        int cmp = strcmp(library.entries[middle].name, name);
+        if (cmp == 0) {
+            *position = middle;
+            return true;
+        } else if (cmp < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    *position = low;
+    return false;
+}
+
+/**
+ * @brief Make room for one more entry in the working list.
+ */
+static bool reserve_entry(void) {
+    if (library.count == library.capacity) {
+        size_t capacity = library.capacity ? library.capacity * 2 : 64;
+        struct library_entry *entries = realloc(library.entries, capacity * sizeof(*entries));
+        if (entries == NULL) {
+            return false;
+        }
+        library.entries = entries;
+        library.capacity = capacity;
+    }
+    return true;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const struct library_entry *)a)->name, ((const struct library_entry *)b)->name);
+}
+
+/**
+ * @brief Build a snapshot of the working list and make it the one readers see.
+ *        The tracks, their names and the LIST response live in one allocation.
+ *
+ * @return true if the snapshot was published, false if it could not be allocated.
+ */
+static bool publish_snapshot(void) {
+    struct library_snapshot *snapshot, *old_snapshot;
+    size_t names_length = 0;
+    const char **track_names;
+    char *names;
+
+    for (size_t i = 0; i < library.count; i++) {
+        names_length += strlen(library.entries[i].name) + 1;
+    }
+
+    // The names are stored twice: NUL-terminated for lookups and newline-terminated
+    // in the listing, so LIST can be sent without any formatting
+    snapshot = malloc(sizeof(*snapshot) + library.count * sizeof(struct library_track) + 2 * names_length);
+    if (snapshot == NULL) {
+        perror("Unable to allocate library snapshot");
+        return false;
+    }
+    atomic_init(&snapshot->references, 1); // The reference held as the current snapshot
+    snapshot->count = library.count;
+    snapshot->tracks = (struct library_track *)(snapshot + 1);
+    names = (char *)(snapshot->tracks + library.count);
+    snapshot->listing = names + names_length;
+    snapshot->listing_length = names_length;
+
+    for (size_t i = 0, offset = 0; i < library.count; i++) {
+        const struct library_entry *entry = &library.entries[i];
+        struct library_track *track = &snapshot->tracks[i];
+        size_t length = strlen(entry->name);
+
+        memcpy(names + offset, entry->name, length + 1);
+        memcpy(snapshot->listing + offset, entry->name, length);
+        snapshot->listing[offset + length] = '\n';
+        track->name = names + offset;
+        track->name_length = length;
+        track->inode = entry->inode;
+        track->size = entry->size;
+        track->mtime = entry->mtime;
+        memcpy(track->digest, entry->digest, SHA256_DIGEST_LENGTH);
+        track->blocks = block_tree_retain(entry->blocks);
+        offset += length + 1;
+    }
+
+    // Index the names for SEARCH
+    track_names = malloc((library.count ? library.count : 1) * sizeof(*track_names));
+    for (size_t i = 0; track_names != NULL && i < library.count; i++) {
+        track_names[i] = snapshot->tracks[i].name;
+    }
+    snapshot->search = track_names ? search_index_build(track_names, library.count) : NULL;
+    free(track_names);
+    if (snapshot->search == NULL) {
+        perror("Unable to build search index");
+        for (size_t i = 0; i < library.count; i++) {
+            block_tree_release(snapshot->tracks[i].blocks);
+        }
+        free(snapshot);
+        return false;
+    }
+
+    pthread_mutex_lock(&snapshot_lock);
+    old_snapshot = current_snapshot;
+    current_snapshot = snapshot;
+    pthread_mutex_unlock(&snapshot_lock);
+
+    if (old_snapshot != NULL) {
+        library_release(old_snapshot);
+    }
+    return true;
+}
+
+/**
+ * @brief Take a reference to the current snapshot of the library. It stays valid,
+ *        and unchanged, until it is passed to library_release().
+ *
+ * @return The current snapshot.
+ */
+struct library_snapshot *library_acquire(void) {
+    struct library_snapshot *snapshot;
+
+    pthread_mutex_lock(&snapshot_lock);
+    snapshot = current_snapshot;
+    atomic_fetch_add_explicit(&snapshot->references, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&snapshot_lock);
+
+    return snapshot;
+}
+
+/**
+ * @brief Drop a reference to a snapshot, freeing it if it has been replaced and
+ *        this was the last reader.
+ *
+ * @param snapshot - A snapshot from library_acquire().
+ */
+void library_release(struct library_snapshot *snapshot) {
+    if (atomic_fetch_sub_explicit(&snapshot->references, 1, memory_order_acq_rel) == 1) {
+        for (size_t i = 0; i < snapshot->count; i++) {
+            block_tree_release(snapshot->tracks[i].blocks);
+        }
+        search_index_free(snapshot->search);
+        free(snapshot);
+    }
+}
+
+/**
+ * @brief Find a track in a snapshot by name.
+ *
+ * @param snapshot - A snapshot from library_acquire().
+ * @param name - The track to look for.
+ * @return The track, or NULL if it is not in the library.
+ */
+const struct library_track *library_find(const struct library_snapshot *snapshot, const char *name) {
+    size_t low = 0, high = snapshot->count;
+
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        int cmp = strcmp(snapshot->tracks[middle].name, name);
+        if (cmp == 0) {
+            return &snapshot->tracks[middle];
+        } else if (cmp < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Read a run of blocks and hash them. Used as a worker pool job, and run
+ *        directly when a file is hashed on one thread.
+ */
+static void run_hash_job(void *arg) {
+    struct hash_job *job = arg;
+    unsigned char *buffer = malloc(RPC_BLOCK_SIZE);
+
+    job->failed = buffer == NULL;
+    for (size_t i = job->first; !job->failed && i < job->last; i++) {
+        uint64_t start = (uint64_t)i * RPC_BLOCK_SIZE;
+        size_t length = job->size - start < RPC_BLOCK_SIZE ? job->size - start : RPC_BLOCK_SIZE;
+        size_t done = 0;
+        ssize_t bytes;
+
+        while (done < length && (bytes = pread(job->fd, buffer + done, length - done, start + done)) > 0) {
+            done += bytes;
+        }
+        if (done < length) { // The file shrank or could not be read
+            job->failed = true;
+            break;
+        }
+        if (job->sha256 != NULL && EVP_DigestUpdate(job->sha256, buffer, length) != 1) {
+            job->failed = true;
+            break;
+        }
+        if (job->tree != NULL) {
+            block_hash_leaf(buffer, length, job->tree->leaves[i]);
+        }
+    }
+    free(buffer);
+}
+
+/**
+ * @brief Fill in the leaves of a tree, and the digest of the whole file if asked.
+ *        On one thread the file is read once for both. With more than one thread
+ *        the blocks are split into runs hashed in parallel, and the whole-file
+ *        digest, which can only be computed in order, is one more job running
+ *        alongside them that reads the file a second time.
+ *
+ * @return true if every block was read.
+ */
+static bool hash_blocks(int fd, struct block_tree *tree, EVP_MD_CTX *sha256, int threads) {
+    struct hash_job *jobs;
+    struct worker_pool *pool;
+    size_t runs, count = tree->count;
+    bool ok = true;
+
+    if (threads <= 1 || count <= 1) {
+        struct hash_job job = { .fd = fd, .size = tree->size, .last = count, .tree = tree, .sha256 = sha256 };
+        run_hash_job(&job);
+        return !job.failed;
+    }
+
+    runs = (size_t)threads * JOBS_PER_THREAD < count ? (size_t)threads * JOBS_PER_THREAD : count;
+    jobs = calloc(runs + 1, sizeof(*jobs));
+    if (jobs == NULL || (pool = worker_pool_create(threads, runs + 1)) == NULL) {
+        free(jobs);
+        return false;
+    }
+    for (size_t i = 0; i < runs; i++) {
+        jobs[i] = (struct hash_job){ .fd = fd, .size = tree->size, .tree = tree,
+                                     .first = count * i / runs, .last = count * (i + 1) / runs };
+        worker_pool_submit(pool, run_hash_job, &jobs[i]);
+    }
+    if (sha256 != NULL) {
+        jobs[runs] = (struct hash_job){ .fd = fd, .size = tree->size, .last = count, .sha256 = sha256 };
+        worker_pool_submit(pool, run_hash_job, &jobs[runs]);
+    }
+    worker_pool_destroy(pool); // Waits for every job
+
+    for (size_t i = 0; i <= runs; i++) {
+        ok &= !jobs[i].failed;
+    }
+    free(jobs);
+    return ok;
+}
+
+/**
+ * @brief Compute the SHA-256 digest of a file and, if asked, its block hashes.
+ *
+ * @param path - The file to hash.
+ * @param st - Filled in with the identity of the file that was hashed.
+ * @param digest - Receives the digest.
+ * @param blocks - Set to the file's block hashes, or NULL if they are not wanted.
+ * @param threads - Threads to split the file's blocks across.
+ * @return true on success, false if the file could not be read.
+ */
+static bool hash_track(const char *path, struct stat *st, unsigned char digest[SHA256_DIGEST_LENGTH],
+                       struct block_tree **blocks, int threads) {
+    struct block_tree *tree = NULL;
+    EVP_MD_CTX *sha256;
+    bool ok;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, st) < 0 || !S_ISREG(st->st_mode) ||
+        (blocks != NULL && (tree = block_tree_create(st->st_size)) == NULL)) {
+        close(fd);
+        return false;
+    }
+
+    // The same SHA-256 implementation as the block hashes, fetched once
+    sha256 = EVP_MD_CTX_new();
+    ok = sha256 != NULL && block_digest_init(sha256);
+    if (ok && tree != NULL) {
+        ok = hash_blocks(fd, tree, sha256, threads) &&
+             block_hash_root((const unsigned char (*)[BLOCK_HASH_SIZE])tree->leaves, tree->count, tree->root);
+    } else if (ok) {
+        struct hash_job job = { .fd = fd, .size = st->st_size, .last = block_count(st->st_size), .sha256 = sha256 };
+        run_hash_job(&job);
+        ok = !job.failed;
+    }
+    ok = ok && EVP_DigestFinal_ex(sha256, digest, NULL) == 1;
+    EVP_MD_CTX_free(sha256);
+    close(fd);
+
+    if (ok && blocks != NULL) {
+        *blocks = tree;
+    } else {
+        block_tree_release(tree);
+    }
+    return ok;
+}
+
+/**
+ * @brief Compute the SHA-256 digest of a file.
+ *
+ * @param path - The file to hash.
+ * @param st - Filled in with the identity of the file that was hashed.
+ * @param digest - Receives the digest.
+ * @return true on success, false if the file could not be read.
+ */
+bool library_hash_file(const char *path, struct stat *st, unsigned char digest[SHA256_DIGEST_LENGTH]) {
+    return hash_track(path, st, digest, NULL, 1);
+}
+
+/**
+ * @brief Build the block hashes of an open file the library has none for, such as
+ *        one that changed since the watcher last saw it. The caller is answering a
+ *        request, so the blocks are hashed on its thread rather than on threads
+ *        started and stopped for every request.
+ *
+ * @param fd - The open file.
+ * @param size - Its size, from fstat().
+ * @return The tree, to release when done, or NULL if the file could not be read.
+ */
+struct block_tree *library_hash_blocks(int fd, off_t size) {
+    struct block_tree *tree = block_tree_create(size);
+
+    if (tree != NULL && (!hash_blocks(fd, tree, NULL, 1) ||
+                         !block_hash_root((const unsigned char (*)[BLOCK_HASH_SIZE])tree->leaves, tree->count,
+                                          tree->root))) {
+        block_tree_release(tree);
+        tree = NULL;
+    }
+    return tree;
+}
+
+/**
+ * @brief Hash a single library entry in place. Used as a worker pool job while
+ *        the library is loaded, when each entry is only touched by one thread.
+ */
+static void hash_entry(void *arg) {
+    struct library_entry *entry = arg;
+    char path[PATH_MAX];
+    struct stat st;
+
+    // The other files are being hashed alongside this one, so it gets one thread
+    snprintf(path, sizeof(path), "%s/%s", library.directory, entry->name);
+    if (hash_track(path, &st, entry->digest, &entry->blocks, 1)) {
+        entry->inode = st.st_ino;
+        entry->size = st.st_size;
+        entry->mtime = st.st_mtim;
+        entry->hashed = true;
+    }
+}
+
+/**
+ * @brief Scan the MP3 directory and hash every track, in parallel across all cores.
+ *
+ * @param directory - The directory holding the MP3 files.
+ * @return true on success, false if the directory could not be read.
+ */
+bool library_load(const char *directory) {
+    DIR *dir = opendir(directory);
+    struct dirent *entry;
+    struct worker_pool *pool;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t kept = 0;
+
+    if (!dir) {
+        perror("Unable to open mp3 directory");
+        return false;
+    }
+    snprintf(library.directory, sizeof(library.directory), "%s", directory);
+    library.threads = threads > 1 ? threads : 1;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_type != DT_REG || !is_track_name(entry->d_name)) {
+            continue;
+        }
+        if (!reserve_entry()) {
+            perror("Unable to grow the library");
+            closedir(dir);
+            return false;
+        }
+        library.entries[library.count++] = (struct library_entry){ .name = strdup(entry->d_name) };
+    }
+    closedir(dir);
+
+    // One job per file; destroying the pool waits until every file is hashed
+    threads = library.threads;
+    pool = worker_pool_create(threads, library.count ? library.count : 1);
+    if (pool == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < library.count; i++) {
+        worker_pool_submit(pool, hash_entry, &library.entries[i]);
+    }
+    worker_pool_destroy(pool);
+
+    // Drop files that disappeared or could not be read while hashing
+    for (size_t i = 0; i < library.count; i++) {
+        if (library.entries[i].hashed) {
+            library.entries[kept++] = library.entries[i];
+        } else {
+            block_tree_release(library.entries[i].blocks);
+            free(library.entries[i].name);
+        }
+    }
+    library.count = kept;
+    qsort(library.entries, library.count, sizeof(*library.entries), compare_entries);
+
+    printf("Hashed %zu tracks in %s using %ld threads\n", library.count, directory, threads);
+    return publish_snapshot();
+}
+
+/**
+ * @brief Look up the stored digest of a track, provided it was computed from the
+ *        same file the caller has open.
+ *
+ * @param name - The track name.
+ * @param st - The identity of the caller's open file, from fstat().
+ * @param digest - Receives the digest.
+ * @return true if a digest for this exact file is known.
+ */
+bool library_get_hash(const char *name, const struct stat *st, unsigned char digest[SHA256_DIGEST_LENGTH]) {
+    struct library_snapshot *snapshot = library_acquire();
+    const struct library_track *track = library_find(snapshot, name);
+    bool found = track != NULL && track->inode == st->st_ino && track->size == st->st_size &&
+                 track->mtime.tv_sec == st->st_mtim.tv_sec && track->mtime.tv_nsec == st->st_mtim.tv_nsec;
+
+    if (found) {
+        memcpy(digest, track->digest, SHA256_DIGEST_LENGTH);
+    }
+    library_release(snapshot);
+
+    return found;
+}
+
+/**
+ * @brief Look up the block hashes of a track, provided they were computed from the
+ *        same file the caller has open: the library's, or else ones built on demand
+ *        and kept with library_keep_blocks().
+ *
+ * @param name - The track name.
+ * @param st - The identity of the caller's open file, from fstat().
+ * @return The tree, to release with block_tree_release(), or NULL if none is known.
+ */
+struct block_tree *library_get_blocks(const char *name, const struct stat *st) {
+    struct library_snapshot *snapshot = library_acquire();
+    const struct library_track *track = library_find(snapshot, name);
+    struct block_tree *tree = NULL;
+
+    if (track != NULL && track->inode == st->st_ino && track->size == st->st_size &&
+        track->mtime.tv_sec == st->st_mtim.tv_sec && track->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+        tree = block_tree_retain(track->blocks);
+    }
+    library_release(snapshot);
+    if (tree != NULL) {
+        return tree;
+    }
+
+    pthread_mutex_lock(&built_trees_lock);
+    for (size_t i = 0; i < BUILT_TREES && tree == NULL; i++) {
+        if (built_trees[i].name != NULL && strcmp(built_trees[i].name, name) == 0 &&
+            same_identity(&built_trees[i], st)) {
+            tree = block_tree_retain(built_trees[i].blocks);
+        }
+    }
+    pthread_mutex_unlock(&built_trees_lock);
+
+    return tree;
+}
+
+/**
+ * @brief Keep block hashes built on demand for a file the library had none for,
+ *        so later requests for the same version of the file find them with
+ *        library_get_blocks() instead of building them again.
+ *
+ * @param name - The track name.
+ * @param st - The identity of the file the tree was built from.
+ * @param tree - The tree. The library takes a reference of its own.
+ */
+void library_keep_blocks(const char *name, const struct stat *st, struct block_tree *tree) {
+    struct library_entry *slot;
+    char *copy = strdup(name);
+
+    if (copy == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&built_trees_lock);
+    slot = &built_trees[next_built_tree];
+    next_built_tree = (next_built_tree + 1) % BUILT_TREES;
+    free(slot->name);
+    block_tree_release(slot->blocks);
+    *slot = (struct library_entry){ .name = copy, .inode = st->st_ino, .size = st->st_size,
+                                    .mtime = st->st_mtim, .blocks = block_tree_retain(tree) };
+    pthread_mutex_unlock(&built_trees_lock);
+}
+
+/**
+ * @brief Check whether a track is part of the library.
+ */
+bool library_contains(const char *name) {
+    struct library_snapshot *snapshot = library_acquire();
+    bool found = library_find(snapshot, name) != NULL;
+
+    library_release(snapshot);
+    return found;
+}
+
+/**
+ * @brief Remove a track from the working list.
+ *
+ * @return true if the track was in the list.
+ */
+static bool remove_track(const char *name) {
+    size_t position;
+
+    if (!find_entry(name, &position)) {
+        return false;
+    }
+    free(library.entries[position].name);
+    block_tree_release(library.entries[position].blocks);
+    memmove(&library.entries[position], &library.entries[position + 1],
+            (library.count - position - 1) * sizeof(*library.entries));
+    library.count--;
+    return true;
+}
+
+/**
+ * @brief Bring one track in the working list up to date with the file on disk:
+ *        re-hash it if it is new or its identity changed, or remove it if it is gone.
+ *
+ * @return true if the working list changed.
+ */
+static bool update_track(const char *name) {
+    char path[PATH_MAX];
+    struct stat st;
+    struct library_entry updated = { 0 };
+    size_t position;
+    bool found;
+
+    snprintf(path, sizeof(path), "%s/%s", library.directory, name);
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return remove_track(name);
+    }
+
+    found = find_entry(name, &position);
+    if (found && same_identity(&library.entries[position], &st)) {
+        return false;
+    }
+
+    if (!hash_track(path, &st, updated.digest, &updated.blocks, library.threads)) {
+        return remove_track(name);
+    }
+    updated.inode = st.st_ino;
+    updated.size = st.st_size;
+    updated.mtime = st.st_mtim;
+    updated.hashed = true;
+
+    if (found) {
+        updated.name = library.entries[position].name;
+        block_tree_release(library.entries[position].blocks);
+        library.entries[position] = updated;
+    } else {
+        if (!reserve_entry() || (updated.name = strdup(name)) == NULL) {
+            perror("Unable to grow the library");
+            block_tree_release(updated.blocks);
+            return false;
+        }
+        memmove(&library.entries[position + 1], &library.entries[position],
+                (library.count - position) * sizeof(*library.entries));
+        library.entries[position] = updated;
+        library.count++;
+    }
+    printf("Re-hashed %s\n", name);
+    return true;
+}
+
+/**
+ * @brief Bring the whole working list up to date after inotify dropped events:
+ *        re-check every file in the directory and remove tracks that no longer exist.
+ *
+ * @return true if the working list changed.
+ */
+static bool rescan_library(void) {
+    DIR *dir = opendir(library.directory);
+    struct dirent *entry;
+    bool changed = false;
+
+    if (!dir) {
+        perror("Unable to open mp3 directory");
+        return false;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (is_track_name(entry->d_name)) {
+            changed |= update_track(entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    // Check each known track still exists; update_track() removes it if not. Walk
+    // backwards so removals do not skip the entry that moves into their place.
+    for (size_t i = library.count; i > 0; i--) {
+        char path[PATH_MAX];
+        struct stat st;
+
+        snprintf(path, sizeof(path), "%s/%s", library.directory, library.entries[i - 1].name);
+        if (stat(path, &st) < 0) {
+            changed |= remove_track(library.entries[i - 1].name);
+        }
+    }
+
+    return changed;
+}
+
+/**
+ * @brief Thread that applies inotify events for the MP3 directory to the working
+ *        list, and publishes a new snapshot after each batch of events that changed it.
+ */
+static void *watch_library(void *arg) {
+    int fd = *(int *)arg;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    bool changed;
+
+    free(arg);
+    while ((length = read(fd, events, sizeof(events))) != 0) {
+        if (length < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Unable to read directory events");
+            break;
+        }
+
+        changed = false;
+        for (char *ptr = events; ptr < events + length; ) {
+            const struct inotify_event *event = (const struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                changed |= rescan_library();
+            } else if (event->len > 0 && is_track_name(event->name)) {
+                if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    changed |= remove_track(event->name);
+                } else {
+                    changed |= update_track(event->name);
+                }
+            }
+        }
+
+        if (changed) {
+            publish_snapshot();
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+/**
+ * @brief Start watching the MP3 directory so added, changed and removed files are
+ *        reflected in the library without a restart.
+ *
+ * @return true if the watcher thread was started.
+ */
+bool library_watch(void) {
+    pthread_t tid;
+    int *fd = malloc(sizeof(int));
+
+    if (fd == NULL) {
+        return false;
+    }
+    *fd = inotify_init1(IN_CLOEXEC);
+    if (*fd < 0 || inotify_add_watch(*fd, library.directory, WATCH_EVENTS) < 0) {
+        perror("Unable to watch mp3 directory");
+        if (*fd >= 0) {
+            close(*fd);
+        }
+        free(fd);
+        return false;
+    }
+
+    // Catch anything that changed between loading the library and starting the watch
+    if (rescan_library()) {
+        publish_snapshot();
+    }
+
+    if (pthread_create(&tid, NULL, watch_library, fd) != 0) {
+        close(*fd);
+        free(fd);
+        return false;
+    }
+    pthread_detach(tid);
+    return true;
+}
@@ -0,0 +1,45 @@
+#ifndef _LIBRARY_H
+#define _LIBRARY_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+
+// One track in a snapshot of the library
+struct library_track {
+    const char *name;
+    size_t name_length;
+    ino_t inode;
+    off_t size;
+    struct timespec mtime;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    struct block_tree *blocks;    // Block hashes, NULL if they could not be built
+};
+
+// An immutable view of the library. Readers hold a reference while they use it;
+// changes to the directory publish a new snapshot rather than modifying this one.
+struct library_snapshot {
+    atomic_int references;
+    size_t count;
+    struct library_track *tracks; // Sorted by name
+    char *listing;                // Every track name followed by a newline, as sent for LIST
+    size_t listing_length;
+    struct search_index *search;  // Trigram index over the track names for SEARCH
+};
+
+// The MP3 library: every track in the MP3 directory with its SHA-256 digest and
+// block hashes
+bool library_load(const char *directory);
+bool library_watch(void);
+struct library_snapshot *library_acquire(void);
+void library_release(struct library_snapshot *snapshot);
+const struct library_track *library_find(const struct library_snapshot *snapshot, const char *name);
+bool library_get_hash(const char *name, const struct stat *st, unsigned char digest[SHA256_DIGEST_LENGTH]);
+struct block_tree *library_get_blocks(const char *name, const struct stat *st);
+struct block_tree *library_hash_blocks(int fd, off_t size);
+void library_keep_blocks(const char *name, const struct stat *st, struct block_tree *tree);
+bool library_contains(const char *name);
+bool library_hash_file(const char *path, struct stat *st, unsigned char digest[SHA256_DIGEST_LENGTH]);
+
+#endif
@@ -0,0 +1,577 @@
+/**
+* @file loadgen.c
+* @author Corey Brantley, Shen Knoll, Harrison Sherwin
+* @brief  Load generator for the media server. Opens many concurrent TLS sessions
+*         and runs a weighted mix of LIST, SEARCH and DOWNLOAD against a server,
+*         either as fast as a fixed number of connections allows (closed loop) or
+*         at a target request rate (open loop), then prints throughput, latency
+*         percentiles, handshake times and error rates as JSON on stdout.
+*
+*         In open-loop mode every request has a scheduled start time, and its
+*         latency is measured from then rather than from when a connection got
+*         round to sending it, so a server that falls behind shows up as higher
+*         latency instead of a quietly lower request rate.
+*
+*         Usage: ./loadgen [options] <host>:<port>
+*           -c N     concurrent connections (default 16)
+*           -d S     seconds to run (default 10)
+*           -r RATE  requests per second across all connections; 0 runs closed loop (default 0)
+*           -m MIX   operation weights (default list=2,search=3,download=1)
+*           -k       keep connections open between requests (KEEPALIVE)
+*           -H       handshakes only: connect, handshake and close, with no requests
+*
+*         The JSON includes handshakes per second, which with -H measures how fast
+*         the server accepts and handshakes; run it against a server with different
+*         --acceptors counts to see how accepting scales across cores.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "CommunicationConstants.h"
+
+#define DEFAULT_CONCURRENCY 16
+#define DEFAULT_DURATION    10
+#define DEFAULT_MIX         "list=2,search=3,download=1"
+#define REQUEST_SIZE        256
+#define READ_BUFFER_SIZE    (64 * 1024)
+#define HASH_SIZE           32
+#define MAX_NAMES           4096
+
+enum operation { OP_LIST, OP_SEARCH, OP_DOWNLOAD, OPERATIONS };
+static const char *operation_names[OPERATIONS] = { "LIST", "SEARCH", "DOWNLOAD" };
+
+// One finished request
+struct sample {
+    double latency; // Seconds
+    enum operation operation;
+    bool failed;
+};
+
+// A growable list of measurements kept by each worker, merged at the end
+struct samples {
+    struct sample *requests;
+    size_t request_count;
+    size_t request_capacity;
+    double *handshakes;
+    size_t handshake_count;
+    size_t handshake_capacity;
+};
+
+struct worker {
+    pthread_t thread;
+    unsigned int seed;
+    SSL *ssl;
+    int fd;
+    int requests_left; // On a keep-alive connection
+    unsigned long long bytes;
+    unsigned long connect_errors;
+    struct samples samples;
+};
+
+static struct {
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    SSL_CTX *ctx;
+    int concurrency;
+    double duration;
+    double rate;
+    bool keep_alive;
+    bool handshakes_only;
+    int weights[OPERATIONS];
+    int total_weight;
+    char *names[MAX_NAMES]; // Tracks on the server, for DOWNLOAD and SEARCH
+    int name_count;
+    double start;
+    atomic_ullong next_ticket; // Open loop: index of the next scheduled request
+} run;
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double when) {
+    double delay = when - now_s();
+    if (delay > 0) {
+        struct timespec ts = { .tv_sec = (time_t)delay, .tv_nsec = (long)((delay - (time_t)delay) * 1e9) };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void add_request(struct samples *samples, double latency, enum operation operation, bool failed) {
+    if (samples->request_count == samples->request_capacity) {
+        samples->request_capacity = samples->request_capacity ? samples->request_capacity * 2 : 1024;
+        samples->requests = realloc(samples->requests, samples->request_capacity * sizeof(*samples->requests));
+        if (samples->requests == NULL) {
+            perror("Out of memory for samples");
+            exit(EXIT_FAILURE);
+        }
+    }
+    samples->requests[samples->request_count++] = (struct sample){ latency, operation, failed };
+}
+
+static void add_handshake(struct samples *samples, double seconds) {
+    if (samples->handshake_count == samples->handshake_capacity) {
+        samples->handshake_capacity = samples->handshake_capacity ? samples->handshake_capacity * 2 : 256;
+        samples->handshakes = realloc(samples->handshakes, samples->handshake_capacity * sizeof(double));
+        if (samples->handshakes == NULL) {
+            perror("Out of memory for samples");
+            exit(EXIT_FAILURE);
+        }
+    }
+    samples->handshakes[samples->handshake_count++] = seconds;
+}
+
+static bool read_exact(SSL *ssl, void *buffer, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        int result = SSL_read(ssl, (char *)buffer + done, length - done);
+        if (result <= 0) {
+            return false;
+        }
+        done += result;
+    }
+    return true;
+}
+
+/**
+ * @brief Read one framed reply, keeping the body if 'body' is not NULL and
+ *        throwing it away otherwise.
+ *
+ * @return false if the connection failed or the reply was not a frame.
+ */
+static bool read_reply(struct worker *worker, struct rpc_frame_header *header, char *body, size_t body_size) {
+    unsigned char wire[RPC_FRAME_HEADER_SIZE];
+    char scratch[READ_BUFFER_SIZE];
+    uint64_t left;
+    size_t kept = 0;
+
+    if (!read_exact(worker->ssl, wire, sizeof(wire)) || !rpc_frame_decode(wire, header)) {
+        return false;
+    }
+    left = header->body_length + (header->flags & RPC_FLAG_HASH_TRAILER ? HASH_SIZE : 0);
+    worker->bytes += sizeof(wire) + left;
+    while (left > 0) {
+        int result = SSL_read(worker->ssl, scratch, left < sizeof(scratch) ? left : sizeof(scratch));
+        if (result <= 0) {
+            return false;
+        }
+        if (body != NULL && kept < body_size - 1) {
+            size_t copy = (size_t)result < body_size - 1 - kept ? (size_t)result : body_size - 1 - kept;
+            memcpy(body + kept, scratch, copy);
+            kept += copy;
+        }
+        left -= result;
+    }
+    if (body != NULL) {
+        body[kept] = '\0';
+    }
+    return true;
+}
+
+static void disconnect(struct worker *worker) {
+    if (worker->ssl != NULL) {
+        SSL_shutdown(worker->ssl);
+        SSL_free(worker->ssl);
+        close(worker->fd);
+        worker->ssl = NULL;
+    }
+}
+
+/**
+ * @brief Open a TLS connection offering the framed protocol, timing the TCP
+ *        connect and handshake together, and ask for keep-alive if wanted.
+ */
+static bool connect_server(struct worker *worker) {
+    struct rpc_frame_header header;
+    char limits[REQUEST_SIZE];
+    int max_requests, idle_timeout;
+    int nodelay = 1;
+    double started = now_s();
+
+    worker->fd = socket(run.address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (worker->fd < 0 || connect(worker->fd, (struct sockaddr *)&run.address, run.address_length) < 0) {
+        if (worker->fd >= 0) {
+            close(worker->fd);
+        }
+        worker->connect_errors++;
+        return false;
+    }
+    setsockopt(worker->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    worker->ssl = SSL_new(run.ctx);
+    SSL_set_alpn_protos(worker->ssl, RPC_ALPN_PROTOCOLS, sizeof(RPC_ALPN_PROTOCOLS) - 1);
+    SSL_set_fd(worker->ssl, worker->fd);
+    if (SSL_connect(worker->ssl) != 1) {
+        SSL_free(worker->ssl);
+        close(worker->fd);
+        worker->ssl = NULL;
+        worker->connect_errors++;
+        return false;
+    }
+    add_handshake(&worker->samples, now_s() - started);
+
+    worker->requests_left = 1;
+    if (run.keep_alive) {
+        if (SSL_write(worker->ssl, RPC_KEEPALIVE_OPERATION, strlen(RPC_KEEPALIVE_OPERATION)) <= 0 ||
+            !read_reply(worker, &header, limits, sizeof(limits))) {
+            disconnect(worker);
+            worker->connect_errors++;
+            return false;
+        }
+        if (header.status == RPC_STATUS_OK && sscanf(limits, "%d %d", &max_requests, &idle_timeout) == 2) {
+            worker->requests_left = max_requests;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Pick an operation by weight and build its request.
+ */
+static enum operation make_request(struct worker *worker, char *request) {
+    int pick = rand_r(&worker->seed) % run.total_weight;
+    enum operation operation = OP_LIST;
+    const char *name;
+
+    while (pick >= run.weights[operation]) {
+        pick -= run.weights[operation];
+        operation++;
+    }
+
+    if (run.name_count == 0) {
+        operation = OP_LIST; // Nothing to search for or download
+    }
+    name = run.name_count > 0 ? run.names[rand_r(&worker->seed) % run.name_count] : "";
+    switch (operation) {
+    case OP_SEARCH:
+        // Search for the first word of a real track name
+        snprintf(request, REQUEST_SIZE, "%s %.*s", RPC_SEARCH_OPERATION, (int)strcspn(name, "-_ ."), name);
+        break;
+    case OP_DOWNLOAD:
+        snprintf(request, REQUEST_SIZE, "%s %s", RPC_DOWNLOAD_OPERATION, name);
+        break;
+    default:
+        snprintf(request, REQUEST_SIZE, "%s", RPC_LIST_OPERATION);
+        break;
+    }
+    return operation;
+}
+
+/**
+ * @brief Send one request and read the whole reply.
+ *
+ * @return false if the request failed, either on the connection or with an
+ *         error reply from the server.
+ */
+static bool send_request(struct worker *worker, const char *request) {
+    struct rpc_frame_header header;
+
+    if (worker->ssl == NULL && !connect_server(worker)) {
+        return false;
+    }
+    if (SSL_write(worker->ssl, request, strlen(request)) <= 0 || !read_reply(worker, &header, NULL, 0)) {
+        disconnect(worker);
+        return false;
+    }
+    if (--worker->requests_left <= 0) {
+        disconnect(worker);
+    }
+    return header.status == RPC_STATUS_OK;
+}
+
+static void *run_worker(void *arg) {
+    struct worker *worker = arg;
+    double end = run.start + run.duration;
+    char request[REQUEST_SIZE];
+
+    while (true) {
+        double scheduled;
+
+        if (run.rate > 0) {
+            // Open loop: take the next slot in the shared schedule
+            unsigned long long ticket = atomic_fetch_add(&run.next_ticket, 1);
+            scheduled = run.start + ticket / run.rate;
+            if (scheduled >= end) {
+                break;
+            }
+            sleep_until(scheduled);
+        } else {
+            scheduled = now_s();
+            if (scheduled >= end) {
+                break;
+            }
+        }
+
+        if (run.handshakes_only) {
+            if (connect_server(worker)) {
+                disconnect(worker);
+            }
+            continue;
+        }
+
+        enum operation operation = make_request(worker, request);
+        bool ok = send_request(worker, request);
+        add_request(&worker->samples, now_s() - scheduled, operation, !ok);
+    }
+
+    disconnect(worker);
+    return NULL;
+}
+
+/**
+ * @brief Fetch the track list once, so DOWNLOAD and SEARCH use real names.
+ */
+static bool load_names(void) {
+    struct worker worker = { 0 };
+    struct rpc_frame_header header;
+    char *listing;
+    bool ok = false;
+
+    if (!connect_server(&worker)) {
+        return false;
+    }
+    if (SSL_write(worker.ssl, RPC_LIST_OPERATION, strlen(RPC_LIST_OPERATION)) > 0 &&
+        (listing = malloc(READ_BUFFER_SIZE * 16)) != NULL) {
+        if (read_reply(&worker, &header, listing, READ_BUFFER_SIZE * 16) && header.status == RPC_STATUS_OK) {
+            for (char *name = strtok(listing, "\n"); name != NULL && run.name_count < MAX_NAMES;
+                 name = strtok(NULL, "\n")) {
+                run.names[run.name_count++] = strdup(name);
+            }
+            ok = true;
+        }
+        free(listing);
+    }
+    disconnect(&worker);
+    free(worker.samples.handshakes);
+    return ok;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Print count, mean and percentiles of a list of seconds as a JSON object
+ *        in milliseconds. Sorts the list.
+ */
+static void print_latencies(double *values, size_t count) {
+    static const double percentiles[] = { 0.50, 0.95, 0.99, 0.999 };
+    static const char *labels[] = { "p50", "p95", "p99", "p999" };
+    double sum = 0;
+
+    qsort(values, count, sizeof(double), compare_doubles);
+    for (size_t i = 0; i < count; i++) {
+        sum += values[i];
+    }
+    printf("{\"count\": %zu, \"mean_ms\": %.3f", count, count ? sum / count * 1e3 : 0.0);
+    for (size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++) {
+        size_t index = count ? (size_t)(percentiles[p] * count + 0.999999) : 0;
+        printf(", \"%s_ms\": %.3f", labels[p], count ? values[(index ? index : 1) - 1] * 1e3 : 0.0);
+    }
+    printf(", \"max_ms\": %.3f}", count ? values[count - 1] * 1e3 : 0.0);
+}
+
+/**
+ * @brief Parse "list=2,search=3,download=1" into operation weights.
+ */
+static bool parse_mix(const char *mix) {
+    char copy[REQUEST_SIZE];
+
+    snprintf(copy, sizeof(copy), "%s", mix);
+    memset(run.weights, 0, sizeof(run.weights));
+    for (char *item = strtok(copy, ","); item != NULL; item = strtok(NULL, ",")) {
+        char name[REQUEST_SIZE];
+        int weight, op;
+
+        if (sscanf(item, " %[^=]=%d", name, &weight) != 2 || weight < 0) {
+            return false;
+        }
+        for (op = 0; op < OPERATIONS; op++) {
+            if (strcasecmp(name, operation_names[op]) == 0) {
+                break;
+            }
+        }
+        if (op == OPERATIONS) {
+            return false;
+        }
+        run.weights[op] = weight;
+    }
+    run.total_weight = 0;
+    for (int op = 0; op < OPERATIONS; op++) {
+        run.total_weight += run.weights[op];
+    }
+    return run.total_weight > 0;
+}
+
+static bool resolve(char *target) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *result;
+    char *colon = strrchr(target, ':');
+    char port[16];
+
+    snprintf(port, sizeof(port), "%d", DEFAULT_PORT);
+    if (colon != NULL) {
+        *colon = '\0';
+        snprintf(port, sizeof(port), "%s", colon + 1);
+    }
+    if (getaddrinfo(target, port, &hints, &result) != 0) {
+        return false;
+    }
+    memcpy(&run.address, result->ai_addr, result->ai_addrlen);
+    run.address_length = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] <host>:<port>\n", program);
+    fprintf(stderr, "  -c N     concurrent connections (default %d)\n", DEFAULT_CONCURRENCY);
+    fprintf(stderr, "  -d S     seconds to run (default %d)\n", DEFAULT_DURATION);
+    fprintf(stderr, "  -r RATE  requests per second across all connections, 0 for closed loop (default 0)\n");
+    fprintf(stderr, "  -m MIX   operation weights (default %s)\n", DEFAULT_MIX);
+    fprintf(stderr, "  -k       keep connections open between requests\n");
+    fprintf(stderr, "  -H       only connect and handshake, to measure handshakes per second\n");
+}
+
+int main(int argc, char **argv) {
+    const char *mix = DEFAULT_MIX;
+    struct worker *workers;
+    struct samples all = { 0 };
+    double elapsed;
+    unsigned long long bytes = 0;
+    unsigned long connect_errors = 0;
+    int opt;
+
+    run.concurrency = DEFAULT_CONCURRENCY;
+    run.duration = DEFAULT_DURATION;
+    while ((opt = getopt(argc, argv, "c:d:r:m:kHh")) != -1) {
+        switch (opt) {
+        case 'c': run.concurrency = atoi(optarg); break;
+        case 'd': run.duration = atof(optarg); break;
+        case 'r': run.rate = atof(optarg); break;
+        case 'm': mix = optarg; break;
+        case 'k': run.keep_alive = true; break;
+        case 'H': run.handshakes_only = true; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1 || run.concurrency <= 0 || run.duration <= 0 || run.rate < 0 || !parse_mix(mix) ||
+        (run.handshakes_only && run.keep_alive)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (!resolve(argv[optind])) {
+        fprintf(stderr, "Cannot resolve %s\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    run.ctx = SSL_CTX_new(TLS_client_method());
+    if (run.ctx == NULL) {
+        ERR_print_errors_fp(stderr);
+        return EXIT_FAILURE;
+    }
+    // Every connection does a full handshake, as a new client would
+    SSL_CTX_set_session_cache_mode(run.ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_options(run.ctx, SSL_OP_NO_TICKET);
+
+    if (!load_names()) {
+        fprintf(stderr, "Could not get the track list from the server\n");
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "Running %s%s for %.0f s with %d connections against %d tracks\n",
+            run.rate > 0 ? "open loop" : "closed loop", run.handshakes_only ? " handshakes" : "",
+            run.duration, run.concurrency, run.name_count);
+
+    workers = calloc(run.concurrency, sizeof(*workers));
+    run.start = now_s();
+    for (int i = 0; i < run.concurrency; i++) {
+        workers[i].seed = 469 + i;
+        pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+    }
+    for (int i = 0; i < run.concurrency; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    elapsed = now_s() - run.start;
+
+    // Merge what every connection measured
+    for (int i = 0; i < run.concurrency; i++) {
+        struct samples *samples = &workers[i].samples;
+        for (size_t j = 0; j < samples->request_count; j++) {
+            add_request(&all, samples->requests[j].latency, samples->requests[j].operation,
+                        samples->requests[j].failed);
+        }
+        for (size_t j = 0; j < samples->handshake_count; j++) {
+            add_handshake(&all, samples->handshakes[j]);
+        }
+        bytes += workers[i].bytes;
+        connect_errors += workers[i].connect_errors;
+        free(samples->requests);
+        free(samples->handshakes);
+    }
+
+    double *latencies = malloc((all.request_count + 1) * sizeof(double));
+    size_t failed = 0;
+    for (size_t i = 0; i < all.request_count; i++) {
+        failed += all.requests[i].failed;
+    }
+
+    printf("{\n  \"mode\": \"%s\", \"concurrency\": %d, \"target_rate\": %.1f, \"keep_alive\": %s,\n",
+           run.rate > 0 ? "open" : "closed", run.concurrency, run.rate, run.keep_alive ? "true" : "false");
+    printf("  \"duration_s\": %.3f, \"requests\": %zu, \"errors\": %zu, \"error_rate\": %.6f, \"connect_errors\": %lu,\n",
+           elapsed, all.request_count, failed, all.request_count ? (double)failed / all.request_count : 0.0,
+           connect_errors);
+    printf("  \"throughput_rps\": %.2f, \"received_bytes\": %llu, \"received_mbit_s\": %.2f,\n",
+           all.request_count / elapsed, bytes, bytes * 8 / elapsed / 1e6);
+    printf("  \"handshakes\": %zu, \"handshakes_per_s\": %.2f,\n", all.handshake_count,
+           all.handshake_count / elapsed);
+    printf("  \"handshake\": ");
+    print_latencies(all.handshakes, all.handshake_count);
+    for (size_t i = 0; i < all.request_count; i++) {
+        latencies[i] = all.requests[i].latency;
+    }
+    printf(",\n  \"latency\": ");
+    print_latencies(latencies, all.request_count);
+    printf(",\n  \"operations\": {");
+    for (int op = 0; op < OPERATIONS; op++) {
+        size_t count = 0, errors = 0;
+        for (size_t i = 0; i < all.request_count; i++) {
+            if (all.requests[i].operation == (enum operation)op) {
+                latencies[count++] = all.requests[i].latency;
+                errors += all.requests[i].failed;
+            }
+        }
+        printf("%s\n    \"%s\": {\"errors\": %zu, \"latency\": ", op ? "," : "", operation_names[op], errors);
+        print_latencies(latencies, count);
+        printf("}");
+    }
+    printf("\n  }\n}\n");
+
+    free(latencies);
+    free(all.requests);
+    free(all.handshakes);
+    free(workers);
+    SSL_CTX_free(run.ctx);
+    return failed > 0 || connect_errors > 0 ? 2 : EXIT_SUCCESS;
+}
@@ -0,0 +1,516 @@
+/**
+* @file metrics.c
+* @author Corey Brantley, Shen Knoll, Harrison Sherwin
+* @brief  Counters and latency histograms for the server, and a small plain-HTTP
+*         admin server that hands them to Prometheus.
+*
+*         Everything is recorded with relaxed atomic adds, so the event loop and
+*         the workers never wait on each other to update a metric. Histograms keep
+*         a count per bucket; the cumulative counts Prometheus expects are only
+*         added up when /metrics is scraped.
+*
+*         The admin server runs on its own thread and answers one request at a
+*         time: GET /metrics, GET /healthz (the event loop is still turning) and
+*         GET /readyz (the library is loaded and the server is accepting
+*         connections). It is for the kubelet and Prometheus inside the cluster,
+*         not for clients, so it does not use TLS.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "metrics.h"
+#include "CommunicationConstants.h"
+#include "contentcache.h"
+
+#define HISTOGRAM_BUCKETS  16
+#define ERROR_SLOTS        136 // errno values and RPC error codes; larger ones share the last slot
+#define STATUSES           4   // enum rpc_status
+#define HEALTHY_HEARTBEAT  10  // Seconds the event loop may go without turning before it is unhealthy
+#define ADMIN_BACKLOG      16
+#define ADMIN_TIMEOUT      2   // Seconds a scraper has to send its request
+#define ADMIN_REQUEST_SIZE 1024
+#define ADMIN_RESPONSE_SIZE (64 * 1024)
+
+// Upper bounds of the histogram buckets, in nanoseconds (100 us to 10 s)
+static const uint64_t bucket_bounds[HISTOGRAM_BUCKETS] = {
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 25000000,
+    50000000, 100000000, 250000000, 500000000, 1000000000, 2500000000, 5000000000, 10000000000
+};
+
+struct histogram {
+    atomic_ullong buckets[HISTOGRAM_BUCKETS + 1]; // The last one is +Inf
+    atomic_ullong count;
+    atomic_ullong sum; // Nanoseconds
+};
+
+static const char *operation_names[METRICS_OPERATIONS] = {
+    "LIST", "SEARCH", "DOWNLOAD", "RANGE", "HASH", "KEEPALIVE", "OTHER"
+};
+static const char *status_names[STATUSES] = { "ok", "file_error", "rpc_error", "not_modified" };
+static const char *limit_names[METRICS_LIMITS] = { "connection", "client" };
+
+static struct {
+    struct histogram handshake;
+    struct histogram queue_wait;
+    struct histogram requests[METRICS_OPERATIONS];
+    atomic_ullong replies[METRICS_OPERATIONS][STATUSES][ERROR_SLOTS];
+    atomic_ullong bytes_sent[METRICS_OPERATIONS];
+    atomic_ullong handshake_failures;
+    atomic_ullong connections_total;
+    atomic_long connections_active;
+    atomic_int workers_busy;
+    atomic_int workers;
+    atomic_ullong rejected[2];                 // Turned away busy: metadata, download
+    atomic_ullong throttled[METRICS_LIMITS];   // Bulk writes held back by a rate limit
+    atomic_ullong throttled_ns[METRICS_LIMITS];
+    atomic_int downloads_waiting;
+    atomic_int downloads_active;
+    atomic_int download_slots;
+    atomic_llong heartbeat; // Seconds on the monotonic clock
+    atomic_bool ready;
+} metrics;
+
+static uint64_t nanoseconds_since(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000 + (now.tv_nsec - start->tv_nsec);
+}
+
+static void observe(struct histogram *histogram, uint64_t nanoseconds) {
+    int bucket = 0;
+
+    while (bucket < HISTOGRAM_BUCKETS && nanoseconds > bucket_bounds[bucket]) {
+        bucket++;
+    }
+    atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, nanoseconds, memory_order_relaxed);
+}
+
+/**
+ * @brief Which operation a request is, for labelling its metrics.
+ */
+enum metrics_operation metrics_operation_of(const char *request) {
+    size_t length = strcspn(request, " \n");
+
+    if (length == strlen(RPC_LIST_OPERATION) && strncmp(request, RPC_LIST_OPERATION, length) == 0) {
+        return METRICS_LIST;
+    } else if (length == strlen(RPC_SEARCH_OPERATION) && strncmp(request, RPC_SEARCH_OPERATION, length) == 0) {
+        return METRICS_SEARCH;
+    } else if (length == strlen(RPC_DOWNLOAD_OPERATION) && strncmp(request, RPC_DOWNLOAD_OPERATION, length) == 0) {
+        return METRICS_DOWNLOAD;
+    } else if (length == strlen(RPC_RANGE_OPERATION) && strncmp(request, RPC_RANGE_OPERATION, length) == 0) {
+        return METRICS_RANGE;
+    } else if (length == strlen(RPC_HASH_OPERATION) && strncmp(request, RPC_HASH_OPERATION, length) == 0) {
+        return METRICS_HASH;
+    } else if (length == strlen(RPC_KEEPALIVE_OPERATION) && strncmp(request, RPC_KEEPALIVE_OPERATION, length) == 0) {
+        return METRICS_KEEPALIVE;
+    }
+    return METRICS_OTHER;
+}
+
+void metrics_connection_opened(void) {
+    atomic_fetch_add_explicit(&metrics.connections_total, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics.connections_active, 1, memory_order_relaxed);
+}
+
+void metrics_connection_closed(void) {
+    atomic_fetch_sub_explicit(&metrics.connections_active, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Record a finished or failed TLS handshake.
+ *
+ * @param started - When the connection was accepted.
+ * @param succeeded - false if the handshake failed or timed out.
+ */
+void metrics_handshake(const struct timespec *started, bool succeeded) {
+    if (succeeded) {
+        observe(&metrics.handshake, nanoseconds_since(started));
+    } else {
+        atomic_fetch_add_explicit(&metrics.handshake_failures, 1, memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Record how long a request waited for a free worker.
+ *
+ * @param queued - When the request was handed to the worker pool.
+ */
+void metrics_queue_wait(const struct timespec *queued) {
+    observe(&metrics.queue_wait, nanoseconds_since(queued));
+}
+
+void metrics_worker_busy(bool busy) {
+    atomic_fetch_add_explicit(&metrics.workers_busy, busy ? 1 : -1, memory_order_relaxed);
+}
+
+/**
+ * @brief Record an answered request.
+ *
+ * @param operation - What the request was.
+ * @param started - When the worker started on it.
+ * @param status - The reply's enum rpc_status.
+ * @param error - The reply's error code: an errno value or an RPC_ERROR code.
+ * @param bytes - Bytes of reply handed to TLS.
+ */
+void metrics_request(enum metrics_operation operation, const struct timespec *started,
+                     int status, int error, uint64_t bytes) {
+    int slot = error < 0 ? -error : error;
+
+    if (status < 0 || status >= STATUSES) {
+        status = RPC_STATUS_RPC_ERROR;
+    }
+    if (slot >= ERROR_SLOTS) {
+        slot = ERROR_SLOTS - 1;
+    }
+    observe(&metrics.requests[operation], nanoseconds_since(started));
+    atomic_fetch_add_explicit(&metrics.replies[operation][status][slot], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics.bytes_sent[operation], bytes, memory_order_relaxed);
+}
+
+/**
+ * @brief Record a request turned away because its worker pool's queue was full.
+ *
+ * @param download - true for a DOWNLOAD or RANGE, false for a metadata request.
+ */
+void metrics_rejected(bool download) {
+    atomic_fetch_add_explicit(&metrics.rejected[download], 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Record a bulk write held back by a rate limit.
+ *
+ * @param limit - The limit that made it wait longest.
+ * @param seconds - How long it waits.
+ */
+void metrics_throttled(enum metrics_limit limit, double seconds) {
+    atomic_fetch_add_explicit(&metrics.throttled[limit], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics.throttled_ns[limit], (uint64_t)(seconds * 1e9), memory_order_relaxed);
+}
+
+void metrics_download_waiting(bool waiting) {
+    atomic_fetch_add_explicit(&metrics.downloads_waiting, waiting ? 1 : -1, memory_order_relaxed);
+}
+
+void metrics_download_active(bool active) {
+    atomic_fetch_add_explicit(&metrics.downloads_active, active ? 1 : -1, memory_order_relaxed);
+}
+
+/**
+ * @brief Called by the event loop every time it turns, for /healthz.
+ */
+void metrics_heartbeat(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    atomic_store_explicit(&metrics.heartbeat, now.tv_sec, memory_order_relaxed);
+}
+
+void metrics_set_ready(bool ready) {
+    atomic_store(&metrics.ready, ready);
+}
+
+void metrics_set_workers(int workers) {
+    atomic_store(&metrics.workers, workers);
+}
+
+void metrics_set_download_slots(int slots) {
+    atomic_store(&metrics.download_slots, slots);
+}
+
+/**
+ * @brief Number of threads in the process, from /proc.
+ */
+static long thread_count(void) {
+    char line[256];
+    long threads = 0;
+    FILE *status = fopen("/proc/self/status", "r");
+
+    if (status == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), status) != NULL) {
+        if (sscanf(line, "Threads: %ld", &threads) == 1) {
+            break;
+        }
+    }
+    fclose(status);
+    return threads;
+}
+
+// Appends to a fixed-size response; output past the end is dropped
+struct text {
+    char *data;
+    size_t length;
+    size_t size;
+};
+
+__attribute__((format(printf, 2, 3)))
+static void append(struct text *text, const char *format, ...) {
+    va_list args;
+    int written;
+
+    if (text->length >= text->size) {
+        return;
+    }
+    va_start(args, format);
+    written = vsnprintf(text->data + text->length, text->size - text->length, format, args);
+    va_end(args);
+    if (written > 0) {
+        text->length += written;
+        if (text->length > text->size) {
+            text->length = text->size;
+        }
+    }
+}
+
+static void append_histogram(struct text *text, const char *name, const char *labels,
+                             const struct histogram *histogram) {
+    unsigned long long cumulative = 0;
+    const char *separator = labels[0] != '\0' ? "," : "";
+    const char *open = labels[0] != '\0' ? "{" : "";
+    const char *close = labels[0] != '\0' ? "}" : "";
+
+    for (int i = 0; i <= HISTOGRAM_BUCKETS; i++) {
+        cumulative += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        if (i < HISTOGRAM_BUCKETS) {
+            append(text, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, separator,
+                   bucket_bounds[i] / 1e9, cumulative);
+        } else {
+            append(text, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, separator, cumulative);
+        }
+    }
+    append(text, "%s_sum%s%s%s %.9f\n", name, open, labels, close,
+           atomic_load_explicit(&histogram->sum, memory_order_relaxed) / 1e9);
+    append(text, "%s_count%s%s%s %llu\n", name, open, labels, close,
+           (unsigned long long)atomic_load_explicit(&histogram->count, memory_order_relaxed));
+}
+
+/**
+ * @brief Write every metric in the Prometheus text exposition format.
+ */
+static void write_metrics(struct text *text) {
+    struct content_cache_stats cache;
+    char labels[64];
+
+    append(text, "# HELP mp3_server_handshake_seconds Time from accept to a finished TLS handshake.\n");
+    append(text, "# TYPE mp3_server_handshake_seconds histogram\n");
+    append_histogram(text, "mp3_server_handshake_seconds", "", &metrics.handshake);
+    append(text, "# HELP mp3_server_handshake_failures_total Handshakes that failed or timed out.\n");
+    append(text, "# TYPE mp3_server_handshake_failures_total counter\n");
+    append(text, "mp3_server_handshake_failures_total %llu\n",
+           (unsigned long long)atomic_load(&metrics.handshake_failures));
+
+    append(text, "# HELP mp3_server_queue_wait_seconds Time a request waited for a free worker.\n");
+    append(text, "# TYPE mp3_server_queue_wait_seconds histogram\n");
+    append_histogram(text, "mp3_server_queue_wait_seconds", "", &metrics.queue_wait);
+
+    append(text, "# HELP mp3_server_request_seconds Time a worker spent answering a request, including sending it.\n");
+    append(text, "# TYPE mp3_server_request_seconds histogram\n");
+    for (int op = 0; op < METRICS_OPERATIONS; op++) {
+        snprintf(labels, sizeof(labels), "operation=\"%s\"", operation_names[op]);
+        append_histogram(text, "mp3_server_request_seconds", labels, &metrics.requests[op]);
+    }
+
+    append(text, "# HELP mp3_server_requests_total Requests answered, by operation, status and error code.\n");
+    append(text, "# TYPE mp3_server_requests_total counter\n");
+    for (int op = 0; op < METRICS_OPERATIONS; op++) {
+        for (int status = 0; status < STATUSES; status++) {
+            for (int slot = 0; slot < ERROR_SLOTS; slot++) {
+                unsigned long long count = atomic_load_explicit(&metrics.replies[op][status][slot],
+                                                                memory_order_relaxed);
+                if (count > 0) {
+                    append(text, "mp3_server_requests_total{operation=\"%s\",status=\"%s\",error=\"%d\"} %llu\n",
+                           operation_names[op], status_names[status],
+                           status == RPC_STATUS_RPC_ERROR ? -slot : slot, count);
+                }
+            }
+        }
+    }
+
+    append(text, "# HELP mp3_server_sent_bytes_total Reply bytes handed to TLS, by operation.\n");
+    append(text, "# TYPE mp3_server_sent_bytes_total counter\n");
+    for (int op = 0; op < METRICS_OPERATIONS; op++) {
+        append(text, "mp3_server_sent_bytes_total{operation=\"%s\"} %llu\n", operation_names[op],
+               (unsigned long long)atomic_load_explicit(&metrics.bytes_sent[op], memory_order_relaxed));
+    }
+
+    append(text, "# HELP mp3_server_connections_total Connections accepted.\n");
+    append(text, "# TYPE mp3_server_connections_total counter\n");
+    append(text, "mp3_server_connections_total %llu\n", (unsigned long long)atomic_load(&metrics.connections_total));
+    append(text, "# HELP mp3_server_connections_active Connections open now.\n");
+    append(text, "# TYPE mp3_server_connections_active gauge\n");
+    append(text, "mp3_server_connections_active %ld\n", atomic_load(&metrics.connections_active));
+
+    append(text, "# HELP mp3_server_workers Worker threads answering requests.\n");
+    append(text, "# TYPE mp3_server_workers gauge\n");
+    append(text, "mp3_server_workers %d\n", atomic_load(&metrics.workers));
+    append(text, "# HELP mp3_server_workers_busy Worker threads answering a request now.\n");
+    append(text, "# TYPE mp3_server_workers_busy gauge\n");
+    append(text, "mp3_server_workers_busy %d\n", atomic_load(&metrics.workers_busy));
+    append(text, "# HELP mp3_server_download_slots Downloads that may be sent at once.\n");
+    append(text, "# TYPE mp3_server_download_slots gauge\n");
+    append(text, "mp3_server_download_slots %d\n", atomic_load(&metrics.download_slots));
+    append(text, "# HELP mp3_server_downloads_active Downloads being sent now.\n");
+    append(text, "# TYPE mp3_server_downloads_active gauge\n");
+    append(text, "mp3_server_downloads_active %d\n", atomic_load(&metrics.downloads_active));
+    append(text, "# HELP mp3_server_downloads_waiting Downloads queued for a free slot.\n");
+    append(text, "# TYPE mp3_server_downloads_waiting gauge\n");
+    append(text, "mp3_server_downloads_waiting %d\n", atomic_load(&metrics.downloads_waiting));
+    append(text, "# HELP mp3_server_rejected_total Requests answered busy because their queue was full.\n");
+    append(text, "# TYPE mp3_server_rejected_total counter\n");
+    append(text, "mp3_server_rejected_total{class=\"metadata\"} %llu\n",
+           (unsigned long long)atomic_load(&metrics.rejected[0]));
+    append(text, "mp3_server_rejected_total{class=\"download\"} %llu\n",
+           (unsigned long long)atomic_load(&metrics.rejected[1]));
+    append(text, "# HELP mp3_server_throttled_total Bulk writes held back by a rate limit.\n");
+    append(text, "# TYPE mp3_server_throttled_total counter\n");
+    for (int limit = 0; limit < METRICS_LIMITS; limit++) {
+        append(text, "mp3_server_throttled_total{limit=\"%s\"} %llu\n", limit_names[limit],
+               (unsigned long long)atomic_load_explicit(&metrics.throttled[limit], memory_order_relaxed));
+    }
+    append(text, "# HELP mp3_server_throttled_seconds_total Time bulk writes spent held back by a rate limit.\n");
+    append(text, "# TYPE mp3_server_throttled_seconds_total counter\n");
+    for (int limit = 0; limit < METRICS_LIMITS; limit++) {
+        append(text, "mp3_server_throttled_seconds_total{limit=\"%s\"} %.6f\n", limit_names[limit],
+               atomic_load_explicit(&metrics.throttled_ns[limit], memory_order_relaxed) / 1e9);
+    }
+    append(text, "# HELP mp3_server_threads Threads in the server process.\n");
+    append(text, "# TYPE mp3_server_threads gauge\n");
+    append(text, "mp3_server_threads %ld\n", thread_count());
+
+    content_cache_stats(&cache);
+    append(text, "# HELP mp3_server_cache_hits_total Downloads sent from the content cache.\n");
+    append(text, "# TYPE mp3_server_cache_hits_total counter\n");
+    append(text, "mp3_server_cache_hits_total %llu\n", cache.hits);
+    append(text, "# HELP mp3_server_cache_misses_total Downloads that had to read a file into the content cache.\n");
+    append(text, "# TYPE mp3_server_cache_misses_total counter\n");
+    append(text, "mp3_server_cache_misses_total %llu\n", cache.misses);
+    append(text, "# HELP mp3_server_cache_evictions_total Files evicted from the content cache.\n");
+    append(text, "# TYPE mp3_server_cache_evictions_total counter\n");
+    append(text, "mp3_server_cache_evictions_total %llu\n", cache.evictions);
+    append(text, "# HELP mp3_server_cache_bytes Bytes of files in the content cache.\n");
+    append(text, "# TYPE mp3_server_cache_bytes gauge\n");
+    append(text, "mp3_server_cache_bytes %zu\n", cache.bytes);
+}
+
+/**
+ * @brief Answer one admin request and close the connection.
+ */
+static void serve_admin(int client, char *response) {
+    char request[ADMIN_REQUEST_SIZE];
+    char path[ADMIN_REQUEST_SIZE];
+    char header[256];
+    struct text body = { response, 0, ADMIN_RESPONSE_SIZE };
+    const char *status = "200 OK";
+    const char *type = "text/plain; charset=utf-8";
+    struct timespec now;
+    ssize_t length;
+
+    length = recv(client, request, sizeof(request) - 1, 0);
+    if (length <= 0) {
+        return;
+    }
+    request[length] = '\0';
+
+    if (sscanf(request, "GET %1023s", path) != 1) {
+        status = "405 Method Not Allowed";
+        append(&body, "Only GET is supported\n");
+    } else if (strcmp(path, "/metrics") == 0) {
+        type = "text/plain; version=0.0.4; charset=utf-8";
+        write_metrics(&body);
+    } else if (strcmp(path, "/healthz") == 0) {
+        // The event loop only starts turning once the server is ready
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (atomic_load(&metrics.ready) && now.tv_sec - atomic_load(&metrics.heartbeat) > HEALTHY_HEARTBEAT) {
+            status = "503 Service Unavailable";
+            append(&body, "event loop stalled\n");
+        } else {
+            append(&body, "ok\n");
+        }
+    } else if (strcmp(path, "/readyz") == 0) {
+        if (!atomic_load(&metrics.ready)) {
+            status = "503 Service Unavailable";
+            append(&body, "not ready\n");
+        } else {
+            append(&body, "ready\n");
+        }
+    } else {
+        status = "404 Not Found";
+        append(&body, "Not found\n");
+    }
+
+    length = snprintf(header, sizeof(header),
+                      "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                      status, type, body.length);
+    if (send(client, header, length, MSG_NOSIGNAL) == length) {
+        send(client, body.data, body.length, MSG_NOSIGNAL);
+    }
+}
+
+static void *run_admin_server(void *arg) {
+    int server = (int)(intptr_t)arg;
+    struct timeval timeout = { .tv_sec = ADMIN_TIMEOUT, .tv_usec = 0 };
+    char *response = malloc(ADMIN_RESPONSE_SIZE);
+
+    while (response != NULL) {
+        int client = accept4(server, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno != EINTR) {
+                perror("Unable to accept admin connection");
+            }
+            continue;
+        }
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve_admin(client, response);
+        close(client);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start the admin HTTP server on its own thread.
+ *
+ * @param port - The TCP port to listen on.
+ * @return false if the port could not be opened.
+ */
+bool metrics_serve(unsigned int port) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port),
+                                .sin_addr.s_addr = htonl(INADDR_ANY) };
+    int reuse = 1;
+    pthread_t tid;
+    int server;
+
+    metrics_heartbeat();
+    server = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server < 0) {
+        perror("Unable to create admin socket");
+        return false;
+    }
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(server, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(server, ADMIN_BACKLOG) < 0) {
+        perror("Unable to open admin port");
+        close(server);
+        return false;
+    }
+    if (pthread_create(&tid, NULL, run_admin_server, (void *)(intptr_t)server) != 0) {
+        close(server);
+        return false;
+    }
+    pthread_detach(tid);
+    return true;
+}
@@ -0,0 +1,47 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// Operations that are counted and timed separately
+enum metrics_operation {
+    METRICS_LIST,
+    METRICS_SEARCH,
+    METRICS_DOWNLOAD,
+    METRICS_RANGE,
+    METRICS_HASH,
+    METRICS_KEEPALIVE,
+    METRICS_OTHER,
+    METRICS_OPERATIONS
+};
+
+// Bandwidth limits a bulk reply can be held back by
+enum metrics_limit {
+    METRICS_LIMIT_CONNECTION,
+    METRICS_LIMIT_CLIENT,
+    METRICS_LIMITS
+};
+
+// Server metrics, recorded lock-free from any thread and served in the Prometheus
+// text format on a plain-HTTP admin port, along with /healthz and /readyz
+enum metrics_operation metrics_operation_of(const char *request);
+void metrics_connection_opened(void);
+void metrics_connection_closed(void);
+void metrics_handshake(const struct timespec *started, bool succeeded);
+void metrics_queue_wait(const struct timespec *queued);
+void metrics_worker_busy(bool busy);
+void metrics_request(enum metrics_operation operation, const struct timespec *started,
+                     int status, int error, uint64_t bytes);
+void metrics_rejected(bool download);
+void metrics_throttled(enum metrics_limit limit, double seconds);
+void metrics_download_waiting(bool waiting);
+void metrics_download_active(bool active);
+void metrics_heartbeat(void);
+void metrics_set_ready(bool ready);
+void metrics_set_workers(int workers);
+void metrics_set_download_slots(int slots);
+bool metrics_serve(unsigned int port);
+
+#endif
@@ -0,0 +1,276 @@
+/**
+* @file outbuf.c
+* @author Corey Brantley, Shen Knoll, Harrison Sherwin
+* @brief  A per-connection output buffer for TLS responses. Every SSL_write() call
+*         turns into at least one TLS record with its own header and MAC, and one
+*         system call. Responses are collected here and written in pieces as large
+*         as a record can hold, and only when the buffer fills or the handler
+*         flushes it.
+*
+*         On keep-alive connections the client cannot wait for the connection to
+*         close to know a response is over, so each flushed piece is framed as a
+*         chunk and the response ends with an empty chunk. Chunk headers share a
+*         record with the data around them.
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "outbuf.h"
+
+// Chunked buffers keep room for the chunk's own header in front of the data and
+// for the header that follows it (the next chunk's or the end marker) behind it
+#define CHUNKED_CAPACITY (OUTBUF_SIZE - 2 * OUTBUF_CHUNK_HEADER)
+
+/**
+ * @brief Prepare an empty output buffer for a connection.
+ * 
+ * @param out - The buffer to set up.
+ * @param ssl - The connection its contents are written to.
+ * @param chunked - true to frame the response in chunks for a keep-alive connection.
+ */
+void outbuf_init(struct outbuf *out, SSL *ssl, bool chunked) {
+    out->ssl = ssl;
+    out->chunked = chunked;
+    out->failed = false;
+    out->early_data = false;
+    out->status = 0;
+    out->error = 0;
+    out->length = 0;
+    out->writes = 0;
+    out->records = 0;
+    out->bytes = 0;
+    out->pace = NULL;
+    out->pace_arg = NULL;
+}
+
+/**
+ * @brief Hand bytes to SSL_write() and keep count of the records produced.
+ *        SSL_write() splits anything longer than a record by itself. A paced
+ *        buffer waits on its pace hook before each piece of OUTBUF_PACE_SIZE.
+ * 
+ * @param out - The output buffer whose connection is written to.
+ * @param data - The bytes to send.
+ * @param length - Number of bytes to send.
+ * @return true if everything was written.
+ */
+static bool send_records(struct outbuf *out, const void *data, size_t length) {
+    if (out->failed) {
+        return false;
+    }
+    if (out->pace != NULL && length > OUTBUF_PACE_SIZE) {
+        const char *bytes = data;
+
+        while (length > OUTBUF_PACE_SIZE) {
+            if (!send_records(out, bytes, OUTBUF_PACE_SIZE)) {
+                return false;
+            }
+            bytes += OUTBUF_PACE_SIZE;
+            length -= OUTBUF_PACE_SIZE;
+        }
+        data = bytes;
+    }
+    if (out->pace != NULL) {
+        out->pace(out->pace_arg, length);
+    }
+    if (out->early_data) {
+        size_t written;
+
+        if (SSL_write_early_data(out->ssl, data, length, &written) != 1) {
+            out->failed = true;
+            return false;
+        }
+    } else if (SSL_write(out->ssl, data, length) <= 0) {
+        out->failed = true;
+        return false;
+    }
+    out->writes++;
+    out->records += (length + OUTBUF_SIZE - 1) / OUTBUF_SIZE;
+    out->bytes += length;
+    return true;
+}
+
+static void put_chunk_header(char *where, uint32_t length) {
+    where[0] = (char)(length >> 24);
+    where[1] = (char)(length >> 16);
+    where[2] = (char)(length >> 8);
+    where[3] = (char)length;
+}
+
+/**
+ * @brief Send a chunked buffer's contents as one chunk, followed in the same write
+ *        by the header of whatever comes next.
+ * 
+ * @param out - A chunked output buffer.
+ * @param next - Length of the next chunk, or 0 to end the response.
+ * @return true unless a write to the peer has failed.
+ */
+static bool send_chunk(struct outbuf *out, uint32_t next) {
+    char *start = out->data;
+    size_t length = out->length;
+
+    if (length > 0) {
+        put_chunk_header(out->data, length);
+        length += OUTBUF_CHUNK_HEADER;
+    } else {
+        start += OUTBUF_CHUNK_HEADER; // Nothing buffered, only the next header goes out
+    }
+    put_chunk_header(start + length, next);
+    length += OUTBUF_CHUNK_HEADER;
+
+    out->length = 0;
+    return send_records(out, start, length);
+}
+
+/**
+ * @brief Send whatever is waiting in the buffer.
+ * 
+ * @param out - The output buffer.
+ * @return true unless a write to the peer has failed.
+ */
+bool outbuf_flush(struct outbuf *out) {
+    size_t length = out->length;
+
+    if (length == 0) {
+        return !out->failed;
+    }
+    out->length = 0;
+    if (out->chunked) {
+        put_chunk_header(out->data, length);
+        return send_records(out, out->data, length + OUTBUF_CHUNK_HEADER);
+    }
+    return send_records(out, out->data, length);
+}
+
+/**
+ * @brief Add bytes to the response. Full records are sent as the buffer fills;
+ *        large writes on plain connections skip the copy and go straight out in
+ *        whole records.
+ * 
+ * @param out - The output buffer.
+ * @param data - The bytes to add.
+ * @param length - Number of bytes to add.
+ * @return true unless a write to the peer has failed.
+ */
+bool outbuf_write(struct outbuf *out, const void *data, size_t length) {
+    const char *bytes = data;
+
+    if (out->failed) {
+        return false;
+    }
+
+    if (out->chunked) {
+        // Data sits after the chunk header; each full buffer is one chunk
+        while (length > 0) {
+            size_t space = CHUNKED_CAPACITY - out->length;
+            size_t taken = length < space ? length : space;
+
+            memcpy(out->data + OUTBUF_CHUNK_HEADER + out->length, bytes, taken);
+            out->length += taken;
+            bytes += taken;
+            length -= taken;
+            if (out->length == CHUNKED_CAPACITY && !outbuf_flush(out)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Top up a partly filled buffer first so records stay full
+    if (out->length > 0) {
+        size_t space = OUTBUF_SIZE - out->length;
+        size_t taken = length < space ? length : space;
+
+        memcpy(out->data + out->length, bytes, taken);
+        out->length += taken;
+        bytes += taken;
+        length -= taken;
+        if (out->length < OUTBUF_SIZE) {
+            return true;
+        }
+        if (!outbuf_flush(out)) {
+            return false;
+        }
+    }
+
+    // Whole records need no copy
+    if (length >= OUTBUF_SIZE) {
+        size_t whole = length - length % OUTBUF_SIZE;
+
+        if (!send_records(out, bytes, whole)) {
+            return false;
+        }
+        bytes += whole;
+        length -= whole;
+    }
+
+    memcpy(out->data, bytes, length);
+    out->length = length;
+    return true;
+}
+
+/**
+ * @brief Add formatted text to the response, like printf().
+ * 
+ * @param out - The output buffer.
+ * @param format - printf() format string.
+ * @return true unless a write to the peer has failed.
+ */
+bool outbuf_printf(struct outbuf *out, const char *format, ...) {
+    char text[OUTBUF_SIZE];
+    va_list args;
+    int length;
+
+    va_start(args, format);
+    length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+
+    if (length < 0) {
+        return !out->failed;
+    }
+    if ((size_t)length >= sizeof(text)) {
+        length = sizeof(text) - 1;
+    }
+    return outbuf_write(out, text, length);
+}
+
+/**
+ * @brief Send everything buffered so the caller can write the next bytes to the
+ *        connection itself (as SSL_sendfile() does). On a chunked buffer the header
+ *        of a chunk of the given length goes out too, and the caller must then
+ *        send exactly that many bytes.
+ * 
+ * @param out - The output buffer.
+ * @param length - Number of bytes the caller is about to send.
+ * @return true unless a write to the peer has failed.
+ */
+bool outbuf_begin_chunk(struct outbuf *out, uint32_t length) {
+    if (out->failed) {
+        return false;
+    }
+    if (!out->chunked) {
+        return outbuf_flush(out);
+    }
+    if (length == 0) {
+        return true; // An empty chunk would end the response
+    }
+    return send_chunk(out, length);
+}
+
+/**
+ * @brief Finish the response: send what is buffered and, on a chunked buffer, the
+ *        empty chunk that tells the client the response is complete.
+ * 
+ * @param out - The output buffer.
+ * @return true unless a write to the peer has failed.
+ */
+bool outbuf_end(struct outbuf *out) {
+    if (out->failed) {
+        return false;
+    }
+    if (!out->chunked) {
+        return outbuf_flush(out);
+    }
+    return send_chunk(out, 0);
+}
@@ -0,0 +1,46 @@
+#ifndef _OUTBUF_H
+#define _OUTBUF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/ssl.h>
+
+// Largest amount of plaintext one TLS record can carry
+#define OUTBUF_SIZE (16 * 1024)
+
+// Largest write handed to SSL_write() at once while the buffer is paced, so a
+// rate limit spreads a large reply out instead of sleeping once and bursting it
+#define OUTBUF_PACE_SIZE (4 * OUTBUF_SIZE)
+
+// On keep-alive connections every piece of a response is sent as a chunk: a 4-byte
+// big-endian length, then that many bytes. A zero-length chunk ends the response.
+#define OUTBUF_CHUNK_HEADER 4
+
+// Collects a response into full TLS records before handing it to SSL_write(), so
+// small writes do not each cost a record header, a MAC and a system call
+struct outbuf {
+    SSL *ssl;
+    bool chunked;             // Frame the response in chunks (keep-alive connections)
+    bool failed;              // A write to the peer failed; later output is dropped
+    bool early_data;          // Send as TLS 1.3 early data, before the handshake finishes
+    int status;               // The reply's enum rpc_status, for the metrics
+    int error;                // The reply's error code when status is not OK
+    size_t length;            // Bytes waiting in data
+    unsigned long writes;     // SSL_write() calls made
+    unsigned long records;    // TLS records those calls produced
+    unsigned long long bytes; // Plaintext bytes handed to SSL_write()
+    void (*pace)(void *arg, size_t length); // Called before each write when set, may sleep
+    void *pace_arg;
+    char data[OUTBUF_SIZE];
+};
+
+void outbuf_init(struct outbuf *out, SSL *ssl, bool chunked);
+bool outbuf_write(struct outbuf *out, const void *data, size_t length);
+bool outbuf_printf(struct outbuf *out, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+bool outbuf_flush(struct outbuf *out);
+bool outbuf_begin_chunk(struct outbuf *out, uint32_t length);
+bool outbuf_end(struct outbuf *out);
+
+#endif
@@ -0,0 +1,267 @@
+/**
+* @file outbufbench.c
+* @author Corey Brantley, Shen Knoll, Harrison Sherwin
+* @brief  Benchmark for the server's TLS output buffer. Runs a TLS session in memory,
+*         sends typical responses the way the server used to (SSL_write() in 256-byte
+*         pieces, error replies padded to 256 bytes) and through outbuf.c, and
+*         reports the TLS records, bytes on the wire and throughput of each.
+*
+*         Usage: ./outbufbench [iterations]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "outbuf.h"
+
+#define DEFAULT_ITERATIONS 20
+#define OLD_CHUNK_SIZE     256    // BUFFER_SIZE in server.c before the output buffer
+#define NEW_CHUNK_SIZE     (64 * 1024) // FILE_CHUNK_SIZE in server.c
+#define LISTING_TRACKS     2000
+#define SEARCH_TRACKS      100
+#define FILE_SIZE          (4 * 1024 * 1024)
+#define HASH_SIZE          32
+
+struct tls_pair {
+    SSL *server;
+    SSL *client;
+    BIO *to_client; // What the server has written, as it would appear on the wire
+};
+
+struct measurement {
+    unsigned long records;
+    unsigned long long wire_bytes;
+    double seconds;
+};
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Make a throwaway self-signed certificate so the benchmark needs no files.
+ */
+static bool add_certificate(SSL_CTX *ctx) {
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *cert = X509_new();
+    bool ok = false;
+
+    if (key != NULL && cert != NULL) {
+        X509_set_version(cert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+        X509_set_pubkey(cert, key);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+                                   (const unsigned char *)"outbufbench", -1, -1, 0);
+        X509_set_issuer_name(cert, X509_get_subject_name(cert));
+        ok = X509_sign(cert, key, EVP_sha256()) > 0 &&
+             SSL_CTX_use_certificate(ctx, cert) == 1 &&
+             SSL_CTX_use_PrivateKey(ctx, key) == 1;
+    }
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ok;
+}
+
+/**
+ * @brief Move everything one side has written to the other side.
+ */
+static void pump(BIO *from, BIO *to) {
+    char buffer[OUTBUF_SIZE];
+    int length;
+
+    while ((length = BIO_read(from, buffer, sizeof(buffer))) > 0) {
+        BIO_write(to, buffer, length);
+    }
+}
+
+/**
+ * @brief Connect a client and a server SSL object through memory BIOs and finish
+ *        the handshake.
+ */
+static bool open_pair(SSL_CTX *server_ctx, SSL_CTX *client_ctx, struct tls_pair *pair) {
+    pair->to_client = BIO_new(BIO_s_mem());
+    pair->server = SSL_new(server_ctx);
+    pair->client = SSL_new(client_ctx);
+    SSL_set_bio(pair->server, BIO_new(BIO_s_mem()), pair->to_client);
+    SSL_set_bio(pair->client, BIO_new(BIO_s_mem()), BIO_new(BIO_s_mem()));
+    SSL_set_accept_state(pair->server);
+    SSL_set_connect_state(pair->client);
+
+    for (int round = 0; round < 10; round++) {
+        int client_done = SSL_do_handshake(pair->client) == 1;
+        pump(SSL_get_wbio(pair->client), SSL_get_rbio(pair->server));
+        int server_done = SSL_do_handshake(pair->server) == 1;
+        pump(SSL_get_wbio(pair->server), SSL_get_rbio(pair->client));
+        if (client_done && server_done) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void close_pair(struct tls_pair *pair) {
+    SSL_free(pair->server);
+    SSL_free(pair->client);
+}
+
+/**
+ * @brief Count the TLS records and bytes the server has produced so far, then
+ *        throw them away.
+ */
+static void drain(struct tls_pair *pair, struct measurement *m) {
+    char *data;
+    long length = BIO_get_mem_data(pair->to_client, &data);
+    long offset = 0;
+
+    while (offset + 5 <= length) {
+        unsigned int record = ((unsigned char)data[offset + 3] << 8) | (unsigned char)data[offset + 4];
+        offset += 5 + record;
+        m->records++;
+    }
+    m->wire_bytes += length;
+    (void)BIO_reset(pair->to_client);
+}
+
+// The responses, as the server used to send them and as it sends them now
+enum workload { WORK_LIST, WORK_SEARCH, WORK_DOWNLOAD, WORK_ERROR, WORK_COUNT };
+static const char *workload_names[WORK_COUNT] = { "LIST", "SEARCH", "DOWNLOAD", "error reply" };
+
+static void send_old(SSL *ssl, enum workload work, const char *payload, size_t length) {
+    char chunk[OLD_CHUNK_SIZE];
+
+    if (work == WORK_ERROR) {
+        memset(chunk, 0, sizeof(chunk));
+        snprintf(chunk, sizeof(chunk), "RPCERROR %d", 2);
+        SSL_write(ssl, chunk, sizeof(chunk));
+        return;
+    }
+    for (size_t offset = 0; offset < length; offset += OLD_CHUNK_SIZE) {
+        size_t piece = length - offset < OLD_CHUNK_SIZE ? length - offset : OLD_CHUNK_SIZE;
+        SSL_write(ssl, payload + offset, piece);
+    }
+    if (work == WORK_DOWNLOAD) {
+        SSL_write(ssl, payload, HASH_SIZE);
+    }
+}
+
+static void send_new(SSL *ssl, enum workload work, const char *payload, size_t length) {
+    struct outbuf *out = malloc(sizeof(*out));
+
+    outbuf_init(out, ssl, false);
+    if (work == WORK_ERROR) {
+        outbuf_printf(out, "RPCERROR %d", 2);
+    } else if (work == WORK_SEARCH) {
+        // One name at a time, as search_files() does
+        const char *name = payload;
+        const char *end = payload + length;
+        while (name < end) {
+            const char *newline = memchr(name, '\n', end - name);
+            outbuf_write(out, name, newline - name + 1);
+            name = newline + 1;
+        }
+    } else if (work == WORK_DOWNLOAD) {
+        for (size_t offset = 0; offset < length; offset += NEW_CHUNK_SIZE) {
+            size_t piece = length - offset < NEW_CHUNK_SIZE ? length - offset : NEW_CHUNK_SIZE;
+            outbuf_write(out, payload + offset, piece);
+        }
+        outbuf_write(out, payload, HASH_SIZE);
+    } else {
+        outbuf_write(out, payload, length);
+    }
+    outbuf_end(out);
+    free(out);
+}
+
+static char *make_listing(size_t tracks, size_t *length) {
+    char *listing = malloc(tracks * 64);
+    size_t used = 0;
+
+    for (size_t i = 0; i < tracks; i++) {
+        used += sprintf(listing + used, "lazy-day-stylish-futuristic-chill-%06zu.mp3\n", i);
+    }
+    *length = used;
+    return listing;
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+    SSL_CTX *server_ctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX *client_ctx = SSL_CTX_new(TLS_client_method());
+    const char *payloads[WORK_COUNT];
+    size_t lengths[WORK_COUNT];
+    char *file;
+
+    if (iterations <= 0) {
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (server_ctx == NULL || client_ctx == NULL || !add_certificate(server_ctx)) {
+        ERR_print_errors_fp(stderr);
+        return EXIT_FAILURE;
+    }
+
+    payloads[WORK_LIST] = make_listing(LISTING_TRACKS, &lengths[WORK_LIST]);
+    payloads[WORK_SEARCH] = make_listing(SEARCH_TRACKS, &lengths[WORK_SEARCH]);
+    file = malloc(FILE_SIZE);
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        file[i] = (char)(i * 131 + (i >> 9));
+    }
+    payloads[WORK_DOWNLOAD] = file;
+    lengths[WORK_DOWNLOAD] = FILE_SIZE;
+    payloads[WORK_ERROR] = NULL;
+    lengths[WORK_ERROR] = 0;
+
+    printf("%-12s %10s | %9s %12s %10s | %9s %12s %10s\n", "response", "bytes",
+           "old recs", "old wire", "old MB/s", "new recs", "new wire", "new MB/s");
+    for (int work = 0; work < WORK_COUNT; work++) {
+        struct measurement old = { 0 }, new = { 0 };
+        size_t plain = work == WORK_ERROR ? strlen("RPCERROR 2") :
+                       lengths[work] + (work == WORK_DOWNLOAD ? HASH_SIZE : 0);
+
+        for (int it = 0; it < iterations; it++) {
+            struct tls_pair pair;
+            double start;
+
+            if (!open_pair(server_ctx, client_ctx, &pair)) {
+                ERR_print_errors_fp(stderr);
+                return EXIT_FAILURE;
+            }
+            (void)BIO_reset(pair.to_client);
+
+            start = now_s();
+            send_old(pair.server, work, payloads[work], lengths[work]);
+            old.seconds += now_s() - start;
+            drain(&pair, &old);
+
+            start = now_s();
+            send_new(pair.server, work, payloads[work], lengths[work]);
+            new.seconds += now_s() - start;
+            drain(&pair, &new);
+
+            close_pair(&pair);
+        }
+
+        printf("%-12s %10zu | %9lu %12llu %10.1f | %9lu %12llu %10.1f\n", workload_names[work], plain,
+               old.records / iterations, old.wire_bytes / iterations,
+               plain * iterations / old.seconds / 1e6,
+               new.records / iterations, new.wire_bytes / iterations,
+               plain * iterations / new.seconds / 1e6);
+    }
+
+    free((char *)payloads[WORK_LIST]);
+    free((char *)payloads[WORK_SEARCH]);
+    free(file);
+    SSL_CTX_free(server_ctx);
+    SSL_CTX_free(client_ctx);
+    return EXIT_SUCCESS;
+}
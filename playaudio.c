@@ -1,54 +1,1066 @@
 #include <ao/ao.h>
 #include <mpg123.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "playaudio.h"
 
 #define BITS 8
+#define STOP_CHECK_NS 100000000 // How often a waiting player looks at the stop flag
+#define QUEUE_SIZE 64           // Tracks that can wait in a player's queue
+#define WAIT_NS 20000000        // Longest a player thread sleeps before looking at the ring again
+#define INDEX_SUFFIX ".idx"     // A track's frame index is kept in .<file name>.idx beside it
+#define INDEX_VERSION 1
+#define INDEX_SIZE -1000        // Grow the index instead of thinning it, so every frame stays a seek target
+
+struct audio_stream {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;   // Signalled when data arrives or the download ends
+    unsigned char *data;      // Fed but not yet decoded
+    size_t length;
+    size_t capacity;
+    size_t fed;               // Total bytes fed so far
+    int ended;                // The downloader will not feed any more
+    int references;           // Downloader and player; the last to let go frees it
+    struct timespec opened;
+};
 
-int playAudio(char* fileName, int *stopFlag) {
+// A track open in one of a player's two decoders
+struct track {
     mpg123_handle *mh;
-    char *buffer;
-    size_t buffer_size;
-    size_t done;
-    int err;
+    char *fileName;
+    ao_sample_format format;
+    unsigned char *first;     // The first block, decoded before the track starts
+    size_t firstLength;
+    off_t firstEnd;           // Sample offset where the first block ends
+    off_t length;             // Samples, or 0 if the track could not be indexed
+    int ready;                // Opened, with its first block decoded
+};
 
-    int driver;
-    ao_device *dev;
+// A file waiting in a player's queue
+struct queued_track {
+    char *fileName;
+    double start;             // Seconds into the track to begin at
+};
 
+// One block of decoded audio on its way to the device
+struct pcm_block {
+    unsigned char *data;
+    size_t length;
     ao_sample_format format;
-    int channels, encoding;
-    long rate;
+    char *announce;           // Set on a track's first block: the name to print as it starts
+    struct timespec decoded;  // When it went into the ring, for the latency counters
+    unsigned generation;      // The seek it was decoded after; blocks from before the latest are dropped
+    off_t end;                // Sample offset in its track where the block ends
+    off_t trackLength;
+};
 
+struct audio_player {
+    pthread_t decoder;
+    pthread_t output;
+    int started;              // Both threads are running
+    pthread_mutex_t lock;     // Guards the queue, and lets a thread sleep on 'changed'
+    pthread_cond_t changed;   // Broadcast when the queue, the flags or the ring change
+    struct queued_track queue[QUEUE_SIZE]; // Files waiting to be played, oldest at head
+    int head;
+    int count;
 
-    /* initializations */
+    // Signals between the threads and the rest of the client. None of them needs the
+    // lock to read or write; the lock is only taken to sleep until one changes.
+    atomic_int stopping;      // Drop the current track, the queue and the ring, then close the device
+    atomic_int closing;       // Stop and end both threads
+    atomic_int paused;        // The output thread holds on to the ring and stops playing
+    atomic_int decoderStopped; // Acknowledges 'stopping': the decoder has let go of everything
+    atomic_int outputStopped;  // Acknowledges 'stopping': the ring is empty and the device closed
+    atomic_int decoding;      // The decoder has a track, so an empty ring is an underrun
+    atomic_int sleepers;      // Threads waiting on 'changed' for the ring
+    atomic_uint seeks;        // Counts seeks; the decoder applies the latest one it has not seen
+    atomic_llong seekMs;      // Where the latest seek goes in the current track
+
+    // What the listener hears, published by the output thread
+    char *playing;            // The track's name, or NULL; guarded by the lock
+    atomic_llong positionMs;
+    atomic_llong lengthMs;
+
+    // The ring of decoded blocks between the decoder thread (the only writer of
+    // 'written') and the output thread (the only writer of 'played'). Both count up
+    // forever; a block's slot is its number modulo 'depth'.
+    struct pcm_block *ring;
+    size_t depth;
+    atomic_size_t written;
+    atomic_size_t played;
+
+    // Counters, written by the output thread
+    atomic_ulong blocks;
+    atomic_ulong underruns;
+    atomic_ullong latencyTotalNs;
+    atomic_ullong latencyMaxNs;
+
+    // Only the decoder thread uses these
+    struct track tracks[2];   // Playing and next, swapped at the end of each track
+    size_t blockSize;
+    // Only the output thread uses these
+    ao_device *dev;
+    ao_sample_format format;  // What the device is open for
+};
+
+/**
+ * @brief Set up the audio libraries for the whole program.
+ */
+void audioInit(void) {
     ao_initialize();
-    driver = ao_default_driver_id();
     mpg123_init();
-    mh = mpg123_new(NULL, &err);
-    buffer_size = mpg123_outblock(mh);
-    buffer = (char*) malloc(buffer_size * sizeof(char));
-
-    /* open the file and get the decoding format */
-    mpg123_open(mh, fileName);
-    mpg123_getformat(mh, &rate, &channels, &encoding);
-
-    /* set the output format and open the output device */
-    format.bits = mpg123_encsize(encoding) * BITS;
-    format.rate = rate;
-    format.channels = channels;
-    format.byte_format = AO_FMT_NATIVE;
-    format.matrix = 0;
-    dev = ao_open_live(driver, &format, NULL);
-    /* decode and play */
-    printf("%d ----", *stopFlag);
-    while (mpg123_read(mh, buffer, buffer_size, &done) == MPG123_OK && *stopFlag >= 0)
-        ao_play(dev, buffer, done);
-
-    /* clean up */
-    free(buffer);
-    ao_close(dev);
-    mpg123_close(mh);
-    mpg123_delete(mh);
+}
+
+/**
+ * @brief Release the audio libraries once every player has been closed.
+ */
+void audioShutdown(void) {
     mpg123_exit();
     ao_shutdown();
+}
+
+static unsigned long long nsSince(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000ULL + now.tv_nsec - start->tv_nsec;
+}
+
+/**
+ * @brief Wake any thread sleeping on the player. The lock is only taken if some
+ *        thread has said it is about to sleep, so the ring's fast path stays lock-free.
+ */
+static void wakePlayer(struct audio_player *player) {
+    if (atomic_load(&player->sleepers) > 0) {
+        pthread_mutex_lock(&player->lock);
+        pthread_cond_broadcast(&player->changed);
+        pthread_mutex_unlock(&player->lock);
+    }
+}
+
+/**
+ * @brief Sleep until woken or for at most WAIT_NS, unless something changed after
+ *        the caller last looked. Because 'sleepers' is raised before the ring and
+ *        the flags are looked at again, a wakePlayer() cannot slip in between.
+ */
+static void sleepPlayer(struct audio_player *player, size_t written, size_t played) {
+    struct timespec deadline;
+
+    pthread_mutex_lock(&player->lock);
+    atomic_fetch_add(&player->sleepers, 1);
+    if (atomic_load(&player->written) == written && atomic_load(&player->played) == played &&
+        !atomic_load(&player->closing)) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += WAIT_NS;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&player->changed, &player->lock, &deadline);
+    }
+    atomic_fetch_sub(&player->sleepers, 1);
+    pthread_mutex_unlock(&player->lock);
+}
+
+static int interrupted(struct audio_player *player) {
+    return atomic_load(&player->stopping) || atomic_load(&player->closing);
+}
+
+static void finishTrack(struct track *track) {
+    if (track->fileName != NULL) {
+        mpg123_close(track->mh);
+        free(track->fileName);
+        track->fileName = NULL;
+    }
+    track->firstLength = 0;
+    track->ready = 0;
+}
+
+// Leaves the format as it was if the decoder does not know it
+static int readFormat(struct track *track) {
+    long rate;
+    int channels, encoding;
+
+    if (mpg123_getformat(track->mh, &rate, &channels, &encoding) != MPG123_OK) {
+        return -1;
+    }
+    memset(&track->format, 0, sizeof(track->format));
+    track->format.bits = mpg123_encsize(encoding) * BITS;
+    track->format.rate = rate;
+    track->format.channels = channels;
+    track->format.byte_format = AO_FMT_NATIVE;
+    return 0;
+}
+
+static char *indexPath(const char *fileName) {
+    const char *base = strrchr(fileName, '/');
+    int dirLength = base == NULL ? 0 : base - fileName + 1;
+    char *path = malloc(strlen(fileName) + sizeof(INDEX_SUFFIX) + 1);
+
+    if (path != NULL) {
+        sprintf(path, "%.*s.%s%s", dirLength, fileName, fileName + dirLength, INDEX_SUFFIX);
+    }
+    return path;
+}
+
+/**
+ * @brief Hand a track's decoder the frame index saved by an earlier scan, if the
+ *        file has not changed since. The index file starts with a line
+ *        "MP3INDEX version size mtime-sec mtime-nsec length step fill", followed by
+ *        the byte offset of every step'th frame, one per line.
+ */
+static int loadIndex(struct track *track, const struct stat *info) {
+    char *path = indexPath(track->fileName);
+    FILE *file = path == NULL ? NULL : fopen(path, "r");
+    long long size, seconds, nanoseconds, length, step, offset;
+    unsigned long long fill;
+    off_t *offsets = NULL;
+    int version, result = -1;
+
+    if (file != NULL &&
+        fscanf(file, "MP3INDEX %d %lld %lld %lld %lld %lld %llu", &version, &size, &seconds, &nanoseconds,
+               &length, &step, &fill) == 7 &&
+        version == INDEX_VERSION && size == info->st_size && seconds == info->st_mtim.tv_sec &&
+        nanoseconds == info->st_mtim.tv_nsec && fill > 0 && fill <= (unsigned long long)info->st_size &&
+        (offsets = malloc(fill * sizeof(off_t))) != NULL) {
+        size_t i;
+        for (i = 0; i < fill && fscanf(file, "%lld", &offset) == 1; i++) {
+            offsets[i] = offset;
+        }
+        if (i == fill && mpg123_set_index(track->mh, offsets, step, fill) == MPG123_OK) {
+            track->length = length;
+            result = 0;
+        }
+    }
+    free(offsets);
+    if (file != NULL) {
+        fclose(file);
+    }
+    free(path);
+    return result;
+}
+
+/**
+ * @brief Save the index a scan built, through a temporary file so a reader never
+ *        sees half of it.
+ */
+static void saveIndex(struct track *track, const struct stat *info) {
+    char *path = indexPath(track->fileName);
+    char *temporary = path == NULL ? NULL : malloc(strlen(path) + sizeof(".new"));
+    FILE *file;
+    off_t *offsets;
+    off_t step;
+    size_t fill;
+
+    if (temporary != NULL && mpg123_index(track->mh, &offsets, &step, &fill) == MPG123_OK && fill > 0) {
+        sprintf(temporary, "%s.new", path);
+        if ((file = fopen(temporary, "w")) != NULL) {
+            fprintf(file, "MP3INDEX %d %lld %lld %lld %lld %lld %zu\n", INDEX_VERSION, (long long)info->st_size,
+                    (long long)info->st_mtim.tv_sec, (long long)info->st_mtim.tv_nsec, (long long)track->length,
+                    (long long)step, fill);
+            for (size_t i = 0; i < fill; i++) {
+                fprintf(file, "%lld\n", (long long)offsets[i]);
+            }
+            if (fclose(file) != 0 || rename(temporary, path) != 0) {
+                remove(temporary);
+            }
+        }
+    }
+    free(temporary);
+    free(path);
+}
+
+/**
+ * @brief Give the decoder an index of where every frame starts, so a seek jumps
+ *        straight to the right frame instead of decoding up to it. The first play
+ *        of a file scans it once and saves the index; later plays load it.
+ */
+static void indexTrack(struct track *track) {
+    struct stat info;
+
+    track->length = 0;
+    if (stat(track->fileName, &info) != 0 || loadIndex(track, &info) == 0) {
+        return;
+    }
+    // Without an index the track still plays; seeking in it is just slower
+    if (mpg123_scan(track->mh) == MPG123_OK) {
+        track->length = mpg123_length(track->mh);
+        saveIndex(track, &info);
+    }
+}
+
+/**
+ * @brief Open a track in a decoder that is not playing and decode its first block,
+ *        so it can start the moment the track before it ends. Takes ownership of
+ *        the queued file name.
+ */
+static int prepareTrack(struct audio_player *player, struct track *track, struct queued_track queued) {
+    int result;
+
+    track->fileName = queued.fileName;
+    if (mpg123_open(track->mh, queued.fileName) != MPG123_OK) {
+        fprintf(stderr, "Client: Could not open '%s' for playback: %s\n", queued.fileName,
+                mpg123_strerror(track->mh));
+        free(queued.fileName);
+        track->fileName = NULL;
+        return -1;
+    }
+    indexTrack(track);
+    memset(&track->format, 0, sizeof(track->format)); // Not the last track's
+    readFormat(track);
+    if (queued.start > 0 && mpg123_seek(track->mh, (off_t)(queued.start * track->format.rate), SEEK_SET) < 0) {
+        fprintf(stderr, "Client: Could not start '%s' at %.0f s: %s\n", queued.fileName, queued.start,
+                mpg123_strerror(track->mh));
+    }
+    result = mpg123_read(track->mh, track->first, player->blockSize, &track->firstLength);
+    if (result == MPG123_NEW_FORMAT) {
+        readFormat(track);
+        if (track->firstLength == 0) {
+            result = mpg123_read(track->mh, track->first, player->blockSize, &track->firstLength);
+        }
+    }
+
+    // A truncated or non-MP3 file has no audio to start with, or no format to play it in
+    if ((result != MPG123_OK && result != MPG123_NEW_FORMAT && result != MPG123_DONE) ||
+        track->firstLength == 0 || track->format.rate <= 0) {
+        fprintf(stderr, "Client: Could not decode '%s': %s\n", queued.fileName,
+                result == MPG123_OK || result == MPG123_DONE ? "no audio found" : mpg123_strerror(track->mh));
+        finishTrack(track);
+        return -1;
+    }
+    track->firstEnd = mpg123_tell(track->mh);
+    track->ready = 1;
+    return 0;
+}
+
+// Call with the lock held
+static struct queued_track popQueue(struct audio_player *player) {
+    struct queued_track queued = player->queue[player->head];
+
+    player->head = (player->head + 1) % QUEUE_SIZE;
+    player->count--;
+    return queued;
+}
+
+/**
+ * @brief Wait for a free block in the ring. Returns NULL if the player is stopped
+ *        while waiting.
+ */
+static struct pcm_block *reserveBlock(struct audio_player *player) {
+    size_t written = atomic_load_explicit(&player->written, memory_order_relaxed);
+    size_t played;
+
+    while ((played = atomic_load_explicit(&player->played, memory_order_acquire)) + player->depth == written) {
+        if (interrupted(player)) {
+            return NULL;
+        }
+        sleepPlayer(player, written, played);
+    }
+    return &player->ring[written % player->depth];
+}
+
+/**
+ * @brief Hand a filled block to the output thread.
+ */
+static void publishBlock(struct audio_player *player) {
+    atomic_fetch_add_explicit(&player->written, 1, memory_order_release);
+    wakePlayer(player);
+}
+
+/**
+ * @brief Decode the current track into the ring until it ends or the player is
+ *        stopped. While it decodes, the next queued track is prepared in the other
+ *        decoder.
+ */
+static void decodeTrack(struct audio_player *player, struct track *current, struct track *next) {
+    struct pcm_block *block;
+    struct queued_track queued;
+    // A seek asked for before this track started was meant for the one before it
+    unsigned generation = atomic_load(&player->seeks);
+    unsigned requested;
+    int result = MPG123_OK;
+
+    if ((block = reserveBlock(player)) == NULL) {
+        return;
+    }
+    memcpy(block->data, current->first, current->firstLength);
+    block->length = current->firstLength;
+    block->format = current->format;
+    block->announce = strdup(current->fileName);
+    block->generation = generation;
+    block->end = current->firstEnd;
+    block->trackLength = current->length;
+    clock_gettime(CLOCK_MONOTONIC, &block->decoded);
+    publishBlock(player);
+    atomic_store(&player->decoding, 1);
+
+    while (result == MPG123_OK || result == MPG123_NEW_FORMAT) {
+        if (!next->ready) {
+            pthread_mutex_lock(&player->lock);
+            queued.fileName = NULL;
+            if (!interrupted(player) && player->count > 0) {
+                queued = popQueue(player);
+            }
+            pthread_mutex_unlock(&player->lock);
+            if (queued.fileName != NULL) {
+                prepareTrack(player, next, queued);
+            }
+        }
+
+        if ((block = reserveBlock(player)) == NULL) {
+            break;
+        }
+        // With the index the decoder jumps straight to the frame holding the target
+        if ((requested = atomic_load(&player->seeks)) != generation) {
+            off_t target = (off_t)(atomic_load(&player->seekMs) * current->format.rate / 1000);
+            if (mpg123_seek(current->mh, target, SEEK_SET) < 0) {
+                fprintf(stderr, "Client: Could not seek in '%s': %s\n", current->fileName,
+                        mpg123_strerror(current->mh));
+            }
+            generation = requested;
+        }
+        result = mpg123_read(current->mh, block->data, player->blockSize, &block->length);
+        if (result == MPG123_NEW_FORMAT) {
+            readFormat(current);
+        }
+        if (block->length > 0) {
+            block->format = current->format;
+            block->announce = NULL;
+            block->generation = generation;
+            block->end = mpg123_tell(current->mh);
+            block->trackLength = current->length;
+            clock_gettime(CLOCK_MONOTONIC, &block->decoded);
+            publishBlock(player);
+        }
+    }
+}
+
+static void *decoderThread(void *arg) {
+    struct audio_player *player = arg;
+    struct track *current = &player->tracks[0];
+    struct track *next = &player->tracks[1];
+    struct track *swap;
+
+    pthread_mutex_lock(&player->lock);
+    while (!atomic_load(&player->closing)) {
+        if (atomic_load(&player->stopping)) {
+            finishTrack(current);
+            finishTrack(next);
+            while (player->count > 0) {
+                free(popQueue(player).fileName);
+            }
+            atomic_store(&player->decoding, 0);
+            atomic_store(&player->decoderStopped, 1);
+            pthread_cond_broadcast(&player->changed);
+            while (atomic_load(&player->stopping) && !atomic_load(&player->closing)) {
+                pthread_cond_wait(&player->changed, &player->lock);
+            }
+            continue;
+        }
+        if (!current->ready) {
+            if (player->count == 0) {
+                atomic_store(&player->decoding, 0);
+                pthread_cond_wait(&player->changed, &player->lock);
+                continue;
+            }
+            struct queued_track queued = popQueue(player);
+            pthread_mutex_unlock(&player->lock);
+            prepareTrack(player, current, queued);
+            pthread_mutex_lock(&player->lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&player->lock);
+        decodeTrack(player, current, next);
+        finishTrack(current);
+        swap = current;
+        current = next;
+        next = swap;
+        pthread_mutex_lock(&player->lock);
+    }
+    pthread_mutex_unlock(&player->lock);
+    finishTrack(current);
+    finishTrack(next);
+    return NULL;
+}
+
+/**
+ * @brief Make sure the device is open for a format, reopening it only if it was
+ *        opened for a different one.
+ */
+static int useFormat(struct audio_player *player, const ao_sample_format *format) {
+    if (player->dev != NULL && player->format.bits == format->bits && player->format.rate == format->rate &&
+        player->format.channels == format->channels) {
+        return 0;
+    }
+    if (player->dev != NULL) {
+        ao_close(player->dev);
+    }
+    player->format = *format;
+    player->dev = ao_open_live(ao_default_driver_id(), &player->format, NULL);
+    if (player->dev == NULL) {
+        fprintf(stderr, "Client: Could not open the audio device\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void closeDevice(struct audio_player *player) {
+    if (player->dev != NULL) {
+        ao_close(player->dev);
+        player->dev = NULL;
+    }
+}
+
+/**
+ * @brief Drop every block in the ring without playing it.
+ */
+static void drainRing(struct audio_player *player) {
+    size_t written = atomic_load_explicit(&player->written, memory_order_acquire);
+    size_t played = atomic_load_explicit(&player->played, memory_order_relaxed);
+
+    for (; played != written; played++) {
+        free(player->ring[played % player->depth].announce);
+        player->ring[played % player->depth].announce = NULL;
+    }
+    atomic_store_explicit(&player->played, played, memory_order_release);
+    wakePlayer(player);
+}
+
+/**
+ * @brief Make a track that has just reached the device the one the listener hears.
+ *        Takes ownership of 'fileName'; NULL means nothing is playing.
+ */
+static void setPlaying(struct audio_player *player, char *fileName, off_t length, long rate) {
+    if (fileName != NULL) {
+        printf("\nClient: Playing '%s'\n", fileName);
+        fflush(stdout);
+    }
+    pthread_mutex_lock(&player->lock);
+    free(player->playing);
+    player->playing = fileName;
+    pthread_mutex_unlock(&player->lock);
+    atomic_store(&player->positionMs, 0);
+    atomic_store(&player->lengthMs, rate > 0 ? length * 1000 / rate : 0);
+}
+
+static void recordLatency(struct audio_player *player, unsigned long long latency) {
+    unsigned long long max = atomic_load_explicit(&player->latencyMaxNs, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&player->blocks, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&player->latencyTotalNs, latency, memory_order_relaxed);
+    while (latency > max &&
+           !atomic_compare_exchange_weak_explicit(&player->latencyMaxNs, &max, latency,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+/**
+ * @brief Take decoded blocks off the ring and play them. This is the only thread
+ *        that waits on the device, so a slow ao_play() only uses up buffered audio
+ *        instead of holding up the decoder.
+ */
+static void *outputThread(void *arg) {
+    struct audio_player *player = arg;
+    struct pcm_block *block;
+    size_t written, played;
+    int dry = 0;
+
+    while (!atomic_load(&player->closing)) {
+        played = atomic_load_explicit(&player->played, memory_order_relaxed);
+        written = atomic_load_explicit(&player->written, memory_order_acquire);
+
+        if (atomic_load(&player->stopping)) {
+            // Keep emptying the ring until the decoder has stopped filling it
+            drainRing(player);
+            closeDevice(player);
+            dry = 0;
+            if (player->playing != NULL) {
+                setPlaying(player, NULL, 0, 0);
+            }
+            if (atomic_load(&player->decoderStopped) &&
+                atomic_load(&player->written) == atomic_load(&player->played)) {
+                pthread_mutex_lock(&player->lock);
+                atomic_store(&player->outputStopped, 1);
+                pthread_cond_broadcast(&player->changed);
+                while (atomic_load(&player->stopping) && !atomic_load(&player->closing)) {
+                    pthread_cond_wait(&player->changed, &player->lock);
+                }
+                pthread_mutex_unlock(&player->lock);
+            } else {
+                sleepPlayer(player, atomic_load(&player->written), atomic_load(&player->played));
+            }
+            continue;
+        }
+        block = &player->ring[played % player->depth];
+        if (played != written && block->announce != NULL) {
+            setPlaying(player, block->announce, block->trackLength, block->format.rate);
+            block->announce = NULL;
+        }
+        // Audio from before a seek is dropped, even while paused, so the decoder can
+        // refill the ring from the new position
+        if (played != written && block->generation != atomic_load(&player->seeks)) {
+            dry = 1; // The ring the seek emptied is not an underrun
+            atomic_store_explicit(&player->played, played + 1, memory_order_release);
+            wakePlayer(player);
+            continue;
+        }
+        if (atomic_load(&player->paused)) {
+            sleepPlayer(player, written, played);
+            continue;
+        }
+        if (played == written) {
+            // Out of audio in the middle of a track: the decoder has fallen behind
+            if (!dry && atomic_load(&player->decoding)) {
+                atomic_fetch_add_explicit(&player->underruns, 1, memory_order_relaxed);
+                dry = 1;
+            } else if (!atomic_load(&player->decoding) && player->playing != NULL) {
+                setPlaying(player, NULL, 0, 0); // The queue has played out
+            }
+            sleepPlayer(player, written, played);
+            continue;
+        }
+        dry = 0;
+
+        recordLatency(player, nsSince(&block->decoded));
+        if (useFormat(player, &block->format) == 0) {
+            ao_play(player->dev, (char *)block->data, block->length);
+        }
+        if (block->format.rate > 0) {
+            atomic_store(&player->positionMs, block->end * 1000 / block->format.rate);
+        }
+        atomic_store_explicit(&player->played, played + 1, memory_order_release);
+        wakePlayer(player);
+    }
+    drainRing(player);
+    closeDevice(player);
+    return NULL;
+}
+
+/**
+ * @brief Start a player with an empty queue. The audio device is opened when the
+ *        first track starts.
+ *
+ * @param depth - Blocks of decoded audio buffered between the decoder and the
+ *        device, at least 2. A block is mpg123_outblock() bytes.
+ */
+struct audio_player *audioPlayerOpen(size_t depth) {
+    struct audio_player *player = calloc(1, sizeof(*player));
+    int err;
+
+    if (player == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&player->lock, NULL);
+    pthread_cond_init(&player->changed, NULL);
+    for (int i = 0; i < 2; i++) {
+        player->tracks[i].mh = mpg123_new(NULL, &err);
+        if (player->tracks[i].mh == NULL) {
+            fprintf(stderr, "Client: Could not start the decoder: %s\n", mpg123_plain_strerror(err));
+            audioPlayerClose(player);
+            return NULL;
+        }
+        // Trim the encoder's padding at the ends of each track, which would otherwise
+        // be heard as a short silence between tracks
+        mpg123_param(player->tracks[i].mh, MPG123_ADD_FLAGS, MPG123_GAPLESS | MPG123_QUIET, 0);
+        mpg123_param(player->tracks[i].mh, MPG123_INDEX_SIZE, INDEX_SIZE, 0);
+    }
+    player->blockSize = mpg123_outblock(player->tracks[0].mh);
+    player->tracks[0].first = malloc(player->blockSize);
+    player->tracks[1].first = malloc(player->blockSize);
+    player->depth = depth < 2 ? 2 : depth;
+    player->ring = calloc(player->depth, sizeof(struct pcm_block));
+    if (player->tracks[0].first == NULL || player->tracks[1].first == NULL || player->ring == NULL) {
+        audioPlayerClose(player);
+        return NULL;
+    }
+    for (size_t i = 0; i < player->depth; i++) {
+        if ((player->ring[i].data = malloc(player->blockSize)) == NULL) {
+            audioPlayerClose(player);
+            return NULL;
+        }
+    }
+
+    if (pthread_create(&player->output, NULL, outputThread, player) != 0) {
+        audioPlayerClose(player);
+        return NULL;
+    }
+    if (pthread_create(&player->decoder, NULL, decoderThread, player) != 0) {
+        atomic_store(&player->closing, 1);
+        pthread_join(player->output, NULL);
+        audioPlayerClose(player);
+        return NULL;
+    }
+    player->started = 1;
+    return player;
+}
+
+/**
+ * @brief Add a file to the end of the queue. Playback starts at once if nothing is
+ *        playing.
+ *
+ * @return How many tracks are waiting, or -1 if the queue is full.
+ */
+int audioPlayerEnqueue(struct audio_player *player, const char *fileName) {
+    return audioPlayerEnqueueAt(player, fileName, 0);
+}
+
+/**
+ * @brief Add a file to the end of the queue, to start 'seconds' into the track,
+ *        e.g. where an earlier play of it was stopped.
+ *
+ * @return How many tracks are waiting, or -1 if the queue is full.
+ */
+int audioPlayerEnqueueAt(struct audio_player *player, const char *fileName, double seconds) {
+    char *copy = strdup(fileName);
+    int waiting = -1;
+
+    pthread_mutex_lock(&player->lock);
+    if (copy != NULL && player->count < QUEUE_SIZE) {
+        player->queue[(player->head + player->count) % QUEUE_SIZE] =
+            (struct queued_track){.fileName = copy, .start = seconds};
+        waiting = ++player->count;
+        copy = NULL;
+        pthread_cond_broadcast(&player->changed);
+    }
+    pthread_mutex_unlock(&player->lock);
+    free(copy);
+    return waiting;
+}
+
+/**
+ * @brief Pause or resume playback. The device stays open while paused, and the
+ *        decoder keeps the ring full so playback resumes at once.
+ *
+ * @return 1 if playback is now paused, 0 if it is playing.
+ */
+int audioPlayerTogglePause(struct audio_player *player) {
+    int paused = !atomic_fetch_xor(&player->paused, 1);
+
+    pthread_mutex_lock(&player->lock);
+    pthread_cond_broadcast(&player->changed);
+    pthread_mutex_unlock(&player->lock);
+    return paused;
+}
+
+/**
+ * @brief Move within the track that is playing. Audio already decoded from the old
+ *        position is dropped rather than played.
+ *
+ * @param whence - SEEK_SET to go to 'seconds' from the start, SEEK_CUR to skip
+ *        'seconds' forwards or, if negative, back.
+ * @return The position sought to in seconds, or -1 if nothing is playing.
+ */
+double audioPlayerSeek(struct audio_player *player, double seconds, int whence) {
+    long long target, length;
+
+    pthread_mutex_lock(&player->lock);
+    if (player->playing == NULL) {
+        pthread_mutex_unlock(&player->lock);
+        return -1;
+    }
+    target = (long long)(seconds * 1000) + (whence == SEEK_CUR ? atomic_load(&player->positionMs) : 0);
+    length = atomic_load(&player->lengthMs);
+    if (length > 0 && target > length) {
+        target = length;
+    }
+    if (target < 0) {
+        target = 0;
+    }
+    atomic_store(&player->seekMs, target);
+    atomic_fetch_add(&player->seeks, 1);
+    pthread_cond_broadcast(&player->changed);
+    pthread_mutex_unlock(&player->lock);
+    return target / 1000.0;
+}
+
+/**
+ * @brief Find out what is playing and how far into it the listener is.
+ *
+ * @param length - Set to the track's length in seconds, or 0 if it is not known.
+ * @return 0, or -1 if nothing is playing.
+ */
+int audioPlayerPosition(struct audio_player *player, char *fileName, size_t size, double *seconds,
+                        double *length) {
+    int result = -1;
+
+    pthread_mutex_lock(&player->lock);
+    if (player->playing != NULL) {
+        snprintf(fileName, size, "%s", player->playing);
+        *seconds = atomic_load(&player->positionMs) / 1000.0;
+        *length = atomic_load(&player->lengthMs) / 1000.0;
+        result = 0;
+    }
+    pthread_mutex_unlock(&player->lock);
+    return result;
+}
+
+/**
+ * @brief Stop the current track, empty the queue and close the audio device.
+ *        Returns once both threads have let go of everything. The player itself
+ *        stays ready for new tracks, and is no longer paused.
+ */
+void audioPlayerStop(struct audio_player *player) {
+    pthread_mutex_lock(&player->lock);
+    atomic_store(&player->decoderStopped, 0);
+    atomic_store(&player->outputStopped, 0);
+    atomic_store(&player->stopping, 1);
+    pthread_cond_broadcast(&player->changed);
+    while (player->started && !(atomic_load(&player->decoderStopped) && atomic_load(&player->outputStopped))) {
+        pthread_cond_wait(&player->changed, &player->lock);
+    }
+    atomic_store(&player->paused, 0);
+    atomic_store(&player->stopping, 0);
+    pthread_cond_broadcast(&player->changed);
+    pthread_mutex_unlock(&player->lock);
+}
+
+/**
+ * @brief Read the player's counters, to see whether its buffer is deep enough for
+ *        this machine.
+ */
+void audioPlayerStats(struct audio_player *player, struct audio_player_stats *stats) {
+    stats->depth = player->depth;
+    stats->blocks = atomic_load(&player->blocks);
+    stats->underruns = atomic_load(&player->underruns);
+    stats->averageLatencyMs = stats->blocks ? atomic_load(&player->latencyTotalNs) / 1e6 / stats->blocks : 0;
+    stats->maxLatencyMs = atomic_load(&player->latencyMaxNs) / 1e6;
+}
+
+/**
+ * @brief Stop playback and free the player, its decoders, its ring and its device.
+ */
+void audioPlayerClose(struct audio_player *player) {
+    pthread_mutex_lock(&player->lock);
+    atomic_store(&player->closing, 1);
+    pthread_cond_broadcast(&player->changed);
+    pthread_mutex_unlock(&player->lock);
+    if (player->started) {
+        pthread_join(player->decoder, NULL);
+        pthread_join(player->output, NULL);
+    }
 
+    for (int i = 0; i < 2; i++) {
+        if (player->tracks[i].mh != NULL) {
+            mpg123_delete(player->tracks[i].mh);
+        }
+        free(player->tracks[i].first);
+    }
+    for (size_t i = 0; player->ring != NULL && i < player->depth; i++) {
+        free(player->ring[i].data);
+        free(player->ring[i].announce);
+    }
+    free(player->ring);
+    free(player->playing);
+    pthread_mutex_destroy(&player->lock);
+    pthread_cond_destroy(&player->changed);
+    free(player);
+}
+
+static double msSince(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void audioStreamRelease(struct audio_stream *stream) {
+    int references;
+
+    pthread_mutex_lock(&stream->lock);
+    references = --stream->references;
+    pthread_mutex_unlock(&stream->lock);
+    if (references == 0) {
+        pthread_mutex_destroy(&stream->lock);
+        pthread_cond_destroy(&stream->changed);
+        free(stream->data);
+        free(stream);
+    }
+}
+
+/**
+ * @brief Start a stream. The caller feeds it and then closes it; the player passed
+ *        it by playAudioStream() lets go of it when playback ends.
+ */
+struct audio_stream *audioStreamOpen(void) {
+    struct audio_stream *stream = calloc(1, sizeof(*stream));
+
+    if (stream == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->changed, NULL);
+    stream->references = 2;
+    clock_gettime(CLOCK_MONOTONIC, &stream->opened);
+    return stream;
+}
+
+/**
+ * @brief Hand the player the next bytes of the file. Never waits for playback.
+ */
+int audioStreamFeed(struct audio_stream *stream, const void *data, size_t size) {
+    int result = 0;
+
+    pthread_mutex_lock(&stream->lock);
+    if (stream->length + size > stream->capacity) {
+        size_t capacity = stream->capacity ? stream->capacity : 64 * 1024;
+        unsigned char *grown;
+
+        while (capacity < stream->length + size) {
+            capacity *= 2;
+        }
+        grown = realloc(stream->data, capacity);
+        if (grown == NULL) {
+            result = -1;
+        } else {
+            stream->data = grown;
+            stream->capacity = capacity;
+        }
+    }
+    if (result == 0) {
+        memcpy(stream->data + stream->length, data, size);
+        stream->length += size;
+        stream->fed += size;
+        pthread_cond_signal(&stream->changed);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return result;
+}
+
+/**
+ * @brief How many bytes of the file the player has been given, so a download that
+ *        is retried does not feed the same part twice.
+ */
+size_t audioStreamFed(struct audio_stream *stream) {
+    size_t fed;
+
+    pthread_mutex_lock(&stream->lock);
+    fed = stream->fed;
+    pthread_mutex_unlock(&stream->lock);
+    return fed;
+}
+
+/**
+ * @brief Tell the player there is nothing more to come, and let go of the stream.
+ */
+void audioStreamClose(struct audio_stream *stream) {
+    pthread_mutex_lock(&stream->lock);
+    stream->ended = 1;
+    pthread_cond_signal(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+    audioStreamRelease(stream);
+}
+
+/**
+ * @brief Play a stream as it is fed, until it ends or *stop is set.
+ *        When the decoder runs out of data before the download has finished, the
+ *        network has fallen behind playback; each of those underruns is reported.
+ */
+int playAudioStream(struct audio_stream *stream, atomic_int *stop) {
+    mpg123_handle *mh;
+    ao_device *dev = NULL;
+    ao_sample_format format;
+    unsigned char *input = NULL;
+    unsigned char *audio;
+    size_t inputLength = 0;
+    size_t bytes;
+    off_t frame;
+    long rate;
+    int channels, encoding;
+    int err;
+    int underruns = 0;
+    int playing = 0;
+    int result;
+
+    mh = mpg123_new(NULL, &err);
+    if (mh == NULL) {
+        fprintf(stderr, "Client: Could not start the decoder: %s\n", mpg123_plain_strerror(err));
+        audioStreamRelease(stream);
+        return -1;
+    }
+    if (mpg123_open_feed(mh) != MPG123_OK) {
+        fprintf(stderr, "Client: Could not start the decoder: %s\n", mpg123_strerror(mh));
+        mpg123_delete(mh);
+        audioStreamRelease(stream);
+        return -1;
+    }
+
+    while (!atomic_load(stop)) {
+        result = mpg123_decode_frame(mh, &frame, &audio, &bytes);
+        if (result == MPG123_NEW_FORMAT) {
+            mpg123_getformat(mh, &rate, &channels, &encoding);
+            format.bits = mpg123_encsize(encoding) * BITS;
+            format.rate = rate;
+            format.channels = channels;
+            format.byte_format = AO_FMT_NATIVE;
+            format.matrix = 0;
+            if (dev != NULL) {
+                ao_close(dev);
+            }
+            dev = ao_open_live(ao_default_driver_id(), &format, NULL);
+        } else if (result == MPG123_OK) {
+            if (!playing && bytes > 0) {
+                printf("\nClient: Playback started %.0f ms after the download\n", msSince(&stream->opened));
+                playing = 1;
+            }
+            if (dev != NULL && bytes > 0) {
+                ao_play(dev, (char *)audio, bytes);
+            }
+        } else if (result == MPG123_NEED_MORE) {
+            // Take everything fed since last time, waiting if there is nothing yet
+            struct timespec deadline;
+
+            pthread_mutex_lock(&stream->lock);
+            if (stream->length == 0 && !stream->ended && playing) {
+                underruns++;
+                printf("\nClient: Playback is waiting for the download (underrun %d)\n", underruns);
+            }
+            while (stream->length == 0 && !stream->ended && !atomic_load(stop)) {
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += STOP_CHECK_NS;
+                if (deadline.tv_nsec >= 1000000000) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&stream->changed, &stream->lock, &deadline);
+            }
+            free(input);
+            input = stream->data;
+            inputLength = stream->length;
+            stream->data = NULL;
+            stream->length = 0;
+            stream->capacity = 0;
+            pthread_mutex_unlock(&stream->lock);
+
+            if (inputLength == 0) {
+                break; // The download ended or playback was stopped
+            }
+            if (mpg123_feed(mh, input, inputLength) != MPG123_OK) {
+                fprintf(stderr, "Client: Decoder error: %s\n", mpg123_strerror(mh));
+                break;
+            }
+        } else {
+            // MPG123_DONE or a decoding error
+            break;
+        }
+    }
+
+    if (underruns > 0) {
+        printf("Client: Playback waited for the network %d time%s\n", underruns, underruns == 1 ? "" : "s");
+    }
+
+    free(input);
+    if (dev != NULL) {
+        ao_close(dev);
+    }
+    mpg123_close(mh);
+    mpg123_delete(mh);
+    audioStreamRelease(stream);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,6 +1,57 @@
 #ifndef _PLAYAUDIO_H
 #define _PLAYAUDIO_H
 
-int playAudio(char* fileName, int *stopFlag);
+#include <stdatomic.h>
+#include <stddef.h>
 
-#endif
\ No newline at end of file
+// Call once before any playback starts, and audioShutdown() once it has all ended
+void audioInit(void);
+void audioShutdown(void);
+
+// A player for downloaded MP3s. It keeps one decoder and one open audio device for
+// as long as it lives and plays a queue of files back to back. While a track plays,
+// the next one is already opened and its first block decoded, so there is no gap
+// between them. The device is only reopened when the next track's sample format is
+// different.
+//
+// Decoding and output run on separate threads joined by a lock-free ring of decoded
+// blocks, so a slow write to the device only uses up buffered audio and a slow
+// decode only shows up as an underrun once the ring is empty.
+//
+// The first play of a file scans it and saves an index of where its frames start
+// beside it, so seeking, or starting a track part way through, jumps straight to
+// the right frame instead of decoding up to it.
+struct audio_player;
+
+// Counters for sizing the ring on a given machine
+struct audio_player_stats {
+    size_t depth;              // Blocks the ring holds
+    unsigned long blocks;      // Blocks played
+    unsigned long underruns;   // Times the ring ran dry in the middle of a track
+    double averageLatencyMs;   // Time from decoding a block to playing it
+    double maxLatencyMs;
+};
+
+struct audio_player *audioPlayerOpen(size_t depth);
+int audioPlayerEnqueue(struct audio_player *player, const char *fileName);
+int audioPlayerEnqueueAt(struct audio_player *player, const char *fileName, double seconds);
+double audioPlayerSeek(struct audio_player *player, double seconds, int whence);
+int audioPlayerPosition(struct audio_player *player, char *fileName, size_t size, double *seconds,
+                        double *length);
+int audioPlayerTogglePause(struct audio_player *player);
+void audioPlayerStop(struct audio_player *player);
+void audioPlayerStats(struct audio_player *player, struct audio_player_stats *stats);
+void audioPlayerClose(struct audio_player *player);
+
+// An MP3 that is played while it is still being downloaded. The downloading thread
+// feeds bytes in as they arrive and the playing thread decodes them with mpg123's
+// feed API, so playback starts after the first few frames rather than the whole file.
+struct audio_stream;
+
+struct audio_stream *audioStreamOpen(void);
+int audioStreamFeed(struct audio_stream *stream, const void *data, size_t size);
+size_t audioStreamFed(struct audio_stream *stream);
+void audioStreamClose(struct audio_stream *stream);
+int playAudioStream(struct audio_stream *stream, atomic_int *stop);
+
+#endif
@@ -0,0 +1,200 @@
+/**
+* @file ratelimit.c
+* @author Corey Brantley, Shen Knoll, Harrison Sherwin
+* @brief  Bandwidth limits for bulk replies (DOWNLOAD and RANGE). Each connection
+*         has a token bucket of its own, and every connection from one client
+*         address also draws from a bucket shared by that address, so opening
+*         more connections does not buy a client more bandwidth.
+*
+*         Writers take tokens for what they are about to send and, if that leaves
+*         a bucket in debt, sleep until it would be paid off. The sleep happens on
+*         the download worker sending the reply, never on the event loop.
+*
+*         Client buckets live in a hash table keyed by address. When the last
+*         connection from an address closes its bucket stays behind until it has
+*         refilled, so reconnecting does not start a client off with a fresh
+*         burst; refilled idle buckets are dropped as lookups walk past them.
+*/
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ratelimit.h"
+#include "metrics.h"
+
+#define CLIENT_TABLE_SIZE 1024
+#define BURST_SECONDS     1            // A bucket holds this many seconds of its rate
+#define MIN_BURST         (64 * 1024)  // ...but never less than a few TLS records
+
+// The bucket shared by every connection from one client address
+struct client_bucket {
+    struct in_addr address;
+    int references;           // Connections from the address that are open
+    struct token_bucket bucket;
+    struct client_bucket *next;
+};
+
+static struct {
+    double client_rate;       // Bytes per second, 0 for no limit
+    double connection_rate;
+    pthread_mutex_t lock;     // Guards the table and the reference counts
+    struct client_bucket *table[CLIENT_TABLE_SIZE];
+} limits = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void token_bucket_init(struct token_bucket *bucket, double rate) {
+    pthread_mutex_init(&bucket->lock, NULL);
+    bucket->rate = rate;
+    bucket->burst = rate * BURST_SECONDS < MIN_BURST ? MIN_BURST : rate * BURST_SECONDS;
+    bucket->tokens = bucket->burst;
+    clock_gettime(CLOCK_MONOTONIC, &bucket->refilled);
+}
+
+// Add the tokens earned since the last refill. Call with the bucket's lock held.
+static void refill(struct token_bucket *bucket) {
+    struct timespec now;
+    double elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - bucket->refilled.tv_sec) + (now.tv_nsec - bucket->refilled.tv_nsec) / 1e9;
+    bucket->tokens += elapsed * bucket->rate;
+    if (bucket->tokens > bucket->burst) {
+        bucket->tokens = bucket->burst;
+    }
+    bucket->refilled = now;
+}
+
+/**
+ * @brief Take tokens for bytes about to be sent.
+ *
+ * @param bucket - The bucket to take from.
+ * @param bytes - Number of bytes about to be sent.
+ * @return Seconds to wait before sending them, 0 if the bucket could pay for them.
+ */
+static double token_bucket_take(struct token_bucket *bucket, size_t bytes) {
+    double wait = 0;
+
+    if (bucket->rate <= 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&bucket->lock);
+    refill(bucket);
+    bucket->tokens -= bytes;
+    if (bucket->tokens < 0) {
+        wait = -bucket->tokens / bucket->rate;
+    }
+    pthread_mutex_unlock(&bucket->lock);
+    return wait;
+}
+
+static bool token_bucket_full(struct token_bucket *bucket) {
+    bool full;
+
+    pthread_mutex_lock(&bucket->lock);
+    refill(bucket);
+    full = bucket->tokens >= bucket->burst;
+    pthread_mutex_unlock(&bucket->lock);
+    return full;
+}
+
+static unsigned int hash_address(struct in_addr address) {
+    uint32_t hash = address.s_addr;
+
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3b;
+    hash ^= hash >> 16;
+    return hash % CLIENT_TABLE_SIZE;
+}
+
+/**
+ * @brief Set the limits. Call once at startup, before any connection is opened.
+ *
+ * @param client_rate - Bytes a second one client address may receive, 0 for no limit.
+ * @param connection_rate - Bytes a second one connection may receive, 0 for no limit.
+ */
+void rate_limit_configure(size_t client_rate, size_t connection_rate) {
+    limits.client_rate = client_rate;
+    limits.connection_rate = connection_rate;
+}
+
+bool rate_limit_enabled(void) {
+    return limits.client_rate > 0 || limits.connection_rate > 0;
+}
+
+/**
+ * @brief Set up the buckets for a new connection.
+ *
+ * @param limit - The connection's limits.
+ * @param address - Where the connection came from.
+ */
+void rate_limit_open(struct rate_limit *limit, struct in_addr address) {
+    struct client_bucket **link;
+    struct client_bucket *entry;
+    unsigned int slot = hash_address(address);
+
+    token_bucket_init(&limit->connection, limits.connection_rate);
+    limit->client = NULL;
+    if (limits.client_rate <= 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&limits.lock);
+    link = &limits.table[slot];
+    while ((entry = *link) != NULL) {
+        if (entry->address.s_addr == address.s_addr) {
+            limit->client = entry;
+        } else if (entry->references == 0 && token_bucket_full(&entry->bucket)) {
+            // Idle and refilled: a new bucket would be no different
+            *link = entry->next;
+            pthread_mutex_destroy(&entry->bucket.lock);
+            free(entry);
+            continue;
+        }
+        link = &entry->next;
+    }
+    if (limit->client == NULL && (entry = calloc(1, sizeof(*entry))) != NULL) {
+        entry->address = address;
+        token_bucket_init(&entry->bucket, limits.client_rate);
+        entry->next = limits.table[slot];
+        limits.table[slot] = entry;
+        limit->client = entry;
+    }
+    if (limit->client != NULL) {
+        limit->client->references++;
+    }
+    pthread_mutex_unlock(&limits.lock);
+}
+
+void rate_limit_close(struct rate_limit *limit) {
+    if (limit->client != NULL) {
+        pthread_mutex_lock(&limits.lock);
+        limit->client->references--;
+        pthread_mutex_unlock(&limits.lock);
+        limit->client = NULL;
+    }
+    pthread_mutex_destroy(&limit->connection.lock);
+}
+
+/**
+ * @brief Wait until a connection may send more bytes of a bulk reply. Fits the
+ *        output buffer's pace hook.
+ *
+ * @param arg - The connection's struct rate_limit.
+ * @param bytes - Number of bytes about to be sent.
+ */
+void rate_limit_pace(void *arg, size_t bytes) {
+    struct rate_limit *limit = arg;
+    double connection_wait = token_bucket_take(&limit->connection, bytes);
+    double client_wait = limit->client != NULL ? token_bucket_take(&limit->client->bucket, bytes) : 0;
+    double wait = client_wait > connection_wait ? client_wait : connection_wait;
+    struct timespec pause;
+
+    if (wait <= 0) {
+        return;
+    }
+    metrics_throttled(client_wait > connection_wait ? METRICS_LIMIT_CLIENT : METRICS_LIMIT_CONNECTION, wait);
+    pause.tv_sec = (time_t)wait;
+    pause.tv_nsec = (long)((wait - pause.tv_sec) * 1e9);
+    while (nanosleep(&pause, &pause) != 0 && errno == EINTR) {
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef _RATELIMIT_H
+#define _RATELIMIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+// A token bucket that refills at 'rate' bytes a second up to 'burst' bytes. Sends
+// take their size in tokens at once and the bucket may go into debt, so a send
+// larger than the burst is paid off by waiting rather than never fitting.
+struct token_bucket {
+    pthread_mutex_t lock;
+    double rate;              // Bytes per second, 0 for no limit
+    double burst;
+    double tokens;
+    struct timespec refilled;
+};
+
+// The buckets a connection's bulk replies are paced by: its own, and the one it
+// shares with every other connection from the same client address
+struct rate_limit {
+    struct token_bucket connection;
+    struct client_bucket *client; // NULL when there is no per-client limit
+};
+
+void rate_limit_configure(size_t client_rate, size_t connection_rate);
+bool rate_limit_enabled(void);
+void rate_limit_open(struct rate_limit *limit, struct in_addr address);
+void rate_limit_close(struct rate_limit *limit);
+void rate_limit_pace(void *arg, size_t bytes);
+
+#endif
@@ -0,0 +1,111 @@
+/**
+* @file searchbench.c
+* @author Corey Brantley, Shen Knoll, Harrison Sherwin
+* @brief  Micro-benchmark for the SEARCH operation. Builds a synthetic library of
+*         track names and times each query three ways: the old linear strstr()
+*         scan (case-sensitive, as the server used to do), a linear case-insensitive
+*         scan, and the trigram index from searchindex.c.
+*
+*         Usage: ./searchbench [number of tracks] [iterations per query]
+*/
+
+#define _GNU_SOURCE // strcasestr()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "searchindex.h"
+
+#define DEFAULT_TRACKS     100000
+#define DEFAULT_ITERATIONS 200
+#define NAME_SIZE          128
+#define RESULT_LIMIT       100
+
+static const char *words[] = {
+    "ambient", "night", "detective", "lazy", "day", "stylish", "futuristic", "chill",
+    "slow", "motion", "inspiring", "lounge", "summer", "rain", "city", "lights",
+    "dream", "ocean", "electric", "piano", "guitar", "morning", "coffee", "jazz",
+    "sunset", "drive", "neon", "retro", "lofi", "forest", "space", "echo"
+};
+#define WORD_COUNT (sizeof(words) / sizeof(words[0]))
+
+static const char *queries[] = {
+    "night", "Detective", "chill lounge", "slow motion piano", "neon-retro", "12345", "zz", "mp3"
+};
+#define QUERY_COUNT (sizeof(queries) / sizeof(queries[0]))
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(int argc, char **argv) {
+    size_t tracks = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_TRACKS;
+    int iterations = argc > 2 ? atoi(argv[2]) : DEFAULT_ITERATIONS;
+    char **names = malloc(tracks * sizeof(*names));
+    uint32_t results[RESULT_LIMIT];
+    struct search_index *index;
+    volatile size_t sink = 0; // Keeps the scans from being optimized away
+    double start;
+
+    if (names == NULL || tracks == 0 || iterations <= 0) {
+        fprintf(stderr, "Usage: %s [number of tracks] [iterations per query]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Names look like the sample library: a few words and a number
+    srand(469);
+    for (size_t i = 0; i < tracks; i++) {
+        names[i] = malloc(NAME_SIZE);
+        snprintf(names[i], NAME_SIZE, "%s-%s-%s-%s-%06d.mp3",
+                 words[rand() % WORD_COUNT], words[rand() % WORD_COUNT],
+                 words[rand() % WORD_COUNT], words[rand() % WORD_COUNT], rand() % 1000000);
+    }
+
+    start = now_us();
+    index = search_index_build((const char *const *)names, tracks);
+    if (index == NULL) {
+        fprintf(stderr, "Unable to build the search index\n");
+        return EXIT_FAILURE;
+    }
+    printf("Built index over %zu tracks in %.1f ms\n\n", tracks, (now_us() - start) / 1000);
+
+    printf("%-20s %10s %14s %14s %14s\n", "query", "matches", "strstr (us)", "strcasestr (us)", "index (us)");
+    for (size_t q = 0; q < QUERY_COUNT; q++) {
+        double linear, caseless, indexed;
+        size_t matches = 0;
+
+        start = now_us();
+        for (int it = 0; it < iterations; it++) {
+            for (size_t i = 0; i < tracks; i++) {
+                sink += strstr(names[i], queries[q]) != NULL;
+            }
+        }
+        linear = (now_us() - start) / iterations;
+
+        start = now_us();
+        for (int it = 0; it < iterations; it++) {
+            for (size_t i = 0; i < tracks; i++) {
+                sink += strcasestr(names[i], queries[q]) != NULL;
+            }
+        }
+        caseless = (now_us() - start) / iterations;
+
+        start = now_us();
+        for (int it = 0; it < iterations; it++) {
+            matches = search_index_query(index, queries[q], results, RESULT_LIMIT);
+        }
+        indexed = (now_us() - start) / iterations;
+
+        printf("%-20s %10zu %14.1f %14.1f %14.1f\n", queries[q], matches, linear, caseless, indexed);
+    }
+
+    search_index_free(index);
+    for (size_t i = 0; i < tracks; i++) {
+        free(names[i]);
+    }
+    free(names);
+    return sink == (size_t)-1; // Never true; uses the sink
+}
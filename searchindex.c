@@ -0,0 +1,398 @@
+/**
+* @file searchindex.c
+* @author Corey Brantley, Shen Knoll, Harrison Sherwin
+* @brief  A trigram inverted index over track names for the SEARCH operation.
+*
+*         Every name is lowercased and broken into overlapping three-byte
+*         sequences (trigrams). For each trigram the index keeps the sorted list of
+*         names that contain it. A query is lowercased and split on whitespace
+*         into terms, and every term must appear in a name for it to match. The
+*         shortest posting list among the query's trigrams gives a small candidate
+*         set, and each candidate is then checked with a plain substring search.
+*         Terms shorter than three characters have no trigrams and are only
+*         checked against the candidates; a query made only of such terms scans
+*         every name.
+*
+*         Matches are ranked so a term at the start of the name beats one at the
+*         start of a word, which beats one in the middle of a word. Ties go to the
+*         shorter name, then to the order of the names given to the index.
+*
+*         Two things keep broad queries fast. Names are numbered shortest first, so
+*         candidates are visited in ranking order for equal scores and only the
+*         best few need to be kept, in a small heap. Each posting also records
+*         where in the name its trigram appears, which bounds the score of a
+*         candidate before it is checked; candidates that cannot beat the worst
+*         result kept so far are skipped without a substring search.
+*/
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "searchindex.h"
+
+#define MAX_QUERY_LENGTH 256
+#define MAX_QUERY_TERMS  8
+
+// Points a term scores depending on where it matched
+#define SCORE_NAME_START 4
+#define SCORE_WORD_START 2
+#define SCORE_INSIDE     1
+
+// Where a trigram appears in a name, kept in the low bits of each posting
+#define PLACE_BITS       2
+#define PLACE_MASK       3
+#define PLACE_INSIDE     1
+#define PLACE_WORD_START 2
+#define PLACE_NAME_START 3
+
+static const int place_score[] = { 0, SCORE_INSIDE, SCORE_WORD_START, SCORE_NAME_START };
+
+// Names are numbered internally shortest first. The names arena and postings
+// use these numbers; order maps them back to positions in the caller's list.
+struct search_index {
+    size_t count;       // Number of names
+    char *names;        // Lowercased names, NUL-terminated, back to back
+    uint32_t *offsets;  // Where each name starts in names
+    uint32_t *order;    // Caller's position of each name
+    size_t key_count;   // Number of distinct trigrams
+    uint32_t *keys;     // Distinct trigrams, sorted
+    uint32_t *starts;   // Where each trigram's posting list starts in postings
+    uint32_t *postings; // Name number << PLACE_BITS | best place, sorted by name
+};
+
+struct search_match {
+    uint32_t id;
+    uint32_t length;
+    int score;
+};
+
+/**
+ * @brief Pack three bytes into a trigram key.
+ */
+static uint32_t trigram(const char *text) {
+    return ((uint32_t)(unsigned char)text[0] << 16) |
+           ((uint32_t)(unsigned char)text[1] << 8) |
+           (uint32_t)(unsigned char)text[2];
+}
+
+/**
+ * @brief Classify where a trigram starting at position j of a name appears.
+ */
+static uint32_t trigram_place(const char *name, size_t j) {
+    if (j == 0) {
+        return PLACE_NAME_START;
+    }
+    return isalnum((unsigned char)name[j - 1]) ? PLACE_INSIDE : PLACE_WORD_START;
+}
+
+static int compare_pairs(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+/**
+ * @brief Build an index over a list of names. The names are copied, so they do
+ *        not need to outlive the index. Query results refer to names by their
+ *        position in this list.
+ *
+ * @param names - The names to index.
+ * @param count - Number of names.
+ * @return The index, or NULL if memory ran out.
+ */
+struct search_index *search_index_build(const char *const *names, size_t count) {
+    struct search_index *index = calloc(1, sizeof(*index));
+    size_t total = 0, pair_count = 0, unique = 0;
+    uint64_t *pairs = NULL;
+    uint64_t *lengths = NULL;
+
+    if (index == NULL) {
+        return NULL;
+    }
+    index->count = count;
+
+    for (size_t i = 0; i < count; i++) {
+        size_t length = strlen(names[i]);
+        total += length + 1;
+        pair_count += length >= 3 ? length - 2 : 0;
+    }
+
+    index->names = malloc(total ? total : 1);
+    index->offsets = malloc((count + 1) * sizeof(*index->offsets));
+    index->order = malloc((count ? count : 1) * sizeof(*index->order));
+    pairs = malloc((pair_count ? pair_count : 1) * sizeof(*pairs));
+    lengths = malloc((count ? count : 1) * sizeof(*lengths));
+    if (index->names == NULL || index->offsets == NULL || index->order == NULL ||
+        pairs == NULL || lengths == NULL) {
+        free(pairs);
+        free(lengths);
+        search_index_free(index);
+        return NULL;
+    }
+
+    // Number the names shortest first, keeping the caller's order for equal lengths
+    for (size_t i = 0; i < count; i++) {
+        lengths[i] = ((uint64_t)strlen(names[i]) << 32) | i;
+    }
+    qsort(lengths, count, sizeof(*lengths), compare_pairs);
+    for (size_t i = 0; i < count; i++) {
+        index->order[i] = (uint32_t)lengths[i];
+    }
+    free(lengths);
+
+    // Lowercase every name and emit a (trigram, name, place) pair for each trigram in it
+    pair_count = 0;
+    for (size_t i = 0, offset = 0; i < count; i++) {
+        char *name = index->names + offset;
+        size_t length = 0;
+
+        for (const char *c = names[index->order[i]]; *c; c++) {
+            name[length++] = tolower((unsigned char)*c);
+        }
+        name[length] = '\0';
+        index->offsets[i] = offset;
+        for (size_t j = 0; j + 3 <= length; j++) {
+            pairs[pair_count++] = ((uint64_t)trigram(name + j) << 32) |
+                                  ((uint64_t)i << PLACE_BITS) | trigram_place(name, j);
+        }
+        offset += length + 1;
+    }
+    index->offsets[count] = total;
+
+    // Sorting the pairs groups them by trigram with the names in order. A name that
+    // repeats a trigram produces several pairs; only the last one, which has the
+    // best place, is kept.
+    qsort(pairs, pair_count, sizeof(*pairs), compare_pairs);
+    for (size_t i = 0; i < pair_count; i++) {
+        if (i + 1 == pair_count || (pairs[i] >> PLACE_BITS) != (pairs[i + 1] >> PLACE_BITS)) {
+            pairs[unique++] = pairs[i];
+        }
+    }
+
+    index->postings = malloc((unique ? unique : 1) * sizeof(*index->postings));
+    index->keys = malloc((unique ? unique : 1) * sizeof(*index->keys));
+    index->starts = malloc((unique + 1) * sizeof(*index->starts));
+    if (index->postings == NULL || index->keys == NULL || index->starts == NULL) {
+        free(pairs);
+        search_index_free(index);
+        return NULL;
+    }
+    for (size_t i = 0; i < unique; i++) {
+        uint32_t key = pairs[i] >> 32;
+        if (index->key_count == 0 || index->keys[index->key_count - 1] != key) {
+            index->keys[index->key_count] = key;
+            index->starts[index->key_count++] = i;
+        }
+        index->postings[i] = (uint32_t)pairs[i];
+    }
+    index->starts[index->key_count] = unique;
+    free(pairs);
+
+    return index;
+}
+
+/**
+ * @brief Find the posting list of a trigram.
+ *
+ * @param length - Set to the number of names containing the trigram.
+ * @return The list, or NULL if no name contains it.
+ */
+static const uint32_t *find_postings(const struct search_index *index, uint32_t key, size_t *length) {
+    size_t low = 0, high = index->key_count;
+
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (index->keys[middle] == key) {
+            *length = index->starts[middle + 1] - index->starts[middle];
+            return index->postings + index->starts[middle];
+        } else if (index->keys[middle] < key) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    *length = 0;
+    return NULL;
+}
+
+/**
+ * @brief Rank two matches. Returns a negative number if a should come before b.
+ */
+static int compare_matches(const void *a, const void *b) {
+    const struct search_match *x = a, *y = b;
+
+    if (x->score != y->score) {
+        return y->score - x->score;
+    }
+    if (x->length != y->length) {
+        return x->length < y->length ? -1 : 1;
+    }
+    return x->id < y->id ? -1 : 1;
+}
+
+/**
+ * @brief Restore the heap below position i. The heap keeps the worst match kept so
+ *        far at the root, so it can be replaced when a better one turns up.
+ */
+static void sift_down(struct search_match *heap, size_t size, size_t i) {
+    while (true) {
+        size_t worst = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < size && compare_matches(&heap[left], &heap[worst]) > 0) {
+            worst = left;
+        }
+        if (right < size && compare_matches(&heap[right], &heap[worst]) > 0) {
+            worst = right;
+        }
+        if (worst == i) {
+            return;
+        }
+        struct search_match swap = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = swap;
+        i = worst;
+    }
+}
+
+static void sift_up(struct search_match *heap, size_t i) {
+    while (i > 0 && compare_matches(&heap[i], &heap[(i - 1) / 2]) > 0) {
+        struct search_match swap = heap[i];
+        heap[i] = heap[(i - 1) / 2];
+        heap[(i - 1) / 2] = swap;
+        i = (i - 1) / 2;
+    }
+}
+
+/**
+ * @brief Find the names that contain every whitespace-separated term of a query,
+ *        ignoring case, best matches first.
+ *
+ * @param index - The index to search.
+ * @param query - The search terms. Leading and trailing whitespace, including the
+ *                newline left by fgets(), is ignored.
+ * @param results - Receives the positions of the matching names.
+ * @param limit - Maximum number of results to return.
+ * @return The number of results.
+ */
+size_t search_index_query(const struct search_index *index, const char *query,
+                          uint32_t *results, size_t limit) {
+    char lowered[MAX_QUERY_LENGTH];
+    char *terms[MAX_QUERY_TERMS];
+    size_t term_count = 0, candidate_count = index->count, kept = 0;
+    const uint32_t *candidates = NULL; // NULL means every name is a candidate
+    bool placed = false; // The candidates' places are those of a term's first trigram
+    int best_score;
+    struct search_match *heap;
+    size_t i;
+
+    // Lowercase the query and split it into terms
+    for (i = 0; query[i] && i < sizeof(lowered) - 1; i++) {
+        lowered[i] = tolower((unsigned char)query[i]);
+    }
+    lowered[i] = '\0';
+    for (char *save, *term = strtok_r(lowered, " \t\r\n", &save);
+         term != NULL && term_count < MAX_QUERY_TERMS;
+         term = strtok_r(NULL, " \t\r\n", &save)) {
+        terms[term_count++] = term;
+    }
+    if (term_count == 0 || limit == 0) {
+        return 0;
+    }
+    best_score = term_count * SCORE_NAME_START;
+
+    // The rarest trigram of any term bounds the set of names that can match
+    for (size_t t = 0; t < term_count; t++) {
+        for (size_t j = 0; j + 3 <= strlen(terms[t]); j++) {
+            size_t length;
+            const uint32_t *postings = find_postings(index, trigram(terms[t] + j), &length);
+            if (postings == NULL) {
+                return 0;
+            }
+            if (candidates == NULL || length < candidate_count) {
+                candidates = postings;
+                candidate_count = length;
+                placed = j == 0;
+            }
+        }
+    }
+
+    heap = malloc(limit * sizeof(*heap));
+    if (heap == NULL) {
+        return 0;
+    }
+
+    // Candidates arrive shortest name first, so a candidate only displaces a kept
+    // match if it scores strictly higher than the worst one
+    for (i = 0; i < candidate_count; i++) {
+        uint32_t id = candidates ? candidates[i] >> PLACE_BITS : (uint32_t)i;
+        const char *name = index->names + index->offsets[id];
+        int score = 0;
+        size_t t;
+
+        if (kept == limit) {
+            // The place of a term's first trigram caps what that term can score
+            int bound = placed ? place_score[candidates[i] & PLACE_MASK] + best_score - SCORE_NAME_START
+                               : best_score;
+            if (heap[0].score == best_score) {
+                break; // Nothing later can beat a full set of perfect matches
+            }
+            if (bound <= heap[0].score) {
+                continue;
+            }
+        }
+
+        for (t = 0; t < term_count; t++) {
+            const char *found = strstr(name, terms[t]);
+            if (found == NULL) {
+                break;
+            }
+            if (found == name) {
+                score += SCORE_NAME_START;
+            } else if (!isalnum((unsigned char)found[-1])) {
+                score += SCORE_WORD_START;
+            } else {
+                score += SCORE_INSIDE;
+            }
+        }
+        if (t < term_count) {
+            continue;
+        }
+
+        struct search_match match = {
+            index->order[id], index->offsets[id + 1] - index->offsets[id] - 1, score
+        };
+        if (kept < limit) {
+            heap[kept] = match;
+            sift_up(heap, kept++);
+        } else if (score > heap[0].score) {
+            heap[0] = match;
+            sift_down(heap, kept, 0);
+        }
+    }
+
+    qsort(heap, kept, sizeof(*heap), compare_matches);
+    for (i = 0; i < kept; i++) {
+        results[i] = heap[i].id;
+    }
+
+    free(heap);
+    return kept;
+}
+
+/**
+ * @brief Free an index.
+ */
+void search_index_free(struct search_index *index) {
+    if (index == NULL) {
+        return;
+    }
+    free(index->names);
+    free(index->offsets);
+    free(index->order);
+    free(index->keys);
+    free(index->starts);
+    free(index->postings);
+    free(index);
+}
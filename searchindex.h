@@ -0,0 +1,15 @@
+#ifndef _SEARCHINDEX_H
+#define _SEARCHINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A trigram index for case-insensitive substring search over a list of names
+struct search_index;
+
+struct search_index *search_index_build(const char *const *names, size_t count);
+size_t search_index_query(const struct search_index *index, const char *query,
+                          uint32_t *results, size_t limit);
+void search_index_free(struct search_index *index);
+
+#endif
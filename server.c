@@ -12,6 +12,7 @@
 *          - Listing available MP3 files in the server directory.
 *          - Searching for MP3 files based on a user-provided search term.
 *          - Downloading an MP3 file and sending its SHA-256 hash to the client for verification.
+*          - Sending just the SHA-256 hash of an MP3 file, to validate a copy the client has.
 *
 *         The SSL/TLS connection ensures that communication between the client and the server
 *         is encrypted and secure. To generate a self-signed certificate and private key that 
@@ -26,15 +27,64 @@
 *         These files are necessary for the server's SSL/TLS encryption. The client does not
 *         need these files, as they are only used by the server to establish secure connections.
 *
-*         The server supports multiple clients concurrently by spawning a separate thread
-*         for each connection. The server ensures data integrity by computing the SHA-256 
-*         hash of each MP3 file before sending it to the client, allowing the client to 
-*         verify the download.
+*         A single SSL context is shared by every connection. It keeps a server-side
+*         session cache and issues stateless session tickets so returning clients can
+*         resume instead of repeating the full handshake. A background thread watches
+*         the certificate and key files and swaps in a freshly loaded context when
+*         they change, so certificates can be rotated without a restart.
+*
+*         Connections are accepted, handshaken and read by a single epoll event loop on
+*         non-blocking sockets. Once a request has arrived, the connection is handed to a
+*         fixed-size pool of worker threads that does the blocking work of answering it,
+*         so thread count and memory use stay flat however many clients are connected.
+*         The listen backlog, worker count, queue depth and handshake timeout can all be
+*         set on the command line (run with --help).
+*
+*         The server ensures data integrity by sending the SHA-256 hash of each MP3
+*         file along with it, allowing the client to verify the download.
+*         The hashes are computed for the whole library at startup and kept up to date
+*         as files change (see library.c), so a download does not re-hash the file.
+*         The most popular files are also kept in memory (see contentcache.c), so a
+*         download of one of them does not read the disk either.
+*
+*         A client that puts BLOCKS before the name of a DOWNLOAD, RANGE or HASH also
+*         gets the file's block hashes (see blockhash.c) ahead of the body, so it can
+*         check each 64 KB block as it arrives and fetch again only the ones that
+*         were damaged. They are built along with the library's digests and kept
+*         with them.
+*
+*         With --acceptors N the server opens N listening sockets on the same port
+*         with SO_REUSEPORT, and the kernel spreads new connections across them.
+*         Each socket has its own event loop: on its own thread sharing one set of
+*         worker pools (the "threads" process model), or in its own forked process
+*         with everything else (the "prefork" model). Acceptors can be pinned to
+*         CPUs so each one accepts and handshakes on a core of its own.
+*
+*         With --early-data, clients resuming a session may send LIST or SEARCH as
+*         TLS 1.3 early data. Those are answered straight away, before the handshake
+*         finishes, so the reply travels with the server's first flight. They only
+*         read, so a replayed copy does no harm; any other request that arrives as
+*         early data waits for the handshake to finish, which a replay never does.
+*
+*         Downloads (DOWNLOAD and RANGE) are answered by a pool of their own with a
+*         short queue, so bulk transfers can never hold up LIST, SEARCH and HASH, and
+*         can be paced by per-connection and per-client bandwidth limits (see
+*         ratelimit.c). A request that finds its pool's queue full is answered at once
+*         with a busy error instead of waiting on an unbounded queue.
+*
+*         Request counts, latency histograms and health checks are served over plain
+*         HTTP on a separate admin port (see metrics.c).
 */
 
 // Header libraries
+#define _GNU_SOURCE // accept4(), CPU affinity
 #include <fcntl.h>
+#include <sched.h>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
@@ -42,13 +92,23 @@
 #include <sys/stat.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
-#include <dirent.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/sha.h>
+#include <openssl/rand.h>
 #include <pthread.h>
 
 #include "CommunicationConstants.h"
+#include "workerpool.h"
+#include "library.h"
+#include "searchindex.h"
+#include "outbuf.h"
+#include "contentcache.h"
+#include "metrics.h"
+#include "ratelimit.h"
+#include "blockhash.h"
 
 // Constants to define buffer sizes, certificate file locations, and directory paths
 #define BUFFER_SIZE       256
@@ -56,26 +116,171 @@
 #define CERTIFICATE_FILE  "cert.pem"
 #define KEY_FILE          "key.pem"
 #define MP3_DIR           "./sample-mp3s"
+#define SEARCH_RESULT_LIMIT 100 // Most names sent back for one SEARCH
+#define FILE_CHUNK_SIZE   (64 * 1024) // Bytes read and written at a time when sending a file
+
+// TLS session resumption and certificate reload settings
+#define SESSION_ID_CONTEXT    "cs469-mp3-server"
+#define SESSION_CACHE_SIZE    20480 // Maximum sessions kept in the server-side cache
+#define SESSION_TIMEOUT       7200  // Seconds a cached session or ticket stays valid
+#define TICKET_KEYS_SIZE      80    // Name, HMAC and AES key for session tickets
+#define CERT_RELOAD_INTERVAL  5     // Seconds between checks for changed certificates
+
+// Connection handling defaults, each of which can be changed on the command line
+#define DEFAULT_BACKLOG       1024 // Pending connections the kernel queues for accept()
+#define DEFAULT_WORKERS       8    // Threads answering requests
+#define DEFAULT_QUEUE_DEPTH   256  // Requests waiting for a free worker
+#define DEFAULT_TIMEOUT       10   // Seconds a client has to finish the handshake and send a request
+#define IO_TIMEOUT            30   // Seconds a worker waits on a client that stops reading
+#define DEFAULT_MAX_REQUESTS  100  // Requests one keep-alive connection may carry (1 turns keep-alive off)
+#define DEFAULT_IDLE_TIMEOUT  15   // Seconds a keep-alive connection may sit idle between requests
+#define MAX_EVENTS            64   // Events handled per epoll_wait() call
+#define DEFAULT_CACHE_SIZE    64   // Megabytes of hot files kept in memory (0 turns the cache off)
+#define CACHE_REPORT_INTERVAL 60   // Seconds between content cache reports
+#define DEFAULT_ADMIN_PORT    9090 // Plain-HTTP port for metrics and health checks (0 turns it off)
+#define DEFAULT_MAX_DOWNLOADS 8    // Downloads sent at once
+#define DEFAULT_DOWNLOAD_QUEUE 32  // Downloads waiting for one of those slots
+#define DEFAULT_ACCEPTORS     1    // Listening sockets, each with its own event loop
+#define MAX_ACCEPTORS         256
+#define RESPAWN_DELAY         1    // Seconds before a prefork child that died is replaced
+
+// How acceptors are run
+enum process_model {
+    PROCESS_THREADS, // One process, an event loop thread per acceptor, shared worker pools
+    PROCESS_PREFORK  // A whole server process per acceptor
+};
+
+// Settings chosen on the command line
+struct server_config {
+    unsigned int port;
+    int backlog;
+    int workers;
+    int queue_depth;
+    int timeout;
+    int max_requests;
+    int idle_timeout;
+    int cache_size;
+    int admin_port;
+    int max_downloads;
+    int download_queue;
+    int client_rate;     // KB/s one client address may download at, 0 for no limit
+    int connection_rate; // KB/s one connection may download at, 0 for no limit
+    int acceptors;
+    enum process_model process_model;
+    bool pin_cpus;       // Pin each acceptor to a CPU of its own
+    bool early_data;     // Accept requests as TLS 1.3 early data
+    bool ktls;
+};
+
+static struct server_config config = {
+    .port = DEFAULT_PORT,
+    .backlog = DEFAULT_BACKLOG,
+    .workers = DEFAULT_WORKERS,
+    .queue_depth = DEFAULT_QUEUE_DEPTH,
+    .timeout = DEFAULT_TIMEOUT,
+    .max_requests = DEFAULT_MAX_REQUESTS,
+    .idle_timeout = DEFAULT_IDLE_TIMEOUT,
+    .cache_size = DEFAULT_CACHE_SIZE,
+    .admin_port = DEFAULT_ADMIN_PORT,
+    .max_downloads = DEFAULT_MAX_DOWNLOADS,
+    .download_queue = DEFAULT_DOWNLOAD_QUEUE,
+    .client_rate = 0,
+    .connection_rate = 0,
+    .acceptors = DEFAULT_ACCEPTORS,
+    .process_model = PROCESS_THREADS,
+    .pin_cpus = false,
+    .early_data = false,
+    .ktls = false,
+};
+
+// Where a connection is in its life. The event loop owns connections that are
+// handshaking or reading; a worker owns a connection while answering its request.
+// A keep-alive connection goes back to the event loop to wait for its next request.
+enum connection_state {
+    CONN_HANDSHAKE,
+    CONN_READING,
+    CONN_WORKING
+};
+
+struct connection {
+    int fd;
+    SSL *ssl;
+    enum connection_state state;
+    time_t deadline; // When the event loop gives up on the handshake or request
+    struct timespec accepted; // For the handshake time
+    struct timespec queued;   // When the request was handed to the worker pool
+    bool keep_alive; // The client asked to send more requests on this connection
+    bool early_data; // Still reading TLS 1.3 early data; the handshake is not finished
+    bool early_request; // The request arrived as early data and waits for the handshake
+    bool bulk;       // The request is a download, answered by the download pool
+    int requests;    // Requests answered so far
+    struct rate_limit limit; // Pacing for the connection's downloads
+    struct event_loop *loop;
+    char request[BUFFER_SIZE];
+    struct connection *prev; // Event loop's list of connections it is waiting on
+    struct connection *next;
+};
+
+// The epoll instance, listening socket and connections handled by the event loop.
+// Workers hand keep-alive connections back, so the list is guarded by a lock.
+// There is one event loop per acceptor; they share the worker pools.
+struct event_loop {
+    int epfd;
+    int server_socket;
+    int cpu;                       // CPU the loop's thread is pinned to, -1 for none
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct connection *connections;
+    struct worker_pool *workers;   // Answers metadata requests
+    struct worker_pool *downloads; // Answers DOWNLOAD and RANGE
+};
+
+// Identity of a file on disk, used to detect when the certificate or key is replaced
+struct file_identity {
+    ino_t inode;
+    off_t size;
+    time_t mtime;
+};
+
+// The shared SSL context. Connections take their own reference through
+// acquire_server_context() so a reload never frees a context that is in use.
+static SSL_CTX *server_ctx = NULL;
+static pthread_mutex_t server_ctx_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Session ticket keys are kept across reloads so tickets issued before a
+// certificate rotation can still be used to resume afterwards.
+static unsigned char ticket_keys[TICKET_KEYS_SIZE];
+static bool ticket_keys_set = false;
 
 // Function declarations
-void list_files(SSL *ssl);
-void search_files(SSL *ssl, const char *search_term);
-void send_file_with_hash(SSL *ssl, const char *filename);
-void *handle_client(void *client_socket);
+void list_files(struct outbuf *out);
+void search_files(struct outbuf *out, const char *search_term);
+void send_file_with_hash(struct outbuf *out, const char *argument);
+void send_file_range_with_hash(struct outbuf *out, const char *argument);
+void send_hash(struct outbuf *out, const char *argument);
+void run_event_loop(struct event_loop *loop);
+void serve_connection(void *arg);
 void init_openssl();
 void cleanup_openssl();
 SSL_CTX* create_new_context();
-void configure_context(SSL_CTX* ssl_ctx);
-void handle_rpc_request(SSL *ssl);
+bool configure_context(SSL_CTX* ssl_ctx);
+SSL_CTX* acquire_server_context();
+bool reload_server_context();
+void *watch_certificates(void *arg);
+void handle_rpc_request(struct outbuf *out, const char *request);
+void *report_cache_stats(void *arg);
 
 /**
  * @brief Creates a TCP socket and binds it to the specified port.
  *        The server listens for incoming client connections on this socket.
  * 
  * @param port - The port number to bind the server to.
+ * @param backlog - How many pending connections the kernel may queue.
+ * @param reuse_port - true to share the port with other listening sockets, each
+ *                     of which gets its own share of the new connections.
  * @return Socket descriptor to be used for communication.
  */
-int create_socket(unsigned int port) {
+int create_socket(unsigned int port, int backlog, bool reuse_port) {
     int s;
     struct sockaddr_in addr;
     
@@ -91,18 +296,27 @@ int create_socket(unsigned int port) {
         exit(EXIT_FAILURE);
     }
 
+    if (reuse_port && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &(int){ 1 }, sizeof(int)) < 0) {
+        perror("Unable to set SO_REUSEPORT");
+        exit(EXIT_FAILURE);
+    }
+
     // Bind the socket to the specified port and network interface
     if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         perror("Unable to bind to socket");
         exit(EXIT_FAILURE);
     }
 
-    // Set the socket to listen for incoming connections with a backlog of 5 clients
-    if (listen(s, 5) < 0) {
+    // Set the socket to listen for incoming connections. The kernel silently caps
+    // the backlog at net.core.somaxconn.
+    if (listen(s, backlog) < 0) {
         perror("Unable to listen");
         exit(EXIT_FAILURE);
     }
 
+    // The event loop accepts until the queue is drained, so accept() must not block
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+
     return s; // Return the socket descriptor
 }
 
@@ -146,240 +360,1738 @@ SSL_CTX* create_new_context() {
     return ctx; // Return the created SSL context
 }
 
+/**
+ * @brief ALPN callback: pick the framed protocol if the client offers it. Clients
+ *        that offer something else, or no ALPN at all, get the text protocol.
+ */
+static int select_protocol(SSL *ssl, const unsigned char **out, unsigned char *out_length,
+                           const unsigned char *in, unsigned int in_length, void *arg) {
+    (void)ssl; (void)arg;
+    if (SSL_select_next_proto((unsigned char **)out, out_length, RPC_ALPN_PROTOCOLS,
+                              sizeof(RPC_ALPN_PROTOCOLS) - 1, in, in_length) == OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_OK;
+    }
+    return SSL_TLSEXT_ERR_NOACK;
+}
+
 /**
  * @brief Configure the SSL context with the server's certificate and private key.
  *        This ensures that SSL/TLS encryption is properly set up for the server.
+ *        The context is also set up for session resumption: a server-side session
+ *        cache for session IDs and stateless tickets that share one set of keys.
  * 
  * @param ctx - The SSL_CTX object to configure.
+ * @return true if the certificate and key were loaded and match, false otherwise.
  */
-void configure_context(SSL_CTX* ctx) {
+bool configure_context(SSL_CTX* ctx) {
     SSL_CTX_set_ecdh_auto(ctx, 1); // Automatically select the best elliptic curve
 
     // Load the server's certificate for SSL/TLS
     if (SSL_CTX_use_certificate_file(ctx, CERTIFICATE_FILE, SSL_FILETYPE_PEM) <= 0) {
         ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
+        return false;
     }
 
     // Load the private key corresponding to the server's certificate
     if (SSL_CTX_use_PrivateKey_file(ctx, KEY_FILE, SSL_FILETYPE_PEM) <= 0 ) {
         ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
+        return false;
+    }
+
+    // Agree on the framed protocol with clients that offer it
+    SSL_CTX_set_alpn_select_cb(ctx, select_protocol, NULL);
+
+    // Let OpenSSL hand encryption over to the kernel, so files can be sent with
+    // SSL_sendfile(). OpenSSL falls back to user-space TLS if the kernel or the
+    // negotiated cipher does not support it.
+#ifdef SSL_OP_ENABLE_KTLS
+    if (config.ktls) {
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
     }
+#endif
+
+    // Catch a certificate and key that do not belong together, e.g. when only one
+    // of the two files has been replaced so far during a rotation
+    if (SSL_CTX_check_private_key(ctx) != 1) {
+        ERR_print_errors_fp(stderr);
+        return false;
+    }
+
+    // Cache sessions on the server so clients can resume by session ID
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, SESSION_TIMEOUT);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *)SESSION_ID_CONTEXT,
+                                   strlen(SESSION_ID_CONTEXT));
+
+    // Tickets say how much early data a resuming client may send: enough for a request
+    if (config.early_data) {
+        SSL_CTX_set_max_early_data(ctx, BUFFER_SIZE - 1);
+        SSL_CTX_set_recv_max_early_data(ctx, BUFFER_SIZE - 1);
+    }
+
+    // Every context uses the ticket keys of the first one, so a reload does not
+    // invalidate the tickets clients are holding
+    if (!ticket_keys_set) {
+        if (SSL_CTX_get_tlsext_ticket_keys(ctx, ticket_keys, sizeof(ticket_keys)) == 1) {
+            ticket_keys_set = true;
+        }
+    } else if (SSL_CTX_set_tlsext_ticket_keys(ctx, ticket_keys, sizeof(ticket_keys)) != 1) {
+        ERR_print_errors_fp(stderr);
+    }
+
+    return true;
 }
 
 /**
- * @brief Handle each client connection in a separate thread.
- *        This function sets up SSL/TLS for the connection and processes client requests.
+ * @brief Take a reference to the current shared SSL context. The caller must
+ *        release it with SSL_CTX_free() once it no longer needs it; an SSL object
+ *        created from the context holds its own reference.
  * 
- * @param client_socket - The socket descriptor for the client connection.
+ * @return The shared SSL_CTX object.
  */
-void *handle_client(void *client_socket) {
-    int client = *(int*)client_socket;
-    free(client_socket); // Free the dynamically allocated client socket
+SSL_CTX* acquire_server_context() {
+    SSL_CTX *ctx;
 
-    // Create and configure SSL context for the new client connection
-    SSL_CTX* ctx = create_new_context();
-    configure_context(ctx);
+    pthread_mutex_lock(&server_ctx_lock);
+    ctx = server_ctx;
+    SSL_CTX_up_ref(ctx);
+    pthread_mutex_unlock(&server_ctx_lock);
 
-    // Create new SSL object and bind it to the client socket
-    SSL *ssl = SSL_new(ctx);
-    SSL_set_fd(ssl, client);
+    return ctx;
+}
 
-    // Perform the SSL handshake with the client
-    if (SSL_accept(ssl) <= 0) {
-        ERR_print_errors_fp(stderr); // Log any SSL handshake errors
-    } else {
-        // Process the client's request (e.g., list files, search, download)
-        handle_rpc_request(ssl);
+/**
+ * @brief Build a new SSL context from the certificate and key on disk and swap it
+ *        in as the shared context. The old context is freed once the last
+ *        connection using it is done. On failure the current context is kept.
+ * 
+ * @return true if the new context was installed, false otherwise.
+ */
+bool reload_server_context() {
+    SSL_CTX *ctx = create_new_context();
+    SSL_CTX *old_ctx;
+
+    if (!configure_context(ctx)) {
+        SSL_CTX_free(ctx);
+        return false;
     }
 
-    // Cleanup the SSL connection and close the client socket
-    SSL_free(ssl);
-    close(client);
-    SSL_CTX_free(ctx); // Free SSL context for this connection
+    pthread_mutex_lock(&server_ctx_lock);
+    old_ctx = server_ctx;
+    server_ctx = ctx;
+    pthread_mutex_unlock(&server_ctx_lock);
+
+    if (old_ctx != NULL) {
+        SSL_CTX_free(old_ctx); // Drop the server's reference to the old context
+    }
 
-    pthread_exit(NULL); // Exit the thread when done
+    return true;
 }
 
 /**
- * @brief Process and handle client RPC requests. Based on the request, it performs
- *        operations like listing available MP3 files, searching for files, or
- *        downloading a file with its hash.
+ * @brief Read the identity of a file so changes to it can be detected.
  * 
- * @param ssl - The SSL object used for secure communication with the client.
+ * @param path - The file to check.
+ * @param identity - Filled in with the file's inode, size and modification time.
  */
-void handle_rpc_request(SSL *ssl) {
-    char buffer[BUFFER_SIZE]; // Buffer to store client request
-    char operation[BUFFER_SIZE]; // Buffer for the operation (LIST, SEARCH, etc.)
-    char argument[BUFFER_SIZE]; // Buffer for any arguments (e.g., filename or search term)
-    char errorMsg[BUFFER_SIZE]; // Buffer for error messages
-    int scanned_items;
+static void get_file_identity(const char *path, struct file_identity *identity) {
+    struct stat st;
 
-    // Read the client's request via SSL
-    SSL_read(ssl, buffer, BUFFER_SIZE);
+    memset(identity, 0, sizeof(*identity));
+    if (stat(path, &st) == 0) {
+        identity->inode = st.st_ino;
+        identity->size = st.st_size;
+        identity->mtime = st.st_mtime;
+    }
+}
 
-    // Parse the operation and arguments from the request
-    scanned_items = sscanf(buffer, "%s %[^\n]", operation, argument);
+/**
+ * @brief Thread that polls the certificate and key files and reloads the shared
+ *        SSL context when either of them changes. stat() follows symlinks, so this
+ *        also picks up the symlink swap Kubernetes uses to update mounted secrets.
+ * 
+ * @param arg - Unused.
+ */
+void *watch_certificates(void *arg) {
+    struct file_identity cert, key, current_cert, current_key;
 
-    // Handle LIST operation (no arguments required)
-    if (scanned_items == 1) {
-        if (strcmp(operation, RPC_LIST_OPERATION) == 0) {
-            list_files(ssl); // Send a list of available MP3 files to the client
-        } else {
-            // If operation is missing arguments, send an error to the client
-            sprintf(errorMsg, "%s %d", ERROR_RPC_ERROR, RPC_ERROR_TOO_FEW_ARGS);
-            SSL_write(ssl, errorMsg, sizeof(errorMsg));
+    (void)arg;
+    get_file_identity(CERTIFICATE_FILE, &cert);
+    get_file_identity(KEY_FILE, &key);
+
+    while (true) {
+        sleep(CERT_RELOAD_INTERVAL);
+
+        get_file_identity(CERTIFICATE_FILE, &current_cert);
+        get_file_identity(KEY_FILE, &current_key);
+        if (memcmp(&cert, &current_cert, sizeof(cert)) == 0 &&
+            memcmp(&key, &current_key, sizeof(key)) == 0) {
+            continue;
         }
-    } else if (scanned_items == 2) { // If operation has an argument (SEARCH or DOWNLOAD)
-        if (strcmp(operation, RPC_SEARCH_OPERATION) == 0) {
-            search_files(ssl, argument); // Search for files matching the search term
-        } else if (strcmp(operation, RPC_DOWNLOAD_OPERATION) == 0) {
-            send_file_with_hash(ssl, argument); // Send the requested file to the client
+
+        // Remember what was attempted so a mismatched pair is only retried once
+        // the other file changes too
+        cert = current_cert;
+        key = current_key;
+
+        if (reload_server_context()) {
+            printf("Reloaded certificate %s and key %s\n", CERTIFICATE_FILE, KEY_FILE);
         } else {
-            // If operation is invalid, send an error to the client
-            sprintf(errorMsg, "%s %d", ERROR_RPC_ERROR, RPC_ERROR_BAD_OPERATION);
-            SSL_write(ssl, errorMsg, sizeof(errorMsg));
+            fprintf(stderr, "Certificate reload failed, keeping the current certificate\n");
         }
-    } else {
-        // If request is poorly formed, send an error response
-        sprintf(errorMsg, "%s %d", ERROR_RPC_ERROR, RPC_ERROR_TOO_FEW_ARGS);
-        SSL_write(ssl, errorMsg, sizeof(errorMsg));
     }
+
+    return NULL;
 }
 
 /**
- * @brief List all available MP3 files in the MP3 directory and send the list
- *        to the client over the secure SSL connection.
+ * @brief The protocol version a connection agreed on during the handshake.
  * 
- * @param ssl - The SSL object used for secure communication.
+ * @param ssl - The connection.
+ * @return RPC_FRAME_VERSION for framed replies, or 1 for text replies.
  */
-void list_files(SSL *ssl) {
-    DIR *dir = opendir(MP3_DIR); // Open the MP3 directory
-    struct dirent *entry;
-    char fileName[BUFFER_SIZE];
+static int protocol_version(SSL *ssl) {
+    const unsigned char *protocol;
+    unsigned int length;
 
-    if (!dir) {
-        perror("Unable to open mp3 directory"); // Error if directory cannot be opened
-        return;
+    SSL_get0_alpn_selected(ssl, &protocol, &length);
+    if (length == strlen(RPC_ALPN_PROTOCOL) && memcmp(protocol, RPC_ALPN_PROTOCOL, length) == 0) {
+        return RPC_FRAME_VERSION;
     }
+    return 1;
+}
 
-    // Iterate through the directory and send each MP3 file to the client
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_REG && strstr(entry->d_name, ".mp3")) {
-            snprintf(fileName, sizeof(fileName), "%s\n", entry->d_name);
-            SSL_write(ssl, fileName, strlen(fileName));
-        }
+/**
+ * @brief Start a reply on a framed connection by sending its header. Text
+ *        connections have no header, so nothing is sent for them.
+ * 
+ * @param out - The output buffer for the client's connection.
+ * @param body_length - Bytes of body that will follow.
+ * @param file_size - Size of the whole file, for DOWNLOAD and RANGE.
+ * @param offset - Where in the file the body starts, for RANGE.
+ * @param flags - RPC_FLAG_HASH_TRAILER if the file's hash follows the body.
+ */
+static void reply_header(struct outbuf *out, uint64_t body_length, uint64_t file_size,
+                         uint64_t offset, uint16_t flags) {
+    struct rpc_frame_header header = {
+        .magic = RPC_FRAME_MAGIC,
+        .version = RPC_FRAME_VERSION,
+        .status = RPC_STATUS_OK,
+        .flags = flags,
+        .body_length = body_length,
+        .file_size = file_size,
+        .offset = offset,
+    };
+    unsigned char wire[RPC_FRAME_HEADER_SIZE];
+
+    if (protocol_version(out->ssl) == RPC_FRAME_VERSION) {
+        rpc_frame_encode(&header, wire);
+        outbuf_write(out, wire, sizeof(wire));
+    }
+}
+
+/**
+ * @brief Send an error reply: a header with the error's status and code on a framed
+ *        connection, or "FILEERROR <errno>" / "RPCERROR <code>" on a text one.
+ * 
+ * @param out - The output buffer for the client's connection.
+ * @param status - RPC_STATUS_FILE_ERROR or RPC_STATUS_RPC_ERROR.
+ * @param error - The errno value or RPC_ERROR code.
+ */
+static void reply_error(struct outbuf *out, enum rpc_status status, int error) {
+    struct rpc_frame_header header = {
+        .magic = RPC_FRAME_MAGIC,
+        .version = RPC_FRAME_VERSION,
+        .status = status,
+        .error = error,
+    };
+    unsigned char wire[RPC_FRAME_HEADER_SIZE];
+
+    out->status = status;
+    out->error = error;
+    if (protocol_version(out->ssl) == RPC_FRAME_VERSION) {
+        rpc_frame_encode(&header, wire);
+        outbuf_write(out, wire, sizeof(wire));
+    } else {
+        outbuf_printf(out, "%s %d", status == RPC_STATUS_FILE_ERROR ? ERROR_FILE_ERROR : ERROR_RPC_ERROR, error);
     }
+}
+
+/**
+ * @brief Answer a conditional DOWNLOAD or RANGE whose hash matched: a header with no
+ *        body on a framed connection, or "NOTMODIFIED <file size>" on a text one.
+ * 
+ * @param out - The output buffer for the client's connection.
+ * @param file_size - Size of the whole file.
+ */
+static void reply_not_modified(struct outbuf *out, uint64_t file_size) {
+    struct rpc_frame_header header = {
+        .magic = RPC_FRAME_MAGIC,
+        .version = RPC_FRAME_VERSION,
+        .status = RPC_STATUS_NOT_MODIFIED,
+        .file_size = file_size,
+    };
+    unsigned char wire[RPC_FRAME_HEADER_SIZE];
 
-    closedir(dir); // Close the directory when done
+    out->status = RPC_STATUS_NOT_MODIFIED;
+    if (protocol_version(out->ssl) == RPC_FRAME_VERSION) {
+        rpc_frame_encode(&header, wire);
+        outbuf_write(out, wire, sizeof(wire));
+    } else {
+        outbuf_printf(out, "%s %llu\n", RPC_NOT_MODIFIED, (unsigned long long)file_size);
+    }
 }
 
 /**
- * @brief Search for MP3 files that match the provided search term and send the results
- *        to the client.
+ * @brief Split an "IF-NONE-MATCH <hash>" condition off the front of a file name.
  * 
- * @param ssl - The SSL object used for secure communication.
- * @param search_term - The term to search for in the file names.
+ * @param argument - The file name, possibly with a condition in front of it.
+ * @param hash - Set to the client's hash if there is a condition.
+ * @param conditional - Set to whether there is a condition.
+ * @return The file name.
+ */
+static const char *parse_condition(const char *argument, unsigned char hash[HASH_SIZE], bool *conditional) {
+    size_t prefix = strlen(RPC_IF_NONE_MATCH);
+
+    *conditional = strncmp(argument, RPC_IF_NONE_MATCH, prefix) == 0 && argument[prefix] == ' ' &&
+                   rpc_hash_from_hex(argument + prefix + 1, hash) && argument[prefix + 1 + 2 * HASH_SIZE] == ' ';
+    return *conditional ? argument + prefix + 2 + 2 * HASH_SIZE : argument;
+}
+
+/**
+ * @brief Split a "BLOCKS" request for block hashes off the front of a file name.
+ *        Only framed replies can carry them, so on a text connection it is dropped.
+ * 
+ * @param out - The output buffer for the client's connection.
+ * @param argument - The file name, possibly with BLOCKS and a condition in front of it.
+ * @param blocks - Set to whether the reply should carry block hashes.
+ * @return The rest of the argument.
+ */
+static const char *parse_blocks(struct outbuf *out, const char *argument, bool *blocks) {
+    size_t prefix = strlen(RPC_BLOCK_HASHES);
+    bool requested = strncmp(argument, RPC_BLOCK_HASHES, prefix) == 0 && argument[prefix] == ' ';
+
+    *blocks = requested && protocol_version(out->ssl) == RPC_FRAME_VERSION;
+    return requested ? argument + prefix + 1 : argument;
+}
+
+/**
+ * @brief Get the block hashes of an open file: the library's if they were built
+ *        from this exact file, or else built now and kept in the library for the
+ *        next request for this version of the file.
+ * 
+ * @return The tree, to release when done, or NULL if it could not be built.
+ */
+static struct block_tree *file_blocks(const char *filename, int fd, const struct stat *st) {
+    struct block_tree *tree = library_get_blocks(filename, st);
+
+    if (tree == NULL && (tree = library_hash_blocks(fd, st->st_size)) != NULL) {
+        library_keep_blocks(filename, st, tree);
+    }
+    return tree;
+}
+
+/**
+ * @brief Get the block hashes of a file in the content cache, built from the
+ *        cached bytes, and kept, if the library has none for that version of the file.
  */
-void search_files(SSL *ssl, const char *search_term) {
-    DIR *dir = opendir(MP3_DIR); // Open the MP3 directory
-    struct dirent *entry;
-    char fileName[BUFFER_SIZE];
+static struct block_tree *cached_blocks(const char *filename, const struct content_entry *cached) {
+    struct stat st = { .st_ino = cached->inode, .st_size = cached->size, .st_mtim = cached->mtime };
+    struct block_tree *tree = library_get_blocks(filename, &st);
+
+    if (tree == NULL && (tree = block_tree_hash_memory(cached->data, cached->size)) != NULL) {
+        library_keep_blocks(filename, &st, tree);
+    }
+    return tree;
+}
 
-    if (!dir) {
-        perror("Unable to open mp3 directory");
+/**
+ * @brief Send the block hashes that follow a header with RPC_FLAG_BLOCK_HASHES, and
+ *        drop the reference to them. Does nothing if there are none.
+ */
+static void send_block_tree(struct outbuf *out, struct block_tree *tree) {
+    if (tree == NULL) {
         return;
     }
+    if (outbuf_write(out, tree->root, BLOCK_HASH_SIZE) && tree->count > 0) {
+        outbuf_write(out, tree->leaves, tree->count * BLOCK_HASH_SIZE);
+    }
+    block_tree_release(tree);
+}
+
+/**
+ * @brief The header flags for a reply that may carry block hashes.
+ */
+static uint16_t block_flags(const struct block_tree *tree) {
+    return tree != NULL ? RPC_FLAG_BLOCK_HASHES : 0;
+}
+
+/**
+ * @brief Free a connection's SSL object and close its socket. Closing the socket
+ *        also removes it from the epoll instance.
+ * 
+ * @param conn - The connection to close.
+ */
+static void close_connection(struct connection *conn) {
+    // Send close_notify so the session stays resumable. This is only attempted
+    // once and never waits on a non-blocking socket.
+    if (conn->state != CONN_HANDSHAKE) {
+        SSL_shutdown(conn->ssl);
+    } else {
+        metrics_handshake(&conn->accepted, false);
+    }
+    metrics_connection_closed();
+    rate_limit_close(&conn->limit);
+    SSL_free(conn->ssl);
+    close(conn->fd);
+    free(conn);
+}
+
+/**
+ * @brief Remove a connection from the event loop's list. The caller holds the lock.
+ */
+static void unlink_connection(struct event_loop *loop, struct connection *conn) {
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        loop->connections = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    conn->prev = conn->next = NULL;
+}
+
+/**
+ * @brief Add or remove a connection from the list the event loop checks for timeouts.
+ */
+static void track_connection(struct event_loop *loop, struct connection *conn) {
+    pthread_mutex_lock(&loop->lock);
+    conn->prev = NULL;
+    conn->next = loop->connections;
+    if (loop->connections != NULL) {
+        loop->connections->prev = conn;
+    }
+    loop->connections = conn;
+    pthread_mutex_unlock(&loop->lock);
+}
+
+static void untrack_connection(struct event_loop *loop, struct connection *conn) {
+    pthread_mutex_lock(&loop->lock);
+    unlink_connection(loop, conn);
+    pthread_mutex_unlock(&loop->lock);
+}
+
+/**
+ * @brief Ask epoll for a single notification when the connection's socket becomes
+ *        readable or writable. EPOLLONESHOT guarantees only one thread handles a
+ *        connection at a time.
+ * 
+ * @param loop - The event loop.
+ * @param conn - The connection to wait on.
+ * @param events - EPOLLIN or EPOLLOUT, depending on what OpenSSL is waiting for.
+ * @param add - true the first time the socket is registered.
+ */
+static void watch_connection(struct event_loop *loop, struct connection *conn, uint32_t events, bool add) {
+    struct epoll_event ev = { .events = events | EPOLLONESHOT, .data.ptr = conn };
+
+    epoll_ctl(loop->epfd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/**
+ * @brief Accept every pending connection on the listening socket and start the
+ *        TLS handshake for each of them.
+ * 
+ * @param loop - The event loop.
+ */
+static void accept_connections(struct event_loop *loop) {
+    while (true) {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        int client = accept4(loop->server_socket, (struct sockaddr*)&addr, &len,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Unable to accept connection");
+            }
+            return;
+        }
 
-    // Iterate through the directory and send files that match the search term
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_REG && strstr(entry->d_name, search_term) && strstr(entry->d_name, ".mp3")) {
-            snprintf(fileName, sizeof(fileName), "%s\n", entry->d_name);
-            SSL_write(ssl, fileName, strlen(fileName));
+        struct connection *conn = calloc(1, sizeof(*conn));
+        if (conn == NULL) {
+            perror("Unable to allocate connection");
+            close(client);
+            continue;
         }
+
+        // Create new SSL object from the shared context and bind it to the client socket
+        SSL_CTX* ctx = acquire_server_context();
+        conn->ssl = SSL_new(ctx);
+        SSL_CTX_free(ctx); // The SSL object keeps its own reference to the context
+        SSL_set_fd(conn->ssl, client);
+        SSL_set_accept_state(conn->ssl);
+
+        conn->fd = client;
+        conn->loop = loop;
+        conn->state = CONN_HANDSHAKE;
+        conn->early_data = config.early_data;
+        conn->deadline = time(NULL) + config.timeout;
+        clock_gettime(CLOCK_MONOTONIC, &conn->accepted);
+        rate_limit_open(&conn->limit, addr.sin_addr);
+        metrics_connection_opened();
+        track_connection(loop, conn);
+        watch_connection(loop, conn, EPOLLIN, true);
     }
+}
 
-    closedir(dir); // Close the directory when done
+static bool is_bulk_request(const char *request) {
+    enum metrics_operation operation = metrics_operation_of(request);
+
+    return operation == METRICS_DOWNLOAD || operation == METRICS_RANGE;
 }
 
 /**
- * @brief Send the requested MP3 file to the client along with its SHA-256 hash
- *        for integrity verification.
+ * @brief Tell a client the server has no room for its request and close the
+ *        connection. The socket is made non-blocking first: this may run on the
+ *        event loop, which must not wait on a client that is not reading.
  * 
- * @param ssl - The SSL object used for secure communication.
- * @param filename - The name of the file to be sent to the client.
+ * @param conn - The connection whose request was turned away.
  */
-void send_file_with_hash(SSL *ssl, const char *filename) {
-    char filepath[BUFFER_SIZE];
-    snprintf(filepath, sizeof(filepath), "%s/%s", MP3_DIR, filename); // Build the file path
-    FILE *file = fopen(filepath, "rb"); // Open the file for reading in binary mode
+static void reply_busy(struct connection *conn) {
+    struct outbuf out;
+    struct timespec started;
 
-    // If the file doesn't exist, send an error to the client
-    if (!file) {
-        char errorMsg[BUFFER_SIZE];
-        snprintf(errorMsg, sizeof(errorMsg), "%s %d", ERROR_FILE_ERROR, errno);
-        SSL_write(ssl, errorMsg, strlen(errorMsg));
-        return;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+    outbuf_init(&out, conn->ssl, conn->keep_alive && protocol_version(conn->ssl) == 1);
+    reply_error(&out, RPC_STATUS_RPC_ERROR, RPC_ERROR_BUSY);
+    outbuf_end(&out);
+    metrics_request(metrics_operation_of(conn->request), &started, out.status, out.error, out.bytes);
+    metrics_rejected(conn->bulk);
+    close_connection(conn);
+}
+
+/**
+ * @brief Queue a connection's request on the pool that answers its kind of request:
+ *        downloads on the download pool, everything else on the worker pool. If the
+ *        pool's queue is full the client is told to retry later.
+ * 
+ * @param loop - The event loop.
+ * @param conn - The connection, in blocking mode, with its request read.
+ */
+static void submit_request(struct event_loop *loop, struct connection *conn) {
+    conn->bulk = is_bulk_request(conn->request);
+    clock_gettime(CLOCK_MONOTONIC, &conn->queued);
+    if (conn->bulk) {
+        metrics_download_waiting(true);
+    }
+    if (!worker_pool_submit(conn->bulk ? loop->downloads : loop->workers, serve_connection, conn)) {
+        if (conn->bulk) {
+            metrics_download_waiting(false);
+        }
+        reply_busy(conn);
     }
+}
 
-    unsigned char hash[HASH_SIZE]; // Buffer for the file's hash
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256); // Initialize the SHA-256 context
+/**
+ * @brief Hand a connection whose request has arrived to a worker pool. The socket
+ *        is switched back to blocking mode with a timeout, so handlers can write
+ *        their response with plain blocking writes.
+ * 
+ * @param loop - The event loop.
+ * @param conn - The connection to dispatch.
+ */
+static void dispatch_connection(struct event_loop *loop, struct connection *conn) {
+    struct timeval timeout = { .tv_sec = IO_TIMEOUT, .tv_usec = 0 };
+
+    untrack_connection(loop, conn);
+    conn->state = CONN_WORKING;
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) & ~O_NONBLOCK);
+    setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    submit_request(loop, conn);
+}
+
+/**
+ * @brief Whether a request may be answered before the handshake finishes, when it
+ *        could be a replay: only requests that read and change nothing.
+ */
+static bool replay_safe(const char *request) {
+    enum metrics_operation operation = metrics_operation_of(request);
+
+    return operation == METRICS_LIST || operation == METRICS_SEARCH;
+}
+
+/**
+ * @brief Move a connection forward after epoll reports activity on it: read any
+ *        early data, continue the handshake, then read the request, then dispatch
+ *        it to a worker.
+ * 
+ * @param loop - The event loop.
+ * @param conn - The connection with pending activity.
+ */
+static void advance_connection(struct event_loop *loop, struct connection *conn) {
+    int result;
+    size_t length;
+
+    // The first call sends the server's whole first flight, then early data is read
+    // until the client ends it. A request in it comes as a single record, so once
+    // one is waiting anything more is read aside, and ends the connection.
+    while (conn->state == CONN_HANDSHAKE && conn->early_data) {
+        char extra[BUFFER_SIZE];
+
+        if (conn->early_request) {
+            result = SSL_read_early_data(conn->ssl, extra, sizeof(extra), &length);
+        } else {
+            result = SSL_read_early_data(conn->ssl, conn->request, sizeof(conn->request) - 1, &length);
+        }
+        if (result == SSL_READ_EARLY_DATA_FINISH) {
+            conn->early_data = false;
+        } else if (result == SSL_READ_EARLY_DATA_SUCCESS && length > 0 && conn->early_request) {
+            untrack_connection(loop, conn);
+            close_connection(conn);
+            return;
+        } else if (result == SSL_READ_EARLY_DATA_SUCCESS && length > 0) {
+            conn->request[length] = '\0';
+            if (replay_safe(conn->request)) {
+                dispatch_connection(loop, conn); // The worker finishes the handshake
+                return;
+            }
+            conn->early_request = true;
+        } else if (result == SSL_READ_EARLY_DATA_ERROR) {
+            goto would_block;
+        }
+    }
 
-    char buffer[BUFFER_SIZE];
-    int bytes;
-    // Read the file and send it in chunks, while calculating the hash
-    while ((bytes = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
-        SSL_write(ssl, buffer, bytes); // Send the file chunk to the client
-        SHA256_Update(&sha256, buffer, bytes); // Update the hash with the file chunk
+    if (conn->state == CONN_HANDSHAKE) {
+        result = SSL_do_handshake(conn->ssl);
+        if (result != 1) {
+            goto would_block;
+        }
+        conn->state = CONN_READING;
+        metrics_handshake(&conn->accepted, true);
+        if (conn->early_request) {
+            conn->early_request = false;
+            dispatch_connection(loop, conn);
+            return;
+        }
     }
 
-    // Finalize the SHA-256 hash and send it to the client
-    SHA256_Final(hash, &sha256);
-    SSL_write(ssl, hash, HASH_SIZE);
+    // The client's request arrives in a single TLS record
+    result = SSL_read(conn->ssl, conn->request, sizeof(conn->request) - 1);
+    if (result > 0) {
+        conn->request[result] = '\0';
+        dispatch_connection(loop, conn);
+        return;
+    }
 
-    fclose(file); // Close the file when done
+would_block:
+    switch (SSL_get_error(conn->ssl, result)) {
+    case SSL_ERROR_WANT_READ:
+        watch_connection(loop, conn, EPOLLIN, false);
+        break;
+    case SSL_ERROR_WANT_WRITE:
+        watch_connection(loop, conn, EPOLLOUT, false);
+        break;
+    default:
+        ERR_print_errors_fp(stderr); // Log any SSL handshake errors
+        untrack_connection(loop, conn);
+        close_connection(conn);
+        break;
+    }
 }
 
 /**
- * @brief Main server loop: initializes SSL, creates the socket, and handles
- *        incoming client connections by spawning a new thread for each client.
+ * @brief Close connections that did not finish the handshake or send a request in
+ *        time, including keep-alive connections that have sat idle too long.
+ * 
+ * @param loop - The event loop.
  */
-int main(int argc, char **argv) {
-    unsigned int port = (argc == 2) ? atoi(argv[1]) : DEFAULT_PORT; // Use port from args or default
+static void expire_connections(struct event_loop *loop) {
+    time_t now = time(NULL);
 
-    // Initialize the OpenSSL library
-    init_openssl();
-    SSL_CTX* ctx = create_new_context(); // Create SSL context for the server
-    configure_context(ctx); // Load certificate and private key
+    pthread_mutex_lock(&loop->lock);
+    struct connection *conn = loop->connections;
+    while (conn != NULL) {
+        struct connection *next = conn->next;
+        if (conn->deadline <= now) {
+            unlink_connection(loop, conn);
+            close_connection(conn);
+        }
+        conn = next;
+    }
+    pthread_mutex_unlock(&loop->lock);
+}
 
-    // Create the server socket and bind to the specified port
-    int server_socket = create_socket(port);
-    printf("Server is running on port %u\n", port);
+/**
+ * @brief Run the event loop: accept connections, drive their handshakes and read
+ *        their requests without blocking, then pass them to the worker pool.
+ * 
+ * @param loop - The event loop, with its listening socket and worker pool set up.
+ */
+void run_event_loop(struct event_loop *loop) {
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event listen_event = { .events = EPOLLIN, .data.ptr = NULL };
+    time_t last_sweep = time(NULL);
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        perror("Unable to create epoll instance");
+        exit(EXIT_FAILURE);
+    }
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->server_socket, &listen_event);
 
     while (true) {
-        struct sockaddr_in addr;
-        unsigned int len = sizeof(addr);
-        int *client_socket = malloc(sizeof(int)); // Allocate memory for client socket
-
-        // Accept incoming client connections
-        *client_socket = accept(server_socket, (struct sockaddr*)&addr, &len);
-        if (*client_socket < 0) {
-            perror("Unable to accept connection");
-            free(client_socket);
-            continue;
+        // Wake up at least once a second to expire idle connections
+        int count = epoll_wait(loop->epfd, events, MAX_EVENTS, 1000);
+        if (count < 0 && errno != EINTR) {
+            perror("Unable to wait for events");
+            exit(EXIT_FAILURE);
         }
+        metrics_heartbeat();
 
-        // Spawn a new thread to handle each client connection
-        pthread_t tid;
-        pthread_create(&tid, NULL, handle_client, client_socket);
-        pthread_detach(tid); // Automatically clean up the thread when it finishes
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_connections(loop);
+            } else {
+                advance_connection(loop, events[i].data.ptr);
+            }
+        }
+
+        if (time(NULL) != last_sweep) {
+            last_sweep = time(NULL);
+            expire_connections(loop);
+        }
     }
+}
 
-    // Clean up server resources before shutting down
-    close(server_socket);
-    SSL_CTX_free(ctx); // Free the SSL context
+/**
+ * @brief Hand a keep-alive connection back to the event loop to wait for its next
+ *        request, for at most the idle timeout. The worker must not touch the
+ *        connection afterwards.
+ * 
+ * @param conn - The connection to hand back.
+ */
+static void resume_connection(struct connection *conn) {
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+    conn->state = CONN_READING;
+    conn->deadline = time(NULL) + config.idle_timeout;
+    track_connection(conn->loop, conn);
+    watch_connection(conn->loop, conn, EPOLLIN, false);
+}
+
+/**
+ * @brief Turn on keep-alive for a connection that asked for it. The reply tells the
+ *        client how many more requests the connection will carry and how long it may
+ *        sit idle: "OK <max requests> <idle timeout>" on a text connection, which is
+ *        sent before any chunked response, or "<max requests> <idle timeout>" as the
+ *        body of a framed reply. A server with keep-alive turned off answers like a
+ *        server that has never heard of it.
+ * 
+ * @param conn - The connection that sent KEEPALIVE.
+ * @param out - The connection's output buffer.
+ */
+static void start_keep_alive(struct connection *conn, struct outbuf *out) {
+    if (config.max_requests <= 1 || conn->keep_alive) {
+        reply_error(out, RPC_STATUS_RPC_ERROR, RPC_ERROR_BAD_OPERATION);
+        outbuf_flush(out);
+        return;
+    }
+    if (protocol_version(out->ssl) == RPC_FRAME_VERSION) {
+        char limits[BUFFER_SIZE];
+        int length = snprintf(limits, sizeof(limits), "%d %d", config.max_requests, config.idle_timeout);
+        reply_header(out, length, 0, 0, 0);
+        outbuf_write(out, limits, length);
+    } else {
+        outbuf_printf(out, "%s %d %d\n", RPC_OK, config.max_requests, config.idle_timeout);
+    }
+    if (outbuf_flush(out)) {
+        conn->keep_alive = true;
+    }
+}
+
+/**
+ * @brief Finish the handshake of a connection whose request came as early data and
+ *        has been answered. The socket is blocking here, with the I/O timeout.
+ * 
+ * @param conn - The connection.
+ * @return true if the handshake finished.
+ */
+static bool finish_early_handshake(struct connection *conn) {
+    char discard[BUFFER_SIZE];
+    size_t length;
+    int result;
+
+    conn->early_data = false;
+    do {
+        result = SSL_read_early_data(conn->ssl, discard, sizeof(discard), &length);
+    } while (result == SSL_READ_EARLY_DATA_SUCCESS);
+    if (result != SSL_READ_EARLY_DATA_FINISH || SSL_do_handshake(conn->ssl) != 1) {
+        metrics_handshake(&conn->accepted, false);
+        return false;
+    }
+    metrics_handshake(&conn->accepted, true);
+    return true;
+}
+
+/**
+ * @brief Update the gauges when a worker starts or stops answering a connection.
+ */
+static void connection_busy(struct connection *conn, bool busy) {
+    metrics_worker_busy(busy);
+    if (conn->bulk) {
+        if (busy) {
+            metrics_download_waiting(false);
+        }
+        metrics_download_active(busy);
+    }
+}
+
+/**
+ * @brief Worker job that answers the request read by the event loop. The connection
+ *        is then closed, or on a keep-alive connection handed back to the event loop
+ *        until it has carried the most requests allowed. Downloads are paced by the
+ *        connection's rate limits.
+ * 
+ * @param arg - The connection to serve.
+ */
+void serve_connection(void *arg) {
+    struct connection *conn = arg;
+    struct outbuf out;
+    struct timespec started;
+
+    metrics_queue_wait(&conn->queued);
+    connection_busy(conn, true);
+    while (true) {
+        // Process the client's request (e.g., list files, search, download), then
+        // send whatever part of the response is still buffered
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        if (strcmp(conn->request, RPC_KEEPALIVE_OPERATION) == 0) {
+            outbuf_init(&out, conn->ssl, false);
+            start_keep_alive(conn, &out);
+        } else {
+            // Framed replies carry their own length, so only text replies need chunks
+            outbuf_init(&out, conn->ssl, conn->keep_alive && protocol_version(conn->ssl) == 1);
+            if (conn->bulk && rate_limit_enabled()) {
+                out.pace = rate_limit_pace;
+                out.pace_arg = &conn->limit;
+            }
+            out.early_data = conn->early_data;
+            handle_rpc_request(&out, conn->request);
+            outbuf_end(&out);
+            conn->requests++;
+        }
+        metrics_request(metrics_operation_of(conn->request), &started, out.status, out.error, out.bytes);
+
+        // An early-data reply went out ahead of the handshake; the client's Finished
+        // must still be read before the connection can carry on or close cleanly
+        if (conn->early_data && !finish_early_handshake(conn)) {
+            break;
+        }
+
+        if (!conn->keep_alive || out.failed || conn->requests >= config.max_requests) {
+            break;
+        }
+
+        // A client that sent its next request already has it waiting in OpenSSL,
+        // where epoll cannot see it
+        if (!SSL_has_pending(conn->ssl)) {
+            connection_busy(conn, false);
+            resume_connection(conn);
+            return;
+        }
+        int result = SSL_read(conn->ssl, conn->request, sizeof(conn->request) - 1);
+        if (result <= 0) {
+            break;
+        }
+        conn->request[result] = '\0';
+
+        // A download after a metadata request, or the other way round, is answered
+        // by the other pool
+        if (is_bulk_request(conn->request) != conn->bulk) {
+            connection_busy(conn, false);
+            submit_request(conn->loop, conn);
+            return;
+        }
+    }
+    connection_busy(conn, false);
+    close_connection(conn);
+}
+
+/**
+ * @brief Process and handle client RPC requests. Based on the request, it performs
+ *        operations like listing available MP3 files, searching for files, or
+ *        downloading a file with its hash.
+ * 
+ * @param out - The output buffer for the client's connection.
+ * @param request - The request read from the client.
+ */
+void handle_rpc_request(struct outbuf *out, const char *request) {
+    char operation[BUFFER_SIZE]; // Buffer for the operation (LIST, SEARCH, etc.)
+    char argument[BUFFER_SIZE]; // Buffer for any arguments (e.g., filename or search term)
+    int scanned_items;
+
+    // Parse the operation and arguments from the request
+    scanned_items = sscanf(request, "%s %[^\n]", operation, argument);
+
+    // Handle LIST operation (no arguments required)
+    if (scanned_items == 1) {
+        if (strcmp(operation, RPC_LIST_OPERATION) == 0) {
+            list_files(out); // Send a list of available MP3 files to the client
+        } else {
+            // If operation is missing arguments, send an error to the client
+            reply_error(out, RPC_STATUS_RPC_ERROR, RPC_ERROR_TOO_FEW_ARGS);
+        }
+    } else if (scanned_items == 2) { // If operation has an argument (SEARCH or DOWNLOAD)
+        if (strcmp(operation, RPC_SEARCH_OPERATION) == 0) {
+            search_files(out, argument); // Search for files matching the search term
+        } else if (strcmp(operation, RPC_DOWNLOAD_OPERATION) == 0) {
+            send_file_with_hash(out, argument); // Send the requested file, unless the client has it
+        } else if (strcmp(operation, RPC_RANGE_OPERATION) == 0) {
+            send_file_range_with_hash(out, argument); // Send part of the requested file
+        } else if (strcmp(operation, RPC_HASH_OPERATION) == 0) {
+            send_hash(out, argument); // Send only the hash of the requested file
+        } else {
+            // If operation is invalid, send an error to the client
+            reply_error(out, RPC_STATUS_RPC_ERROR, RPC_ERROR_BAD_OPERATION);
+        }
+    } else {
+        // If request is poorly formed, send an error response
+        reply_error(out, RPC_STATUS_RPC_ERROR, RPC_ERROR_TOO_FEW_ARGS);
+    }
+}
+
+/**
+ * @brief List all available MP3 files in the MP3 directory and send the list
+ *        to the client over the secure SSL connection. The list comes ready-made
+ *        from the current library snapshot, so it goes out in as few TLS records
+ *        as possible without touching the directory.
+ * 
+ * @param out - The output buffer for the client's connection.
+ */
+void list_files(struct outbuf *out) {
+    struct library_snapshot *snapshot = library_acquire();
+
+    reply_header(out, snapshot->listing_length, 0, 0, 0);
+    if (snapshot->listing_length > 0) {
+        outbuf_write(out, snapshot->listing, snapshot->listing_length);
+    }
+
+    library_release(snapshot);
+}
+
+/**
+ * @brief Search for MP3 files that match the provided search term and send the results
+ *        to the client. The search ignores case, every whitespace-separated word of
+ *        the term must appear in the name, and the best matches are sent first (see
+ *        searchindex.c). At most SEARCH_RESULT_LIMIT names are sent.
+ * 
+ * @param out - The output buffer for the client's connection.
+ * @param search_term - The term to search for in the file names.
+ */
+void search_files(struct outbuf *out, const char *search_term) {
+    struct library_snapshot *snapshot = library_acquire();
+    uint32_t matches[SEARCH_RESULT_LIMIT];
+    size_t count = search_index_query(snapshot->search, search_term, matches, SEARCH_RESULT_LIMIT);
+    uint64_t length = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        length += snapshot->tracks[matches[i]].name_length + 1;
+    }
+    reply_header(out, length, 0, 0, 0);
+
+    // The output buffer gathers the names into as few records as they fit in
+    for (size_t i = 0; i < count; i++) {
+        const struct library_track *track = &snapshot->tracks[matches[i]];
+        outbuf_write(out, track->name, track->name_length);
+        outbuf_write(out, "\n", 1);
+    }
+    library_release(snapshot);
+}
+
+/**
+ * @brief Send part of a file with SSL_sendfile(). The kernel reads the file and
+ *        encrypts it straight into the socket, so the data is never copied into
+ *        user space. Only works once kernel TLS is active for sending.
+ * 
+ * @param out - The output buffer for the client's connection.
+ * @param fd - The open file.
+ * @param offset - Where in the file to start.
+ * @param length - Number of bytes to send.
+ * @return true if every byte was sent.
+ */
+static bool send_file_ktls(struct outbuf *out, int fd, off_t offset, off_t length) {
+#ifdef SSL_OP_ENABLE_KTLS
+    off_t end = offset + length;
+
+    // Anything already buffered has to go out ahead of the file
+    if (!outbuf_begin_chunk(out, length)) {
+        return false;
+    }
+
+    while (offset < end) {
+        size_t piece = end - offset;
+
+        // A paced reply goes out a chunk at a time so the rate limit can spread it out
+        if (out->pace != NULL) {
+            piece = piece < FILE_CHUNK_SIZE ? piece : FILE_CHUNK_SIZE;
+            out->pace(out->pace_arg, piece);
+        }
+        ossl_ssize_t sent = SSL_sendfile(out->ssl, fd, offset, piece, 0);
+        if (sent <= 0) {
+            return false;
+        }
+        offset += sent;
+        out->bytes += sent;
+    }
+    return true;
+#else
+    (void)out; (void)fd; (void)offset; (void)length;
+    return false;
+#endif
+}
+
+/**
+ * @brief Send part of a file by reading it in large chunks into the output buffer,
+ *        hashing it on the way if a SHA-256 context is given.
+ * 
+ * @param out - The output buffer for the client's connection.
+ * @param fd - The open file.
+ * @param offset - Where in the file to start.
+ * @param length - Number of bytes to send.
+ * @param sha256 - Hash context to update, or NULL if the hash is already known.
+ * @return true if every byte was sent.
+ */
+static bool send_file_buffered(struct outbuf *out, int fd, off_t offset, off_t length, EVP_MD_CTX *sha256) {
+    char *buffer = malloc(FILE_CHUNK_SIZE);
+    off_t end = offset + length;
+    ssize_t bytes = 0;
+
+    if (buffer == NULL) {
+        return false;
+    }
+
+    // Read the file and send it in chunks
+    while (offset < end) {
+        size_t wanted = end - offset < FILE_CHUNK_SIZE ? (size_t)(end - offset) : FILE_CHUNK_SIZE;
+        bytes = pread(fd, buffer, wanted, offset);
+        if (bytes <= 0) { // The file shrank or could not be read
+            break;
+        }
+        if (!outbuf_write(out, buffer, bytes)) { // Send the file chunk to the client
+            break;
+        }
+        // Update the hash with the file chunk
+        if (sha256 != NULL && EVP_DigestUpdate(sha256, buffer, bytes) != 1) {
+            break;
+        }
+        offset += bytes;
+    }
+
+    free(buffer);
+    return offset == end;
+}
+
+/**
+ * @brief Send part of a file whose hash is already known, with SSL_sendfile() when
+ *        kernel TLS is active and through the output buffer otherwise.
+ * 
+ * @param out - The output buffer for the client's connection.
+ * @param fd - The open file.
+ * @param offset - Where in the file to start.
+ * @param length - Number of bytes to send.
+ * @return true if every byte was sent.
+ */
+static bool send_file_range(struct outbuf *out, int fd, off_t offset, off_t length) {
+    if (config.ktls && BIO_get_ktls_send(SSL_get_wbio(out->ssl)) && length <= UINT32_MAX) {
+        return send_file_ktls(out, fd, offset, length);
+    }
+    return send_file_buffered(out, fd, offset, length, NULL);
+}
+
+/**
+ * @brief Look a file up in the content cache, reading it in if it is not there.
+ *
+ * @param filename - The track's name.
+ * @param filepath - Where the track is on disk.
+ * @return A cache entry to release when done, or NULL to read the file directly.
+ */
+static struct content_entry *cached_file(const char *filename, const char *filepath) {
+    struct stat st;
+
+    if (config.cache_size == 0 || stat(filepath, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return NULL;
+    }
+    return content_cache_get(filename, filepath, &st);
+}
+
+/**
+ * @brief Send the requested MP3 file to the client along with its SHA-256 hash
+ *        for integrity verification.
+ *
+ *        With --ktls, and when the kernel has taken over TLS encryption for the
+ *        connection, the file body is sent with SSL_sendfile(). That needs the hash
+ *        to be known up front, which it is for any file the library has indexed.
+ *        Otherwise the file is read in large chunks through the output buffer.
+ *        Files in the content cache are sent from memory instead.
+ *
+ *        With "IF-NONE-MATCH <hash>" before the name, a file that still has that
+ *        hash is answered with "not modified" and no body. With "BLOCKS" in front
+ *        of that, the file's block hashes are sent before the body.
+ * 
+ * @param out - The output buffer for the client's connection.
+ * @param argument - The name of the file to be sent to the client, possibly
+ *        with BLOCKS and a condition in front of it.
+ */
+void send_file_with_hash(struct outbuf *out, const char *argument) {
+    char filepath[BUFFER_SIZE];
+    unsigned char client_hash[HASH_SIZE];
+    struct block_tree *tree = NULL;
+    bool conditional, blocks;
+    const char *filename = parse_condition(parse_blocks(out, argument, &blocks), client_hash, &conditional);
+    snprintf(filepath, sizeof(filepath), "%s/%s", MP3_DIR, filename); // Build the file path
+
+    // Like RANGE, only serve tracks in the library, so a name like "../x" reaches
+    // neither a file outside the MP3 directory nor the content cache
+    if (!library_contains(filename)) {
+        reply_error(out, RPC_STATUS_FILE_ERROR, ENOENT);
+        return;
+    }
+
+    // Popular files are sent straight from memory, with the hash of the cached bytes
+    struct content_entry *cached = cached_file(filename, filepath);
+    if (cached != NULL) {
+        if (conditional && memcmp(client_hash, cached->digest, HASH_SIZE) == 0) {
+            reply_not_modified(out, cached->size);
+        } else {
+            tree = blocks ? cached_blocks(filename, cached) : NULL;
+            reply_header(out, cached->size, cached->size, 0, RPC_FLAG_HASH_TRAILER | block_flags(tree));
+            send_block_tree(out, tree);
+            if (outbuf_write(out, cached->data, cached->size)) {
+                outbuf_write(out, cached->digest, HASH_SIZE);
+            }
+        }
+        content_cache_release(cached);
+        return;
+    }
+
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC); // Open the file for reading
+
+    // If the file doesn't exist, send an error to the client
+    if (fd < 0) {
+        reply_error(out, RPC_STATUS_FILE_ERROR, errno);
+        return;
+    }
+
+    unsigned char hash[HASH_SIZE]; // Buffer for the file's hash
+    struct stat st;
+    bool sent;
+
+    if (fstat(fd, &st) < 0) {
+        reply_error(out, RPC_STATUS_FILE_ERROR, errno);
+        close(fd);
+        return;
+    }
+
+    // Use the precomputed hash if the library has one for this exact file. Only a
+    // file that changed since the library last saw it needs hashing while sending.
+    bool hash_known = library_get_hash(filename, &st, hash);
+
+    // A conditional request needs the hash before deciding whether to send anything
+    if (conditional && !hash_known) {
+        struct stat hashed;
+        hash_known = library_hash_file(filepath, &hashed, hash) && hashed.st_ino == st.st_ino &&
+                     hashed.st_size == st.st_size;
+    }
+    if (conditional && hash_known && memcmp(client_hash, hash, HASH_SIZE) == 0) {
+        reply_not_modified(out, st.st_size);
+        close(fd);
+        return;
+    }
+
+    tree = blocks ? file_blocks(filename, fd, &st) : NULL;
+    reply_header(out, st.st_size, st.st_size, 0, RPC_FLAG_HASH_TRAILER | block_flags(tree));
+    send_block_tree(out, tree);
+    if (hash_known) {
+        sent = send_file_range(out, fd, 0, st.st_size);
+    } else {
+        // The same SHA-256 implementation as the library and the block hashes
+        EVP_MD_CTX *sha256 = EVP_MD_CTX_new();
+        sent = sha256 != NULL && block_digest_init(sha256) &&
+               send_file_buffered(out, fd, 0, st.st_size, sha256) &&
+               EVP_DigestFinal_ex(sha256, hash, NULL) == 1;
+        EVP_MD_CTX_free(sha256);
+    }
+
+    // Send the SHA-256 hash to the client, unless it has stopped listening. If the
+    // file shrank while it was sent, the reply is short of what its header promised,
+    // so the connection has to close.
+    if (sent) {
+        outbuf_write(out, hash, HASH_SIZE);
+    } else {
+        out->failed = true;
+    }
+
+    close(fd); // Close the file when done
+}
+
+/**
+ * @brief Write the header of a RANGE reply in the connection's protocol, followed
+ *        by the block hashes if there are any.
+ */
+static void range_header(struct outbuf *out, long long file_size, long long offset, long long length,
+                         struct block_tree *tree) {
+    if (protocol_version(out->ssl) == RPC_FRAME_VERSION) {
+        reply_header(out, length, file_size, offset, RPC_FLAG_HASH_TRAILER | block_flags(tree));
+        send_block_tree(out, tree);
+    } else {
+        outbuf_printf(out, "%s %lld %lld %lld\n", RPC_OK, file_size, offset, length);
+    }
+}
+
+/**
+ * @brief Answer a RANGE request from a file in the content cache.
+ */
+static void send_cached_range(struct outbuf *out, const char *filename, const struct content_entry *cached,
+                              long long offset, long long length, bool blocks) {
+    if (offset < 0 || length < 0 || offset > cached->size) {
+        reply_error(out, RPC_STATUS_FILE_ERROR, EINVAL);
+        return;
+    }
+    if (length == 0 || length > cached->size - offset) {
+        length = cached->size - offset;
+    }
+
+    range_header(out, cached->size, offset, length, blocks ? cached_blocks(filename, cached) : NULL);
+    if (outbuf_write(out, cached->data + offset, length)) {
+        outbuf_write(out, cached->digest, HASH_SIZE);
+    }
+}
+
+/**
+ * @brief Send part of an MP3 file, so a client can resume a broken download. The
+ *        reply is a header ("OK <file size> <offset> <length>" on text connections),
+ *        then exactly <length> bytes of the file starting at <offset>, then the
+ *        SHA-256 hash of the whole file so the client can check the file it has put
+ *        together.
+ *        A length of 0 means "to the end of the file". An offset equal to the file
+ *        size is allowed and sends only the header and the hash.
+ *        As with DOWNLOAD, "IF-NONE-MATCH <hash>" before the name makes the request
+ *        conditional on the file's hash having changed, and "BLOCKS" asks for the
+ *        block hashes of the whole file ahead of the body.
+ * 
+ * @param out - The output buffer for the client's connection.
+ * @param argument - The request's argument:
+ *        "<offset> <length> [BLOCKS] [IF-NONE-MATCH <hash>] <filename>".
+ */
+void send_file_range_with_hash(struct outbuf *out, const char *argument) {
+    char name_argument[BUFFER_SIZE];
+    char filepath[BUFFER_SIZE];
+    unsigned char hash[HASH_SIZE];
+    unsigned char client_hash[HASH_SIZE];
+    const char *filename;
+    bool conditional, blocks;
+    long long offset, length;
+    struct content_entry *cached;
+    struct stat st;
+    int fd;
+
+    if (sscanf(argument, "%lld %lld %[^\n]", &offset, &length, name_argument) != 3) {
+        reply_error(out, RPC_STATUS_RPC_ERROR, RPC_ERROR_TOO_FEW_ARGS);
+        return;
+    }
+    filename = parse_condition(parse_blocks(out, name_argument, &blocks), client_hash, &conditional);
+
+    // Like HASH, only serve tracks in the library
+    snprintf(filepath, sizeof(filepath), "%s/%s", MP3_DIR, filename);
+    if (!library_contains(filename)) {
+        reply_error(out, RPC_STATUS_FILE_ERROR, ENOENT);
+        return;
+    }
+    if ((cached = cached_file(filename, filepath)) != NULL) {
+        if (conditional && memcmp(client_hash, cached->digest, HASH_SIZE) == 0) {
+            reply_not_modified(out, cached->size);
+        } else {
+            send_cached_range(out, filename, cached, offset, length, blocks);
+        }
+        content_cache_release(cached);
+        return;
+    }
+    if ((fd = open(filepath, O_RDONLY | O_CLOEXEC)) < 0) {
+        reply_error(out, RPC_STATUS_FILE_ERROR, ENOENT);
+        return;
+    }
+    if (fstat(fd, &st) < 0) {
+        reply_error(out, RPC_STATUS_FILE_ERROR, errno);
+        close(fd);
+        return;
+    }
+    if (offset < 0 || length < 0 || offset > st.st_size) {
+        reply_error(out, RPC_STATUS_FILE_ERROR, EINVAL);
+        close(fd);
+        return;
+    }
+    if (length == 0 || length > st.st_size - offset) {
+        length = st.st_size - offset;
+    }
+
+    // The hash covers the whole file, not just the range, so it has to be known
+    // before sending. The watcher may not have caught up with a change yet.
+    if (!library_get_hash(filename, &st, hash)) {
+        struct stat hashed;
+        if (!library_hash_file(filepath, &hashed, hash) || hashed.st_ino != st.st_ino ||
+            hashed.st_size != st.st_size) {
+            reply_error(out, RPC_STATUS_FILE_ERROR, EAGAIN);
+            close(fd);
+            return;
+        }
+    }
+    if (conditional && memcmp(client_hash, hash, HASH_SIZE) == 0) {
+        reply_not_modified(out, st.st_size);
+        close(fd);
+        return;
+    }
+
+    range_header(out, st.st_size, offset, length, blocks ? file_blocks(filename, fd, &st) : NULL);
+    if (send_file_range(out, fd, offset, length)) {
+        outbuf_write(out, hash, HASH_SIZE);
+    } else {
+        out->failed = true; // Short of the promised length, as in send_file_with_hash()
+    }
+    close(fd);
+}
+
+/**
+ * @brief Send the SHA-256 hash of an MP3 file without sending the file itself, so
+ *        the client can validate a copy it already has. With "BLOCKS" before the
+ *        name the block hashes come first, so the client can find which parts of
+ *        its copy differ and fetch only those.
+ * 
+ * @param out - The output buffer for the client's connection.
+ * @param argument - The name of the file whose hash is requested, possibly with
+ *        BLOCKS in front of it.
+ */
+void send_hash(struct outbuf *out, const char *argument) {
+    char filepath[BUFFER_SIZE];
+    unsigned char hash[HASH_SIZE];
+    struct block_tree *tree = NULL;
+    struct stat st;
+    bool blocks;
+    const char *filename = parse_blocks(out, argument, &blocks);
+
+    // Only tracks in the library are hashed, which also keeps the request from
+    // reaching files outside the MP3 directory
+    snprintf(filepath, sizeof(filepath), "%s/%s", MP3_DIR, filename);
+    if (!library_contains(filename) || stat(filepath, &st) < 0) {
+        reply_error(out, RPC_STATUS_FILE_ERROR, ENOENT);
+        return;
+    }
+
+    // The watcher may not have caught up with a change yet; hash it now if so
+    if (!library_get_hash(filename, &st, hash) && !library_hash_file(filepath, &st, hash)) {
+        reply_error(out, RPC_STATUS_FILE_ERROR, errno);
+        return;
+    }
+
+    if (blocks && (tree = library_get_blocks(filename, &st)) == NULL) {
+        int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            tree = file_blocks(filename, fd, &st);
+            close(fd);
+        }
+    }
+
+    // The file size tells the client how many leaves follow
+    reply_header(out, HASH_SIZE, tree != NULL ? tree->size : 0, 0, block_flags(tree));
+    send_block_tree(out, tree);
+    outbuf_write(out, hash, HASH_SIZE);
+}
+
+/**
+ * @brief Print the content cache's counters every CACHE_REPORT_INTERVAL seconds,
+ *        whenever they have changed.
+ */
+void *report_cache_stats(void *arg) {
+    struct content_cache_stats stats, last = { 0 };
+    (void)arg;
+
+    while (true) {
+        sleep(CACHE_REPORT_INTERVAL);
+        content_cache_stats(&stats);
+        if (stats.hits == last.hits && stats.misses == last.misses && stats.bypasses == last.bypasses) {
+            continue;
+        }
+        printf("Content cache: %llu hits, %llu misses, %llu evictions, %llu too large; %zu files, %.1f of %zu MB\n",
+               stats.hits, stats.misses, stats.evictions, stats.bypasses, stats.entries,
+               stats.bytes / (1024.0 * 1024), stats.budget / (1024 * 1024));
+        fflush(stdout);
+        last = stats;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Print the command line options.
+ */
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] [port]\n", program);
+    fprintf(stderr, "  -b, --backlog N      pending connections queued by the kernel (default %d)\n", DEFAULT_BACKLOG);
+    fprintf(stderr, "  -w, --workers N      worker threads answering requests (default %d)\n", DEFAULT_WORKERS);
+    fprintf(stderr, "  -q, --queue-depth N  requests waiting for a free worker (default %d)\n", DEFAULT_QUEUE_DEPTH);
+    fprintf(stderr, "  -t, --timeout S      seconds allowed for handshake and request (default %d)\n", DEFAULT_TIMEOUT);
+    fprintf(stderr, "  -r, --max-requests N requests one keep-alive connection may carry, 1 to disable (default %d)\n", DEFAULT_MAX_REQUESTS);
+    fprintf(stderr, "  -i, --idle-timeout S seconds a keep-alive connection may sit idle (default %d)\n", DEFAULT_IDLE_TIMEOUT);
+    fprintf(stderr, "  -c, --cache-size MB  memory for caching popular files, shared out among prefork processes, 0 to disable (default %d)\n", DEFAULT_CACHE_SIZE);
+    fprintf(stderr, "  -a, --admin-port N   plain-HTTP port for /metrics, /healthz and /readyz, 0 to disable (default %d)\n", DEFAULT_ADMIN_PORT);
+    fprintf(stderr, "  -d, --max-downloads N downloads sent at once (default %d)\n", DEFAULT_MAX_DOWNLOADS);
+    fprintf(stderr, "  -Q, --download-queue N downloads waiting for a free slot before clients are told to retry (default %d)\n", DEFAULT_DOWNLOAD_QUEUE);
+    fprintf(stderr, "  -C, --client-rate KB/s download bandwidth per client address, 0 for unlimited (default 0)\n");
+    fprintf(stderr, "  -R, --connection-rate KB/s download bandwidth per connection, 0 for unlimited (default 0)\n");
+    fprintf(stderr, "  -A, --acceptors N    listening sockets sharing the port with SO_REUSEPORT (default %d)\n", DEFAULT_ACCEPTORS);
+    fprintf(stderr, "  -m, --process-model M threads (an event loop thread per acceptor) or prefork (a process per acceptor) (default threads)\n");
+    fprintf(stderr, "  -p, --pin-cpus       pin each acceptor to a CPU of its own\n");
+    fprintf(stderr, "  -e, --early-data     answer LIST and SEARCH sent as TLS 1.3 early data by resuming clients\n");
+    fprintf(stderr, "  -k, --ktls           send files with kernel TLS and sendfile when available\n");
+}
+
+/**
+ * @brief Parse the command line into the server configuration. The port may be
+ *        given as the only positional argument, as before.
+ */
+static void parse_arguments(int argc, char **argv) {
+    static const struct option options[] = {
+        { "backlog",     required_argument, NULL, 'b' },
+        { "workers",     required_argument, NULL, 'w' },
+        { "queue-depth", required_argument, NULL, 'q' },
+        { "timeout",     required_argument, NULL, 't' },
+        { "max-requests", required_argument, NULL, 'r' },
+        { "idle-timeout", required_argument, NULL, 'i' },
+        { "cache-size",  required_argument, NULL, 'c' },
+        { "admin-port",  required_argument, NULL, 'a' },
+        { "max-downloads", required_argument, NULL, 'd' },
+        { "download-queue", required_argument, NULL, 'Q' },
+        { "client-rate", required_argument, NULL, 'C' },
+        { "connection-rate", required_argument, NULL, 'R' },
+        { "acceptors",   required_argument, NULL, 'A' },
+        { "process-model", required_argument, NULL, 'm' },
+        { "pin-cpus",    no_argument,       NULL, 'p' },
+        { "early-data",  no_argument,       NULL, 'e' },
+        { "ktls",        no_argument,       NULL, 'k' },
+        { "help",        no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "b:w:q:t:r:i:c:a:d:Q:C:R:A:m:pekh", options, NULL)) != -1) {
+        switch (opt) {
+        case 'b': config.backlog = atoi(optarg); break;
+        case 'w': config.workers = atoi(optarg); break;
+        case 'q': config.queue_depth = atoi(optarg); break;
+        case 't': config.timeout = atoi(optarg); break;
+        case 'r': config.max_requests = atoi(optarg); break;
+        case 'i': config.idle_timeout = atoi(optarg); break;
+        case 'c': config.cache_size = atoi(optarg); break;
+        case 'a': config.admin_port = atoi(optarg); break;
+        case 'd': config.max_downloads = atoi(optarg); break;
+        case 'Q': config.download_queue = atoi(optarg); break;
+        case 'C': config.client_rate = atoi(optarg); break;
+        case 'R': config.connection_rate = atoi(optarg); break;
+        case 'A': config.acceptors = atoi(optarg); break;
+        case 'm':
+            if (strcmp(optarg, "threads") == 0) {
+                config.process_model = PROCESS_THREADS;
+            } else if (strcmp(optarg, "prefork") == 0) {
+                config.process_model = PROCESS_PREFORK;
+            } else {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'p': config.pin_cpus = true; break;
+        case 'e': config.early_data = true; break;
+        case 'k': config.ktls = true; break;
+        default:
+            usage(argv[0]);
+            exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if (optind < argc) {
+        config.port = atoi(argv[optind]); // Use port from args or default
+    }
+
+    if (config.backlog <= 0 || config.workers <= 0 || config.queue_depth <= 0 || config.timeout <= 0 ||
+        config.max_requests <= 0 || config.idle_timeout <= 0 || config.cache_size < 0 ||
+        config.admin_port < 0 || config.admin_port > 65535 || config.max_downloads <= 0 ||
+        config.download_queue <= 0 || config.client_rate < 0 || config.connection_rate < 0 ||
+        config.acceptors <= 0 || config.acceptors > MAX_ACCEPTORS) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Each prefork process serves its own metrics, on the ports after the admin port
+    if (config.process_model == PROCESS_PREFORK && config.admin_port > 0 &&
+        config.admin_port + config.acceptors - 1 > 65535) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+#ifndef SSL_OP_ENABLE_KTLS
+    if (config.ktls) {
+        fprintf(stderr, "This OpenSSL build has no kernel TLS support, using SSL_write instead\n");
+        config.ktls = false;
+    }
+#endif
+}
+
+/**
+ * @brief The CPU for an acceptor: the index-th CPU the process may run on, wrapping
+ *        round when there are more acceptors than CPUs.
+ * 
+ * @param index - The acceptor's number.
+ * @return The CPU, or -1 if acceptors are not pinned.
+ */
+static int acceptor_cpu(int index) {
+    cpu_set_t allowed;
+    int seen = 0;
+
+    if (!config.pin_cpus || sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return -1;
+    }
+    index %= CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && seen++ == index) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Keep the calling thread on one CPU. Threads it creates afterwards inherit
+ *        the same affinity.
+ * 
+ * @param cpu - The CPU, or -1 to leave the thread where it is.
+ */
+static void pin_to_cpu(int cpu) {
+    cpu_set_t set;
+
+    if (cpu < 0) {
+        return;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        perror("Unable to pin acceptor to a CPU");
+    }
+}
+
+/**
+ * @brief Thread that runs one acceptor's event loop.
+ * 
+ * @param arg - The acceptor's event loop.
+ */
+static void *run_acceptor(void *arg) {
+    struct event_loop *loop = arg;
+
+    pin_to_cpu(loop->cpu);
+    run_event_loop(loop);
+    return NULL;
+}
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop_acceptors(int signal) {
+    (void)signal;
+    stopping = 1;
+}
+
+/**
+ * @brief Prefork model: fork a server process per acceptor and replace any that
+ *        dies, until the parent is told to stop, which stops the children too.
+ *        Only returns in a child.
+ * 
+ * @return The child's acceptor number.
+ */
+static int prefork_acceptors(void) {
+    struct sigaction action = { .sa_handler = stop_acceptors };
+    pid_t children[MAX_ACCEPTORS];
+
+    // Every process issues and accepts the same session tickets, so a client can
+    // resume with whichever process the kernel hands its next connection to
+    if (RAND_bytes(ticket_keys, sizeof(ticket_keys)) == 1) {
+        ticket_keys_set = true;
+    }
+
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    for (int i = 0; i < config.acceptors; i++) {
+        children[i] = -1;
+    }
+
+    while (!stopping) {
+        for (int i = 0; i < config.acceptors; i++) {
+            if (children[i] > 0) {
+                continue;
+            }
+            children[i] = fork();
+            if (children[i] == 0) {
+                signal(SIGTERM, SIG_DFL);
+                signal(SIGINT, SIG_DFL);
+                return i;
+            } else if (children[i] < 0) {
+                perror("Unable to start acceptor process");
+            }
+        }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == ECHILD) {
+                sleep(RESPAWN_DELAY); // Every fork failed; try again shortly
+            }
+            continue;
+        }
+        for (int i = 0; i < config.acceptors; i++) {
+            if (children[i] == pid) {
+                fprintf(stderr, "Acceptor %d (process %d) exited, starting a new one\n", i, (int)pid);
+                children[i] = -1;
+            }
+        }
+        sleep(RESPAWN_DELAY); // Do not spin if the children keep dying at startup
+    }
+
+    for (int i = 0; i < config.acceptors; i++) {
+        if (children[i] > 0) {
+            kill(children[i], SIGTERM);
+        }
+    }
+    while (wait(NULL) > 0) {
+    }
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * @brief Main server loop: initializes SSL, creates the sockets and worker pools,
+ *        and runs the event loops that handle incoming client connections.
+ */
+int main(int argc, char **argv) {
+    struct event_loop *loops;
+    struct worker_pool *workers;
+    struct worker_pool *downloads;
+    bool prefork;
+    int acceptor = 0; // This process's acceptor in the prefork model
+    int loop_count;
+
+    parse_arguments(argc, argv);
+
+    // A client that disconnects mid-response must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // In the prefork model everything from here on runs in each child, which has a
+    // single acceptor. Pinning the child before it starts any threads keeps its
+    // workers on the same CPU. The library is hashed once in the parent, whose
+    // hashing threads are gone by the time it forks, and the children share it
+    // instead of each hashing every track again.
+    prefork = config.process_model == PROCESS_PREFORK;
+    if (prefork) {
+        if (!library_load(MP3_DIR)) {
+            exit(EXIT_FAILURE);
+        }
+        acceptor = prefork_acceptors();
+        pin_to_cpu(acceptor_cpu(acceptor));
+    }
+    loop_count = prefork ? 1 : config.acceptors;
+
+    // Health checks and metrics come up first, so probes get an answer while the
+    // library is still being hashed (in the prefork model the parent has done that)
+    if (config.admin_port > 0 && !metrics_serve(config.admin_port + acceptor)) {
+        exit(EXIT_FAILURE);
+    }
+    metrics_set_workers(config.workers + config.max_downloads);
+    metrics_set_download_slots(config.max_downloads);
+    rate_limit_configure((size_t)config.client_rate * 1024, (size_t)config.connection_rate * 1024);
+
+    // Initialize the OpenSSL library
+    init_openssl();
+
+    // Create the shared SSL context and load the certificate and private key
+    if (!reload_server_context()) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Reload the certificate in the background whenever it changes on disk
+    pthread_t cert_tid;
+    pthread_create(&cert_tid, NULL, watch_certificates, NULL);
+    pthread_detach(cert_tid);
+
+    // Hash every track up front and keep the hashes current as files change. A
+    // prefork child watches on its own, catching up on anything that changed
+    // since the parent loaded the library.
+    if (!prefork && !library_load(MP3_DIR)) {
+        exit(EXIT_FAILURE);
+    }
+    library_watch();
+
+    // Prefork children each cache on their own, so they split the budget
+    content_cache_init((size_t)config.cache_size * 1024 * 1024 / (prefork ? config.acceptors : 1));
+    if (config.cache_size > 0) {
+        pthread_t report_tid;
+        pthread_create(&report_tid, NULL, report_cache_stats, NULL);
+        pthread_detach(report_tid);
+    }
+
+    // Start the workers that answer requests, and the ones that send downloads
+    workers = worker_pool_create(config.workers, config.queue_depth);
+    downloads = worker_pool_create(config.max_downloads, config.download_queue);
+    if (workers == NULL || downloads == NULL) {
+        fprintf(stderr, "Unable to start worker threads\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Create the server sockets and bind them to the specified port. They are all
+    // bound before any accepts, so a port in use is reported once, up front.
+    loops = calloc(loop_count, sizeof(*loops));
+    if (loops == NULL) {
+        perror("Unable to allocate event loops");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < loop_count; i++) {
+        pthread_mutex_init(&loops[i].lock, NULL);
+        loops[i].workers = workers;
+        loops[i].downloads = downloads;
+        loops[i].server_socket = create_socket(config.port, config.backlog, config.acceptors > 1);
+        loops[i].cpu = prefork ? -1 : acceptor_cpu(i); // A prefork child is pinned already
+    }
+    if (prefork) {
+        printf("Acceptor %d is running on port %u with %d workers and %d download slots\n",
+               acceptor, config.port, config.workers, config.max_downloads);
+    } else {
+        printf("Server is running on port %u with %d acceptor%s, %d workers and %d download slots\n",
+               config.port, config.acceptors, config.acceptors == 1 ? "" : "s", config.workers,
+               config.max_downloads);
+    }
+    if (rate_limit_enabled()) {
+        printf("Downloads limited to %d KB/s per client and %d KB/s per connection (0 = unlimited)\n",
+               config.client_rate, config.connection_rate);
+    }
+    metrics_set_ready(true);
+
+    for (int i = 1; i < loop_count; i++) {
+        pthread_create(&loops[i].thread, NULL, run_acceptor, &loops[i]);
+    }
+    run_acceptor(&loops[0]);
+
+    // Clean up server resources before shutting down
+    for (int i = 0; i < loop_count; i++) {
+        close(loops[i].server_socket);
+    }
+    free(loops);
+    worker_pool_destroy(workers);
+    worker_pool_destroy(downloads);
+    SSL_CTX_free(server_ctx); // Free the shared SSL context
     cleanup_openssl(); // Cleanup OpenSSL
 
     return 0;
@@ -0,0 +1,154 @@
+/**
+* @file workerpool.c
+* @author Corey Brantley, Shen Knoll, Harrison Sherwin
+* @brief  A fixed-size pool of worker threads fed from a bounded job queue. The
+*         server uses it for blocking work (file reads, hashing and writing
+*         responses) so the number of threads, and the memory their stacks use,
+*         stays the same no matter how many clients are connected.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "workerpool.h"
+
+// Worker threads only run request handlers, so they do not need the default 8 MB stack
+#define WORKER_STACK_SIZE (512 * 1024)
+
+struct worker_task {
+    worker_job job;
+    void *arg;
+};
+
+struct worker_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    struct worker_task *queue; // Ring buffer of pending jobs
+    int queue_depth;
+    int head;
+    int count;
+    bool stopping;
+    pthread_t *threads;
+    int thread_count;
+};
+
+/**
+ * @brief Body of each worker thread: take jobs off the queue and run them until
+ *        the pool is destroyed and the queue is empty.
+ *
+ * @param arg - The worker pool.
+ */
+static void *worker_main(void *arg) {
+    struct worker_pool *pool = arg;
+    struct worker_task task;
+
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        }
+        if (pool->count == 0) { // Stopping and nothing left to do
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        task = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->queue_depth;
+        pool->count--;
+        pthread_mutex_unlock(&pool->lock);
+
+        task.job(task.arg);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Start a pool of worker threads.
+ *
+ * @param threads - Number of worker threads to start.
+ * @param queue_depth - Maximum number of jobs waiting for a free worker.
+ * @return The new pool, or NULL if it could not be created.
+ */
+struct worker_pool *worker_pool_create(int threads, int queue_depth) {
+    struct worker_pool *pool = calloc(1, sizeof(*pool));
+    pthread_attr_t attr;
+
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->queue = calloc(queue_depth, sizeof(*pool->queue));
+    pool->threads = calloc(threads, sizeof(*pool->threads));
+    if (pool->queue == NULL || pool->threads == NULL) {
+        free(pool->queue);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    pool->queue_depth = queue_depth;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&pool->threads[i], &attr, worker_main, pool) != 0) {
+            perror("Unable to create worker thread");
+            break;
+        }
+        pool->thread_count++;
+    }
+    pthread_attr_destroy(&attr);
+
+    if (pool->thread_count == 0) {
+        worker_pool_destroy(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+/**
+ * @brief Queue a job to run on one of the pool's threads.
+ *
+ * @param pool - The worker pool.
+ * @param job - The function to run.
+ * @param arg - Argument passed to the function.
+ * @return true if the job was queued, false if the queue is full.
+ */
+bool worker_pool_submit(struct worker_pool *pool, worker_job job, void *arg) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count == pool->queue_depth || pool->stopping) {
+        pthread_mutex_unlock(&pool->lock);
+        return false;
+    }
+    pool->queue[(pool->head + pool->count) % pool->queue_depth] = (struct worker_task){ job, arg };
+    pool->count++;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+
+    return true;
+}
+
+/**
+ * @brief Run every job still in the queue, stop the worker threads and free the pool.
+ *
+ * @param pool - The worker pool.
+ */
+void worker_pool_destroy(struct worker_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->not_empty);
+    free(pool->threads);
+    free(pool->queue);
+    free(pool);
+}
@@ -0,0 +1,15 @@
+#ifndef _WORKERPOOL_H
+#define _WORKERPOOL_H
+
+#include <stdbool.h>
+
+// A fixed set of threads that run jobs from a bounded queue
+struct worker_pool;
+
+typedef void (*worker_job)(void *arg);
+
+struct worker_pool *worker_pool_create(int threads, int queue_depth);
+bool worker_pool_submit(struct worker_pool *pool, worker_job job, void *arg);
+void worker_pool_destroy(struct worker_pool *pool);
+
+#endif